@@ -0,0 +1,219 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A segmented LRU cache of chunk bodies. New chunks enter a probation
+** list and only move to the protected list when they are asked for again,
+** so a long restore that touches each chunk once cycles through probation
+** without evicting the chunks that are genuinely shared. The protected
+** list may use up to PROTECTED_SHARE percent of the budget.
+*/
+#define PROTECTED_SHARE 80
+
+#define LIST_PROBATION 0
+#define LIST_PROTECTED 1
+
+typedef struct cache_entry {
+  sqlite3_int64 chunk_id;
+  unsigned int length;
+  int list;
+  struct cache_entry *prev; /* Towards the most recently used end */
+  struct cache_entry *next;
+  struct cache_entry *hash_next;
+  unsigned char data[1];
+} cache_entry;
+
+typedef struct cache_list {
+  cache_entry *head; /* Most recently used */
+  cache_entry *tail;
+  size_t bytes;
+} cache_list;
+
+struct chunk_cache {
+  pthread_mutex_t lock;
+  size_t budget;
+  cache_list lists[2];
+  cache_entry **buckets;
+  unsigned int bucket_count;
+  unsigned int entry_count;
+  sqlite3_int64 hits;
+  sqlite3_int64 misses;
+};
+
+static size_t entry_size(const cache_entry *e){
+  return sizeof(*e) + e->length;
+}
+
+static unsigned int bucket_of(chunk_cache *cc, sqlite3_int64 chunk_id){
+  uint64_t h = (uint64_t)chunk_id * 0x9e3779b97f4a7c15ULL;
+  return (unsigned int)(h >> 32) & (cc->bucket_count-1);
+}
+
+static void list_unlink(cache_list *l, cache_entry *e){
+  if( e->prev ) e->prev->next = e->next; else l->head = e->next;
+  if( e->next ) e->next->prev = e->prev; else l->tail = e->prev;
+  l->bytes -= entry_size(e);
+}
+
+static void list_push(cache_list *l, cache_entry *e){
+  e->prev = NULL;
+  e->next = l->head;
+  if( l->head ) l->head->prev = e; else l->tail = e;
+  l->head = e;
+  l->bytes += entry_size(e);
+}
+
+static void hash_remove(chunk_cache *cc, cache_entry *e){
+  cache_entry **p = &cc->buckets[bucket_of(cc, e->chunk_id)];
+  while( *p!=e ) p = &(*p)->hash_next;
+  *p = e->hash_next;
+  cc->entry_count--;
+}
+
+static void hash_grow(chunk_cache *cc){
+  unsigned int new_count = cc->bucket_count*2;
+  cache_entry **buckets = calloc(new_count, sizeof(*buckets));
+  if( !buckets ) return; /* Chains just get longer */
+  unsigned int i;
+  cache_entry **old = cc->buckets;
+  unsigned int old_count = cc->bucket_count;
+  cc->buckets = buckets;
+  cc->bucket_count = new_count;
+  for( i=0; i<old_count; i++ ){
+    cache_entry *e = old[i];
+    while( e ){
+      cache_entry *next = e->hash_next;
+      unsigned int b = bucket_of(cc, e->chunk_id);
+      e->hash_next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free(old);
+}
+
+static cache_entry *hash_find(chunk_cache *cc, sqlite3_int64 chunk_id){
+  cache_entry *e = cc->buckets[bucket_of(cc, chunk_id)];
+  while( e && e->chunk_id!=chunk_id ) e = e->hash_next;
+  return e;
+}
+
+static size_t bytes_used(chunk_cache *cc){
+  return cc->lists[LIST_PROBATION].bytes + cc->lists[LIST_PROTECTED].bytes;
+}
+
+chunk_cache *chunk_cache_create(size_t budget){
+  chunk_cache *cc = calloc(1, sizeof(*cc));
+  if( !cc ) return NULL;
+  cc->bucket_count = 1024;
+  cc->buckets = calloc(cc->bucket_count, sizeof(*cc->buckets));
+  if( !cc->buckets ){
+    free(cc);
+    return NULL;
+  }
+  cc->budget = budget;
+  pthread_mutex_init(&cc->lock, NULL);
+  return cc;
+}
+
+void chunk_cache_destroy(chunk_cache *cc){
+  if( !cc ) return;
+  int l;
+  for( l=0; l<2; l++ ){
+    cache_entry *e = cc->lists[l].head;
+    while( e ){
+      cache_entry *next = e->next;
+      free(e);
+      e = next;
+    }
+  }
+  pthread_mutex_destroy(&cc->lock);
+  free(cc->buckets);
+  free(cc);
+}
+
+int chunk_cache_get(chunk_cache *cc, sqlite3_int64 chunk_id, unsigned char *dest, unsigned int length){
+  int hit = 0;
+  pthread_mutex_lock(&cc->lock);
+  cache_entry *e = hash_find(cc, chunk_id);
+  if( e && e->length==length ){
+    memcpy(dest, e->data, length);
+    hit = 1;
+
+    /* A second use earns a place in the protected list. Whatever that
+    ** pushes out of it gets another chance in probation. */
+    list_unlink(&cc->lists[e->list], e);
+    e->list = LIST_PROTECTED;
+    list_push(&cc->lists[LIST_PROTECTED], e);
+    cache_list *protected = &cc->lists[LIST_PROTECTED];
+    while( protected->bytes > cc->budget/100*PROTECTED_SHARE && protected->tail!=e ){
+      cache_entry *demoted = protected->tail;
+      list_unlink(protected, demoted);
+      demoted->list = LIST_PROBATION;
+      list_push(&cc->lists[LIST_PROBATION], demoted);
+    }
+  }
+  if( hit ) cc->hits++; else cc->misses++;
+  pthread_mutex_unlock(&cc->lock);
+  return hit;
+}
+
+void chunk_cache_put(chunk_cache *cc, sqlite3_int64 chunk_id, const unsigned char *data, unsigned int length){
+  if( sizeof(cache_entry)+length > cc->budget ) return;
+  cache_entry *e = malloc(sizeof(*e) + length);
+  if( !e ) return;
+  e->chunk_id = chunk_id;
+  e->length = length;
+  e->list = LIST_PROBATION;
+  memcpy(e->data, data, length);
+
+  pthread_mutex_lock(&cc->lock);
+  if( hash_find(cc, chunk_id) ){
+    /* Another thread read the same chunk at the same time */
+    pthread_mutex_unlock(&cc->lock);
+    free(e);
+    return;
+  }
+  if( cc->entry_count >= cc->bucket_count ) hash_grow(cc);
+  unsigned int b = bucket_of(cc, chunk_id);
+  e->hash_next = cc->buckets[b];
+  cc->buckets[b] = e;
+  cc->entry_count++;
+  list_push(&cc->lists[LIST_PROBATION], e);
+
+  while( bytes_used(cc) > cc->budget ){
+    cache_list *l = cc->lists[LIST_PROBATION].tail ? &cc->lists[LIST_PROBATION] : &cc->lists[LIST_PROTECTED];
+    cache_entry *victim = l->tail;
+    list_unlink(l, victim);
+    hash_remove(cc, victim);
+    free(victim);
+  }
+  pthread_mutex_unlock(&cc->lock);
+}
+
+void chunk_cache_stats(chunk_cache *cc, sqlite3_int64 *hits, sqlite3_int64 *misses){
+  pthread_mutex_lock(&cc->lock);
+  *hits = cc->hits;
+  *misses = cc->misses;
+  pthread_mutex_unlock(&cc->lock);
+}
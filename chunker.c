@@ -37,12 +37,70 @@ static uint64_t window_hash(uint8_t *buf, unsigned int buf_begin, uint64_t *byte
   return hash;
 }
 
+/* Zero runs at least this long are recorded as zero extents rather than
+** chunked, so they cost nothing to store and become holes on restore. */
+#define ZERO_RUN_MIN 1024
+/* Longest zero extent handed to handle_chunk at once */
+#define ZERO_RUN_MAX (1U<<30)
+
+/* Count the zero bytes at the start of p */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+static unsigned int zero_prefix(const unsigned char *p, unsigned int len){
+  const __m128i zero = _mm_setzero_si128();
+  unsigned int i = 0;
+  while( i+16<=len ){
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p+i)), zero));
+    if( mask!=0xffff ) return i + __builtin_ctz(~mask);
+    i += 16;
+  }
+  while( i<len && p[i]==0 ) i++;
+  return i;
+}
+#else
+static unsigned int zero_prefix(const unsigned char *p, unsigned int len){
+  unsigned int i = 0;
+  while( i+8<=len ){
+    uint64_t word;
+    memcpy(&word, p+i, 8);
+    if( word ) break;
+    i += 8;
+  }
+  while( i<len && p[i]==0 ) i++;
+  return i;
+}
+#endif
+
+/* Find where the first run of at least ZERO_RUN_MIN zeros begins, or return
+** len if there is none. Any such run covers every ZERO_RUN_MIN'th byte, so
+** only those need probing before looking closer. */
+static unsigned int find_zero_run(const unsigned char *p, unsigned int len){
+  unsigned int i = 0;
+  while( i+ZERO_RUN_MIN<=len ){
+    unsigned int probe = i+ZERO_RUN_MIN-1;
+    if( p[probe] ){
+      i = probe+1;
+      continue;
+    }
+    unsigned int start = probe;
+    while( start>i && p[start-1]==0 ) start--;
+    unsigned int run = zero_prefix(p+start, len-start);
+    if( run>=ZERO_RUN_MIN ) return start;
+    i = start+run+1;
+  }
+  return len;
+}
+
 /* TODO: This algorithm is inefficient in two ways now: lots of unnecessary memmove'ing and
 ** recomputing the whole rolling hash at once. Also it does lots of little freads, but the
 ** memmove change should fix that.
+**
+** handle_chunk is called with data==NULL for a run of data_len zero bytes.
+** read_fn works like fread on src, returning 0 at the end of the stream.
 */
-int file_to_chunks(
-  FILE *f,
+int stream_to_chunks(
+  size_t (*read_fn)(void *src, unsigned char *buf, size_t len),
+  void *src,
   unsigned char *chunk_buf,
   unsigned int chunk_buf_len,
   int (*handle_chunk)(unsigned int sequence, unsigned char *data, int data_len, void *ptr),
@@ -63,15 +121,41 @@ int file_to_chunks(
   unsigned int sequence = 0;
   while( 1 ){ /* segment-generating loop */
     /* Fill the buffer as much as possible */
-    unsigned int read_amount = fread(chunk_buf + chunk_buf_filled, 1, chunk_buf_len-chunk_buf_filled, f);
+    unsigned int read_amount = (unsigned int)read_fn(src, chunk_buf + chunk_buf_filled, chunk_buf_len-chunk_buf_filled);
     chunk_buf_filled += read_amount;
     if( chunk_buf_filled==0 ) break;
     
-    if( chunk_buf_filled<=64 ){
+    unsigned int zeros = zero_prefix(chunk_buf, chunk_buf_filled);
+    if( zeros>=ZERO_RUN_MIN ){
+      /* Swallow the whole run, reading on for as long as it lasts */
+      uint64_t run = 0;
+      while( 1 ){
+        run += zeros;
+        memmove(chunk_buf, chunk_buf + zeros, chunk_buf_filled - zeros);
+        chunk_buf_filled -= zeros;
+        if( chunk_buf_filled>0 ) break;
+        chunk_buf_filled = (unsigned int)read_fn(src, chunk_buf, chunk_buf_len);
+        if( chunk_buf_filled==0 ) break;
+        zeros = zero_prefix(chunk_buf, chunk_buf_filled);
+      }
+      while( run>0 ){
+        unsigned int piece = run>ZERO_RUN_MAX ? ZERO_RUN_MAX : (unsigned int)run;
+        err = handle_chunk(sequence, NULL, (int)piece, ptr);
+        if( err ) goto out;
+        run -= piece;
+        sequence++;
+      }
+      continue;
+    }
+    
+    /* Chunks stop short of the next zero run so that it starts a segment */
+    unsigned int scan_len = find_zero_run(chunk_buf, chunk_buf_filled);
+    if( scan_len<=64 ){
       /* A short segment! We have no choice about placing the boundary. This ends now. */
-      int err = handle_chunk(sequence, chunk_buf, chunk_buf_filled, ptr);
+      err = handle_chunk(sequence, chunk_buf, scan_len, ptr);
       if( err ) goto out;
-      chunk_buf_filled = 0;
+      memmove(chunk_buf, chunk_buf + scan_len, chunk_buf_filled - scan_len);
+      chunk_buf_filled -= scan_len;
     }else{
       unsigned int segment_length;
       /* We scan forward looking for a great segment end. */
@@ -81,7 +165,7 @@ int file_to_chunks(
       recently_consumed_idx = 0; // we loop back to the beginning
       
       uint64_t threshold = 0xffffFFFFffffFFFFULL / 300;
-      while( segment_length<chunk_buf_filled ){
+      while( segment_length<scan_len ){
         uint64_t ending_hash = window_hash(recently_consumed, recently_consumed_idx, byte_hashes);
         
         if( ending_hash < threshold ) break;
@@ -92,7 +176,7 @@ int file_to_chunks(
         segment_length++;
       }
       
-      int err = handle_chunk(sequence, chunk_buf, segment_length, ptr);
+      err = handle_chunk(sequence, chunk_buf, segment_length, ptr);
       if( err ) goto out;
       
       memmove(chunk_buf, chunk_buf + segment_length, chunk_buf_filled - segment_length);
@@ -102,6 +186,21 @@ int file_to_chunks(
   }
   
 out:
+  return err;
+}
+
+size_t read_from_file(void *src, unsigned char *buf, size_t len){
+  return fread(buf, 1, len, (FILE *)src);
+}
+
+int file_to_chunks(
+  FILE *f,
+  unsigned char *chunk_buf,
+  unsigned int chunk_buf_len,
+  int (*handle_chunk)(unsigned int sequence, unsigned char *data, int data_len, void *ptr),
+  void *ptr
+){
+  int err = stream_to_chunks(read_from_file, f, chunk_buf, chunk_buf_len, handle_chunk, ptr);
   if( f ) fclose(f);
   return err;
 }
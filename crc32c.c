@@ -0,0 +1,89 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/* CRC-32C (Castagnoli), as computed by the SSE4.2 crc32 instruction. The
+** instruction is used when the CPU has it; otherwise a table is used.
+*/
+
+#define CRC32C_POLY 0x82f63b78U
+
+static uint32_t crc_table[256];
+static int have_sse42;
+static pthread_once_t crc_init_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void){
+  uint32_t i, j;
+  for( i=0; i<256; i++ ){
+    uint32_t crc = i;
+    for( j=0; j<8; j++ ){
+      crc = (crc>>1) ^ (CRC32C_POLY & (0U - (crc&1)));
+    }
+    crc_table[i] = crc;
+  }
+#if defined(__GNUC__) && defined(__x86_64__)
+  __builtin_cpu_init();
+  have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len){
+  while( len-- ){
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc>>8);
+  }
+  return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len){
+  uint64_t crc64 = crc;
+  while( len>0 && ((uintptr_t)p & 7) ){
+    crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+    len--;
+  }
+  while( len>=8 ){
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    len -= 8;
+  }
+  while( len-- ){
+    crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+  }
+  return (uint32_t)crc64;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t len){
+  const unsigned char *p = (const unsigned char *)data;
+  pthread_once(&crc_init_once, crc_init);
+#ifdef HAVE_CRC32C_SSE42
+  if( have_sse42 ) return ~crc32c_sse42(~0U, p, len);
+#endif
+  return ~crc32c_table(~0U, p, len);
+}
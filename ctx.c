@@ -22,6 +22,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 static int do_exec(const char *sql, ctx *c){
   char *sql_errmsg = NULL;
@@ -65,39 +66,323 @@ void ctx_errtype(ctx *ctx, int errtype){
   }
 }
 
-int ctx_init(ctx *c, const char *path){
-  memset(c, 0, sizeof(*c));
-  int err = sqlite3_open(path, &c->db);
-  if( err ){
-    ctx_errmsg(c, sqlite3_mprintf("Can't open database: %s", sqlite3_errmsg(c->db)));
+/* Databases carry the schema version in PRAGMA user_version. Ones from
+** before it was kept read 0, and may lack any of the columns added since. */
+#define SCHEMA_VERSION 2
+#define SET_SCHEMA_VERSION_(v) "PRAGMA user_version = " #v
+#define SET_SCHEMA_VERSION(v) SET_SCHEMA_VERSION_(v)
+
+/* Add column to table with decl unless it has one already. *added is set
+** if it was added. */
+static int ctx_add_column(ctx *c, const char *table, const char *column, const char *decl, int *added){
+  sqlite3_stmt *info = NULL;
+  char *sql;
+  int found = 0;
+  int step_result;
+
+  *added = 0;
+  sql = sqlite3_mprintf("PRAGMA table_info(%s)", table);
+  if( !sql ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
     return 1;
   }
-  
-  sqlite3_busy_timeout(c->db, 5000);
-  printf("Creating\n");
+  if( do_prepare(sql, c, &info) ){
+    sqlite3_free(sql);
+    return 1;
+  }
+  sqlite3_free(sql);
+  c->err_context = "upgrading the database";
+  while( SQLITE_ROW==(step_result=sqlite3_step(info)) ){
+    if( 0==sqlite3_stricmp((const char *)sqlite3_column_text(info, 1), column) ) found = 1;
+  }
+  sqlite3_finalize(info);
+  if( step_result!=SQLITE_DONE ) return ctx_collect_err(c, step_result);
+  if( found ) return 0;
+
+  sql = sqlite3_mprintf("ALTER TABLE %s ADD COLUMN %s %s", table, column, decl);
+  if( !sql ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  if( do_exec(sql, c) ){
+    sqlite3_free(sql);
+    return 1;
+  }
+  sqlite3_free(sql);
+  *added = 1;
+  return 0;
+}
+
+/* Work out each segment's offset for the contents missing any, from the
+** segments' lengths in sequence */
+static int ctx_backfill_offsets(ctx *c){
+  sqlite3_stmt *select = NULL, *update = NULL;
+  sqlite3_int64 content_id = 0, offset = 0;
+  int step_result;
+  int err = 1;
+
+  if( do_prepare("SELECT segment_id, content_id, length FROM segment"
+                 " WHERE content_id IN (SELECT content_id FROM segment WHERE offset IS NULL)"
+                 " ORDER BY content_id, sequence", c, &select)
+   || do_prepare("UPDATE segment SET offset = ? WHERE segment_id = ?", c, &update)
+  ){
+    goto out;
+  }
+  c->err_context = "working out segment offsets";
+  while( SQLITE_ROW==(step_result=sqlite3_step(select)) ){
+    if( sqlite3_column_int64(select, 1)!=content_id ){
+      content_id = sqlite3_column_int64(select, 1);
+      offset = 0;
+    }
+    if( ctx_collect_err(c, sqlite3_reset(update))
+     || ctx_collect_err(c, sqlite3_bind_int64(update, 1, offset))
+     || ctx_collect_err(c, sqlite3_bind_int64(update, 2, sqlite3_column_int64(select, 0)))
+     || ctx_collect_err(c, sqlite3_step(update))
+    ){
+      goto out;
+    }
+    offset += sqlite3_column_int64(select, 2);
+  }
+  if( ctx_collect_err(c, step_result) ) goto out;
+  err = 0;
+
+out:
+  sqlite3_finalize(select);
+  sqlite3_finalize(update);
+  return err;
+}
+
+/* Compute the CRC-32C of every chunk stored without one */
+static int ctx_backfill_crcs(ctx *c){
+  sqlite3_stmt *select = NULL, *update = NULL;
+  int step_result;
+  int err = 1;
+
+  if( do_prepare("SELECT chunk_id, body FROM chunk WHERE crc IS NULL", c, &select)
+   || do_prepare("UPDATE chunk SET crc = ? WHERE chunk_id = ?", c, &update)
+  ){
+    goto out;
+  }
+  c->err_context = "computing chunk CRCs";
+  while( SQLITE_ROW==(step_result=sqlite3_step(select)) ){
+    const void *body = sqlite3_column_blob(select, 1);
+    uint32_t crc = crc32c(body, sqlite3_column_bytes(select, 1));
+    if( ctx_collect_err(c, sqlite3_reset(update))
+     || ctx_collect_err(c, sqlite3_bind_int64(update, 1, crc))
+     || ctx_collect_err(c, sqlite3_bind_int64(update, 2, sqlite3_column_int64(select, 0)))
+     || ctx_collect_err(c, sqlite3_step(update))
+    ){
+      goto out;
+    }
+  }
+  if( ctx_collect_err(c, step_result) ) goto out;
+  err = 0;
+
+out:
+  sqlite3_finalize(select);
+  sqlite3_finalize(update);
+  return err;
+}
+
+/* Fill in the directory of each row of table missing one, from its path.
+** Only the directory table's '' has none. */
+static int ctx_backfill_directories(ctx *c, const char *table, const char *column){
+  sqlite3_stmt *select = NULL, *update = NULL;
+  char *sql;
+  int step_result;
+  int err = 1;
+
+  sql = sqlite3_mprintf("SELECT rowid, path FROM %s WHERE %s IS NULL AND path != ''", table, column);
+  if( !sql || do_prepare(sql, c, &select) ) goto out;
+  sqlite3_free(sql);
+  sql = sqlite3_mprintf("UPDATE %s SET %s = ? WHERE rowid = ?", table, column);
+  if( !sql || do_prepare(sql, c, &update) ) goto out;
+  c->err_context = "working out directories";
+  while( SQLITE_ROW==(step_result=sqlite3_step(select)) ){
+    const char *path = (const char *)sqlite3_column_text(select, 1);
+    if( ctx_collect_err(c, sqlite3_reset(update))
+     || ctx_collect_err(c, sqlite3_bind_text(update, 1, path, (int)ctx_dir_length(path), SQLITE_TRANSIENT))
+     || ctx_collect_err(c, sqlite3_bind_int64(update, 2, sqlite3_column_int64(select, 0)))
+     || ctx_collect_err(c, sqlite3_step(update))
+    ){
+      goto out;
+    }
+  }
+  if( ctx_collect_err(c, step_result) ) goto out;
+  err = 0;
+
+out:
+  if( !sql ) ctx_errtype(c, CTX_ERR_NO_MEMORY);
+  sqlite3_free(sql);
+  sqlite3_finalize(select);
+  sqlite3_finalize(update);
+  return err;
+}
+
+/* chunk.refcount and content.refcount. Counts were never kept before, so
+** take them from what refers to each row. */
+static int ctx_migrate_refcounts(ctx *c){
+  int chunk_refcount, content_refcount;
+
+  return ctx_add_column(c, "chunk", "refcount", "INT NOT NULL DEFAULT 0", &chunk_refcount)
+      || ctx_add_column(c, "content", "refcount", "INT NOT NULL DEFAULT 0", &content_refcount)
+      || (chunk_refcount
+          && do_exec("UPDATE chunk SET refcount ="
+                     " (SELECT count(*) FROM segment WHERE segment.chunk_id = chunk.chunk_id)", c))
+      || (content_refcount
+          && do_exec("UPDATE content SET refcount ="
+                     " (SELECT count(*) FROM revision WHERE revision.content_id = content.content_id)", c));
+}
+
+/* chunk.crc, the CRC-32C of each chunk's body */
+static int ctx_migrate_crcs(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "chunk", "crc", "INT", &added)
+      || ctx_backfill_crcs(c);
+}
+
+/* content.length. Older databases hold no zero extents, so every
+** content's length is the sum of its chunks'. */
+static int ctx_migrate_content_lengths(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "content", "length", "INT", &added)
+      || do_exec("UPDATE content SET length ="
+                 " (SELECT ifnull(sum(length(body)), 0) FROM segment JOIN chunk USING (chunk_id)"
+                 " WHERE segment.content_id = content.content_id)"
+                 " WHERE length IS NULL", c);
+}
+
+/* content.zero_length and segment.length. Older databases hold no zero
+** extents, so each segment is as long as its chunk. */
+static int ctx_migrate_zero_extents(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "content", "zero_length", "INT NOT NULL DEFAULT 0", &added)
+      || ctx_add_column(c, "segment", "length", "INT", &added)
+      || do_exec("UPDATE segment SET length = (SELECT length(body) FROM chunk WHERE chunk.chunk_id = segment.chunk_id)"
+                 " WHERE length IS NULL", c);
+}
+
+/* segment.offset, from the segment lengths ctx_migrate_zero_extents
+** filled in */
+static int ctx_migrate_offsets(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "segment", "offset", "INT", &added)
+      || ctx_backfill_offsets(c);
+}
+
+/* revision.mtime_ns. Older revisions keep NULL, as their times were never
+** recorded. */
+static int ctx_migrate_mtimes(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "revision", "mtime_ns", "INT", &added);
+}
+
+/* The rest of the revision's stat fields. Older revisions keep NULL, so
+** the next snapshot reads their files again. */
+static int ctx_migrate_revision_stat(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "revision", "size", "INT", &added)
+      || ctx_add_column(c, "revision", "ctime_ns", "INT", &added)
+      || ctx_add_column(c, "revision", "inode", "INT", &added)
+      || ctx_add_column(c, "revision", "device", "INT", &added);
+}
+
+/* snapshot.parent_snapshot_id. Older snapshots keep NULL: each lists every
+** file. */
+static int ctx_migrate_parents(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "snapshot", "parent_snapshot_id", "INT REFERENCES snapshot(snapshot_id)", &added);
+}
+
+/* file.directory and directory.parent, from the paths */
+static int ctx_migrate_directories(ctx *c){
+  int added;
+
+  return ctx_add_column(c, "file", "directory", "TEXT", &added)
+      || ctx_add_column(c, "directory", "parent", "TEXT", &added)
+      || ctx_backfill_directories(c, "file", "directory")
+      || ctx_backfill_directories(c, "directory", "parent");
+}
+
+/* Bring a database from before SCHEMA_VERSION up to date: each step adds
+** the columns it lacks and fills in what they would have held. New
+** databases pass through too, finding nothing to do. */
+static int ctx_migrate(ctx *c){
+  sqlite3_stmt *stmt = NULL;
+  int version = 0;
+
+  if( do_prepare("PRAGMA user_version", c, &stmt) ) return 1;
+  if( SQLITE_ROW==sqlite3_step(stmt) ) version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  if( version>=SCHEMA_VERSION ) return 0;
+
+  if( do_exec("BEGIN IMMEDIATE", c) ) return 1;
+  if( ctx_migrate_refcounts(c)
+   || ctx_migrate_crcs(c)
+   || ctx_migrate_content_lengths(c)
+   || ctx_migrate_zero_extents(c)
+   || ctx_migrate_offsets(c)
+   || ctx_migrate_mtimes(c)
+   || ctx_migrate_revision_stat(c)
+   || ctx_migrate_parents(c)
+   || ctx_migrate_directories(c)
+   || do_exec(SET_SCHEMA_VERSION(SCHEMA_VERSION), c)
+  ){
+    do_exec("ROLLBACK", c);
+    return 1;
+  }
+  return do_exec("COMMIT", c);
+}
+
+static int ctx_create_schema(ctx *c){
+  fprintf(stderr, "Creating\n");
   if( do_exec("CREATE TABLE IF NOT EXISTS chunk"
               "(chunk_id INTEGER PRIMARY KEY AUTOINCREMENT"
               ",hash BLOB"
               ",body BLOB"
+              ",refcount INT NOT NULL DEFAULT 0"
+              ",crc INT" /* CRC-32C of body */
               ")", c)
    || do_exec("CREATE TABLE IF NOT EXISTS snapshot"
               "(snapshot_id INTEGER PRIMARY KEY AUTOINCREMENT"
               ",time TEXT"
               ",note TEXT"
+              /* NULL for a snapshot that lists every file. Otherwise it holds
+              ** only what changed since this one, which is resolved in turn. */
+              ",parent_snapshot_id INT"
+              ",FOREIGN KEY(parent_snapshot_id) REFERENCES snapshot(snapshot_id)"
               ")", c)
    || do_exec("CREATE TABLE IF NOT EXISTS content"
               "(content_id INTEGER PRIMARY KEY AUTOINCREMENT"
               ",hash BLOB"
+              ",refcount INT NOT NULL DEFAULT 0"
+              ",length INT" /* Total bytes, so restores can preallocate */
+              ",zero_length INT NOT NULL DEFAULT 0" /* Bytes held in zero extents */
               ")", c)
    || do_exec("CREATE TABLE IF NOT EXISTS file"
               "(file_id INTEGER PRIMARY KEY AUTOINCREMENT"
               ",path TEXT"
+              ",directory TEXT" /* path up to its last '/', or '' (see merkle.c) */
               ")", c)
    || do_exec("CREATE TABLE IF NOT EXISTS revision"
               "(revision_id INTEGER PRIMARY KEY AUTOINCREMENT"
               ",file_id INT"
-              ",content_id INT"
+              ",content_id INT" /* NULL for a tombstone: gone since the parent snapshot */
               ",snapshot_id INT"
+              ",mtime_ns INT" /* Modification time when stored, or NULL */
+              /* The rest of what stat said when the file was stored, or NULL,
+              ** so an unchanged file need not be read again */
+              ",size INT"
+              ",ctime_ns INT"
+              ",inode INT"
+              ",device INT"
               ",FOREIGN KEY(file_id) REFERENCES file(file_id)"
               ",FOREIGN KEY(content_id) REFERENCES file(content_id)"
               ",FOREIGN KEY(snapshot_id) REFERENCES file(snapshot_id)"
@@ -106,7 +391,9 @@ int ctx_init(ctx *c, const char *path){
               "(segment_id INTEGER PRIMARY KEY AUTOINCREMENT"
               ",content_id INT NOT NULL"
               ",sequence INT NOT NULL"
-              ",chunk_id INT NOT NULL"
+              ",chunk_id INT NOT NULL" /* 0 for a run of zero bytes with no chunk */
+              ",length INT"
+              ",offset INT" /* Where the segment starts within the content */
               ",FOREIGN KEY(content_id) REFERENCES revision(content_id)"
               ",FOREIGN KEY(chunk_id) REFERENCES chunk(chunk_id)"
               ")", c)
@@ -118,6 +405,111 @@ int ctx_init(ctx *c, const char *path){
               ",FOREIGN KEY(revision_id) REFERENCES revision(revision_id)"
               ",FOREIGN KEY(chunk_id) REFERENCES chunk(chunk_id)"
               ")", c)
+   || do_exec("CREATE TABLE IF NOT EXISTS content_tail"
+              "(content_id INTEGER PRIMARY KEY"
+              ",offset INT NOT NULL"
+              ",hasher BLOB NOT NULL" /* The content hash's BLAKE2b state after offset bytes */
+              ",FOREIGN KEY(content_id) REFERENCES content(content_id)"
+              ")", c)
+   || do_exec("CREATE TABLE IF NOT EXISTS directory"
+              "(directory_id INTEGER PRIMARY KEY AUTOINCREMENT"
+              ",snapshot_id INT NOT NULL"
+              ",path TEXT NOT NULL" /* '' for the top, above every stored path */
+              /* Hash of the directory's entries (see merkle.c), or NULL when it
+              ** is gone since the parent snapshot. Like revisions, a delta
+              ** snapshot holds only the directories that changed. */
+              ",hash BLOB"
+              ",parent TEXT" /* The directory it is in, NULL for '' */
+              ",FOREIGN KEY(snapshot_id) REFERENCES snapshot(snapshot_id)"
+              ")", c)
+   || ctx_migrate(c)
+   || do_exec("CREATE INDEX IF NOT EXISTS segment_content ON segment(content_id, sequence)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS segment_offset ON segment(content_id, offset)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS segment_chunk ON segment(chunk_id)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS revision_snapshot ON revision(snapshot_id, file_id)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS revision_file ON revision(file_id, revision_id)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS revision_file_snapshot ON revision(file_id, snapshot_id)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS snapshot_parent ON snapshot(parent_snapshot_id)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS directory_snapshot ON directory(snapshot_id, path)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS directory_path ON directory(path, snapshot_id)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS file_path ON file(path)", c)
+   /* Directory hashes are worked out, and compared, one directory at a time */
+   || do_exec("CREATE INDEX IF NOT EXISTS file_directory ON file(directory, path)", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS directory_parent ON directory(parent, snapshot_id)", c)
+   /* Every chunk and content stored is first looked up by hash */
+   || do_exec("CREATE UNIQUE INDEX IF NOT EXISTS chunk_hash ON chunk(hash)", c)
+   || do_exec("CREATE UNIQUE INDEX IF NOT EXISTS content_hash ON content(hash)", c)
+   /* Rows whose count has dropped to zero, so collection never scans live data */
+   || do_exec("CREATE INDEX IF NOT EXISTS chunk_unreferenced ON chunk(chunk_id) WHERE refcount=0", c)
+   || do_exec("CREATE INDEX IF NOT EXISTS content_unreferenced ON content(content_id) WHERE refcount=0", c)
+  ){
+    return 1;
+  }
+  return 0;
+}
+
+/* Temporary tables live in the connection's own temp database, so they can
+** be created even on a read-only connection. */
+/* The snapshots that snapshot ?1 is resolved through: itself, then each
+** parent in turn */
+#define SNAPSHOT_CHAIN \
+  "WITH RECURSIVE chain(snapshot_id) AS (SELECT ?1" \
+  " UNION ALL SELECT snapshot.parent_snapshot_id FROM snapshot INNER JOIN chain USING (snapshot_id)" \
+  "   WHERE snapshot.parent_snapshot_id IS NOT NULL) "
+/* Likewise for a directory's hash */
+#define RESOLVED_DIRECTORY \
+  "directory.snapshot_id IN (SELECT snapshot_id FROM chain)" \
+  " AND directory.snapshot_id = (SELECT max(newer.snapshot_id) FROM directory AS newer" \
+  "   WHERE newer.path = directory.path AND newer.snapshot_id IN (SELECT snapshot_id FROM chain))"
+/* Whether revision is the one snapshot ?1 has for its file: the one from
+** the newest snapshot in the chain that has one at all */
+#define RESOLVED_REVISION \
+  "revision.snapshot_id IN (SELECT snapshot_id FROM chain)" \
+  " AND revision.snapshot_id = (SELECT max(newer.snapshot_id) FROM revision AS newer" \
+  "   WHERE newer.file_id = revision.file_id AND newer.snapshot_id IN (SELECT snapshot_id FROM chain))"
+/* The chains of snapshots ?1 and ?2 */
+#define BOTH_CHAINS \
+  "WITH RECURSIVE chain(snapshot_id) AS (SELECT ?1" \
+  " UNION ALL SELECT snapshot.parent_snapshot_id FROM snapshot INNER JOIN chain USING (snapshot_id)" \
+  "   WHERE snapshot.parent_snapshot_id IS NOT NULL)," \
+  " other(snapshot_id) AS (SELECT ?2" \
+  " UNION ALL SELECT snapshot.parent_snapshot_id FROM snapshot INNER JOIN other USING (snapshot_id)" \
+  "   WHERE snapshot.parent_snapshot_id IS NOT NULL)"
+/* The files that may differ between snapshots ?1 and ?2. When the chains
+** meet, only the snapshots in one chain and not the other can tell the two
+** apart, so only files with a row in one of those need be looked at. */
+#define DIFF_APART \
+  " apart(snapshot_id) AS (SELECT snapshot_id FROM chain WHERE snapshot_id NOT IN (SELECT snapshot_id FROM other)" \
+  "   UNION SELECT snapshot_id FROM other WHERE snapshot_id NOT IN (SELECT snapshot_id FROM chain))," \
+  " touched(file_id) AS (SELECT DISTINCT file_id FROM revision WHERE snapshot_id IN (SELECT snapshot_id FROM apart))"
+/* Otherwise, the files of the directories whose hashes differ */
+#define DIFF_IN_DIRS \
+  " touched(file_id) AS (SELECT file_id FROM file WHERE directory IN (SELECT path FROM diff_dir))"
+/* The files of snapshot ?1 among touched, as ?1 has them, in file_id
+** order, each resolved through revision_file_snapshot. Files ?1 lacks are
+** left out. */
+#define DIFF_SIDE(touched) \
+  BOTH_CHAINS "," touched \
+  " SELECT revision.file_id, file.path, revision.content_id, revision.size, revision.mtime_ns FROM touched" \
+  " INNER JOIN revision ON revision.file_id = touched.file_id AND revision.snapshot_id =" \
+  "   (SELECT max(newer.snapshot_id) FROM revision AS newer" \
+  "     WHERE newer.file_id = touched.file_id AND newer.snapshot_id IN (SELECT snapshot_id FROM chain))" \
+  " INNER JOIN file ON file.file_id = revision.file_id" \
+  " WHERE revision.content_id IS NOT NULL" \
+  " ORDER BY touched.file_id"
+
+static int ctx_prepare_statements(ctx *c){
+  if( do_exec("CREATE TEMP TABLE IF NOT EXISTS dead_chunk"
+              "(chunk_id INTEGER PRIMARY KEY"
+              ",refs INT NOT NULL"
+              ")", c)
+   || do_exec("CREATE TEMP TABLE IF NOT EXISTS repack_order"
+              "(ord INTEGER PRIMARY KEY"
+              ",chunk_id INT UNIQUE"
+              ")", c)
+   || do_exec("CREATE TEMP TABLE IF NOT EXISTS diff_dir"
+              "(path TEXT PRIMARY KEY"
+              ")", c)
   ){
     return 1;
   }
@@ -125,28 +517,269 @@ int ctx_init(ctx *c, const char *path){
   if( do_prepare("BEGIN TRANSACTION", c, &c->begin_transaction)
    || do_prepare("ROLLBACK", c, &c->rollback)
    || do_prepare("COMMIT", c, &c->commit)
-   || do_prepare("INSERT INTO snapshot(time, note) VALUES (datetime('now'), ?)", c, &c->insert_snapshot)
+   || do_prepare("SAVEPOINT stream_content", c, &c->savepoint_content)
+   || do_prepare("RELEASE stream_content", c, &c->release_content)
+   || do_prepare("ROLLBACK TO stream_content", c, &c->rollback_content)
+   || do_prepare("INSERT INTO snapshot(time, note, parent_snapshot_id) VALUES (datetime('now'), ?, ?)", c, &c->insert_snapshot)
    || do_prepare("SELECT file_id FROM file WHERE path = ?", c, &c->lookup_file_id)
-   || do_prepare("INSERT INTO file(path) VALUES (?)", c, &c->insert_file)
+   || do_prepare("INSERT INTO file(path, directory) VALUES (?, ?)", c, &c->insert_file)
    || do_prepare("SELECT chunk_id FROM chunk WHERE hash = ?", c, &c->find_chunk)
-   || do_prepare("INSERT INTO chunk(hash, body) VALUES (?, ?)", c, &c->insert_chunk)
-   || do_prepare("INSERT INTO segment(content_id, sequence, chunk_id) VALUES (?, ?, ?)", c, &c->insert_segment)
-   || do_prepare("INSERT INTO revision(file_id, snapshot_id, content_id) VALUES (?, ?, ?)", c, &c->insert_revision)
-   || do_prepare("SELECT body FROM chunk"
-                 " INNER JOIN segment USING (chunk_id)"
-                 " WHERE content_id = (SELECT content_id FROM revision WHERE revision_id = ?)"
-                 " ORDER BY sequence ASC", c, &c->select_revision_chunks)
+   || do_prepare("INSERT INTO chunk(hash, body, crc) VALUES (?, ?, ?)", c, &c->insert_chunk)
+   || do_prepare("INSERT INTO segment(content_id, sequence, chunk_id, length, offset) VALUES (?, ?, ?, ?, ?)", c, &c->insert_segment)
+   || do_prepare("INSERT INTO revision(file_id, snapshot_id, content_id, size, mtime_ns, ctime_ns, inode, device)"
+                 " VALUES (?, ?, ?, ?, ?, ?, ?, ?)", c, &c->insert_revision)
+   || do_prepare("SELECT content_id, size, mtime_ns, ctime_ns, inode, device FROM revision"
+                 " WHERE file_id = ? AND snapshot_id != ? AND content_id IS NOT NULL"
+                 " ORDER BY revision_id DESC LIMIT 1", c, &c->select_previous_revision)
+   || do_prepare("SELECT file.path, revision.content_id, revision.size, revision.mtime_ns,"
+                 " revision.ctime_ns, revision.inode, revision.device FROM file"
+                 " INNER JOIN revision ON revision.revision_id ="
+                 "   (SELECT max(revision_id) FROM revision"
+                 "     WHERE revision.file_id = file.file_id AND snapshot_id != ?1)"
+                 " WHERE substr(file.path, 1, length(?2)) = ?2"
+                 "   AND revision.size IS NOT NULL AND revision.mtime_ns IS NOT NULL", c, &c->select_prior_revisions)
+   || do_prepare("SELECT 1 FROM snapshot WHERE snapshot_id = ?", c, &c->select_snapshot_exists)
+   || do_prepare("SELECT time FROM snapshot WHERE snapshot_id = ?", c, &c->select_snapshot_time)
+   || do_prepare("SELECT offset, hasher FROM content_tail WHERE content_id = ?", c, &c->select_content_tail)
+   || do_prepare("INSERT INTO content_tail(content_id, offset, hasher) VALUES (?, ?, ?)", c, &c->insert_content_tail)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT file.path, revision.file_id, revision.content_id, revision.size, revision.mtime_ns,"
+                 " revision.ctime_ns, revision.inode, revision.device FROM revision"
+                 " INNER JOIN file USING (file_id)"
+                 " WHERE " RESOLVED_REVISION
+                 "   AND revision.content_id IS NOT NULL"
+                 "   AND substr(file.path, 1, length(?2)) = ?2", c, &c->select_snapshot_files)
+   || do_prepare("SELECT content_id, (SELECT CASE WHEN zero_length = 0 THEN length END"
+                 "   FROM content WHERE content.content_id = revision.content_id)"
+                 " FROM revision WHERE revision_id = ?", c, &c->select_revision_content)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT file.path, revision.content_id, content.length, content.zero_length,"
+                 " revision.mtime_ns, content.hash FROM revision"
+                 " INNER JOIN file USING (file_id)"
+                 " INNER JOIN content USING (content_id)"
+                 " WHERE " RESOLVED_REVISION
+                 " ORDER BY (SELECT chunk_id FROM segment"
+                 "   WHERE segment.content_id = revision.content_id"
+                 "   ORDER BY sequence LIMIT 1)", c, &c->select_snapshot_entries)
+   || do_prepare("SELECT chunk_id, ifnull(segment.length, length(body)), crc, hash FROM segment"
+                 " LEFT JOIN chunk USING (chunk_id)"
+                 " WHERE content_id = ?"
+                 " ORDER BY sequence ASC", c, &c->select_content_segments)
    || do_prepare("SELECT content_id FROM content WHERE hash = ?", c, &c->select_content_id)
-   || do_prepare("INSERT INTO content(hash) VALUES (?)", c, &c->insert_content)
+   || do_prepare("INSERT INTO content(hash, length) VALUES (?, ?)", c, &c->insert_content)
+   || do_prepare("UPDATE chunk SET refcount = refcount + ? WHERE chunk_id = ?", c, &c->add_chunk_refs)
+   || do_prepare("UPDATE content SET refcount = refcount + ? WHERE content_id = ?", c, &c->add_content_refs)
+   || do_prepare("UPDATE content SET refcount = refcount -"
+                 " (SELECT count(*) FROM revision"
+                 "   WHERE revision.snapshot_id = ?1 AND revision.content_id = content.content_id)"
+                 " WHERE content_id IN (SELECT content_id FROM revision WHERE snapshot_id = ?1)", c, &c->release_snapshot_contents)
+   || do_prepare("DELETE FROM revision WHERE snapshot_id = ?", c, &c->delete_snapshot_revisions)
+   || do_prepare("DELETE FROM dead_chunk", c, &c->clear_dead_chunks)
+   || do_prepare("INSERT INTO dead_chunk(chunk_id, refs)"
+                 " SELECT chunk_id, count(*) FROM segment"
+                 " WHERE content_id IN (SELECT content_id FROM content WHERE refcount = 0)"
+                 " GROUP BY chunk_id", c, &c->collect_dead_chunks)
+   || do_prepare("UPDATE chunk SET refcount = refcount -"
+                 " (SELECT refs FROM dead_chunk WHERE dead_chunk.chunk_id = chunk.chunk_id)"
+                 " WHERE chunk_id IN (SELECT chunk_id FROM dead_chunk)", c, &c->release_dead_chunks)
+   || do_prepare("DELETE FROM segment WHERE content_id IN (SELECT content_id FROM content WHERE refcount = 0)", c, &c->delete_dead_segments)
+   || do_prepare("DELETE FROM content_tail WHERE content_id IN (SELECT content_id FROM content WHERE refcount = 0)", c, &c->delete_dead_tails)
+   || do_prepare("SELECT chunk_id, hash FROM chunk"
+                 " WHERE chunk_id IN (SELECT chunk_id FROM segment WHERE content_id = ?)"
+                 " LIMIT ?", c, &c->select_content_chunk_ids)
+   || do_prepare("SELECT max(snapshot_id) FROM snapshot", c, &c->select_latest_snapshot)
+   || do_prepare(SNAPSHOT_CHAIN "SELECT snapshot_id FROM chain", c, &c->select_snapshot_chain)
+   || do_prepare("SELECT revision_id, snapshot_id, content_id, size, mtime_ns, ctime_ns, inode, device FROM revision"
+                 " WHERE file_id = ?1 AND snapshot_id <= ?2"
+                 " ORDER BY snapshot_id DESC", c, &c->select_file_history)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT file_id FROM revision"
+                 " WHERE " RESOLVED_REVISION " AND content_id IS NOT NULL", c, &c->select_snapshot_file_ids)
+   || do_prepare("SELECT ifnull(max(revision_id), 0) FROM revision", c, &c->select_max_revision_id)
+   || do_prepare("INSERT INTO revision(file_id, content_id, snapshot_id, mtime_ns, size, ctime_ns, inode, device)"
+                 " SELECT revision.file_id, revision.content_id, child.snapshot_id, revision.mtime_ns,"
+                 "   revision.size, revision.ctime_ns, revision.inode, revision.device"
+                 " FROM snapshot AS child INNER JOIN revision ON revision.snapshot_id = ?1"
+                 " WHERE child.parent_snapshot_id = ?1"
+                 "   AND NOT EXISTS (SELECT 1 FROM revision AS own"
+                 "     WHERE own.snapshot_id = child.snapshot_id AND own.file_id = revision.file_id)", c, &c->inherit_child_revisions)
+   || do_prepare("SELECT content_id FROM revision WHERE revision_id > ? AND content_id IS NOT NULL", c, &c->select_revisions_since)
+   || do_prepare("DELETE FROM revision WHERE content_id IS NULL"
+                 " AND snapshot_id IN (SELECT snapshot_id FROM snapshot WHERE parent_snapshot_id = ?1)"
+                 " AND (SELECT parent_snapshot_id FROM snapshot WHERE snapshot_id = ?1) IS NULL", c, &c->drop_rootless_tombstones)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT file.path, revision.size, revision.mtime_ns, content.hash FROM revision"
+                 " INNER JOIN file USING (file_id)"
+                 " INNER JOIN content USING (content_id)"
+                 " WHERE " RESOLVED_REVISION
+                 " ORDER BY file.path", c, &c->select_snapshot_tree)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT path, hash FROM directory"
+                 " WHERE " RESOLVED_DIRECTORY " AND hash IS NOT NULL"
+                 " ORDER BY path", c, &c->select_snapshot_dirs)
+   || do_prepare("SELECT DISTINCT file.directory FROM revision"
+                 " INNER JOIN file USING (file_id)"
+                 " WHERE revision.snapshot_id = ?", c, &c->select_changed_file_dirs)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT file.path, revision.size, revision.mtime_ns, content.hash FROM file"
+                 " INNER JOIN revision ON revision.file_id = file.file_id"
+                 " INNER JOIN content ON content.content_id = revision.content_id"
+                 " WHERE file.directory = ?2 AND " RESOLVED_REVISION
+                 " ORDER BY file.path", c, &c->select_dir_files)
+   /* A directory sorts as the paths under it, so after its name and a '/' */
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT path, hash FROM directory"
+                 " WHERE parent = ?2 AND " RESOLVED_DIRECTORY " AND hash IS NOT NULL"
+                 " ORDER BY path || '/'", c, &c->select_dir_subdirs)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT path, hash FROM directory"
+                 " WHERE parent = ?2 AND " RESOLVED_DIRECTORY " AND hash IS NOT NULL"
+                 " ORDER BY path || '/'", c, &c->select_dir_subdirs_other)
+   || do_prepare(SNAPSHOT_CHAIN
+                 "SELECT hash FROM directory"
+                 " WHERE path = ?2 AND " RESOLVED_DIRECTORY, c, &c->select_directory_hash)
+   || do_prepare(BOTH_CHAINS
+                 " SELECT 1 FROM chain WHERE snapshot_id IN (SELECT snapshot_id FROM other)"
+                 " LIMIT 1", c, &c->select_chains_meet)
+   || do_prepare(DIFF_SIDE(DIFF_APART), c, &c->select_diff_from)
+   || do_prepare(DIFF_SIDE(DIFF_APART), c, &c->select_diff_to)
+   || do_prepare(DIFF_SIDE(DIFF_IN_DIRS), c, &c->select_diff_dirs_from)
+   || do_prepare(DIFF_SIDE(DIFF_IN_DIRS), c, &c->select_diff_dirs_to)
+   || do_prepare("DELETE FROM diff_dir", c, &c->clear_diff_dirs)
+   || do_prepare("INSERT INTO diff_dir(path) VALUES (?)", c, &c->insert_diff_dir)
+   || do_prepare("SELECT count(*),"
+                 "   ifnull(sum(CASE WHEN chunk_id IN (SELECT chunk_id FROM segment AS old WHERE old.content_id = ?1) THEN 0 ELSE 1 END), 0),"
+                 "   ifnull(sum(CASE WHEN chunk_id IN (SELECT chunk_id FROM segment AS old WHERE old.content_id = ?1) THEN 0 ELSE length END), 0)"
+                 " FROM segment WHERE content_id = ?2 AND chunk_id != 0", c, &c->select_chunk_changes)
+   || do_prepare("INSERT INTO directory(snapshot_id, path, hash, parent) VALUES (?, ?, ?, ?)", c, &c->insert_directory)
+   || do_prepare("INSERT INTO directory(snapshot_id, path, hash, parent)"
+                 " SELECT child.snapshot_id, directory.path, directory.hash, directory.parent"
+                 " FROM snapshot AS child INNER JOIN directory ON directory.snapshot_id = ?1"
+                 " WHERE child.parent_snapshot_id = ?1"
+                 "   AND NOT EXISTS (SELECT 1 FROM directory AS own"
+                 "     WHERE own.snapshot_id = child.snapshot_id AND own.path = directory.path)", c, &c->inherit_child_directories)
+   || do_prepare("DELETE FROM directory WHERE hash IS NULL"
+                 " AND snapshot_id IN (SELECT snapshot_id FROM snapshot WHERE parent_snapshot_id = ?1)"
+                 " AND (SELECT parent_snapshot_id FROM snapshot WHERE snapshot_id = ?1) IS NULL", c, &c->drop_rootless_directories)
+   || do_prepare("DELETE FROM directory WHERE snapshot_id = ?", c, &c->delete_snapshot_directories)
+   || do_prepare("UPDATE snapshot SET parent_snapshot_id ="
+                 " (SELECT gone.parent_snapshot_id FROM snapshot AS gone WHERE gone.snapshot_id = ?1)"
+                 " WHERE parent_snapshot_id = ?1", c, &c->reparent_children)
+   || do_prepare("DELETE FROM content WHERE refcount = 0", c, &c->delete_dead_contents)
+   || do_prepare("DELETE FROM chunk WHERE refcount = 0", c, &c->delete_dead_chunks)
+   || do_prepare("DELETE FROM snapshot WHERE snapshot_id = ?", c, &c->delete_snapshot)
+   || do_prepare("DELETE FROM repack_order", c, &c->repack_clear_order)
+   || do_prepare("WITH RECURSIVE recent(snapshot_id) AS ("
+                 "   SELECT snapshot_id FROM snapshot"
+                 "     WHERE snapshot_id > (SELECT ifnull(max(snapshot_id), 0) FROM snapshot) - ?1"
+                 "   UNION SELECT snapshot.parent_snapshot_id FROM snapshot INNER JOIN recent USING (snapshot_id)"
+                 "     WHERE snapshot.parent_snapshot_id IS NOT NULL)"
+                 " INSERT OR IGNORE INTO repack_order(chunk_id)"
+                 " SELECT segment.chunk_id FROM revision"
+                 " INNER JOIN segment USING (content_id)"
+                 " WHERE revision.snapshot_id IN (SELECT snapshot_id FROM recent)"
+                 "   AND segment.chunk_id != 0"
+                 " ORDER BY revision.snapshot_id DESC, revision.revision_id ASC, segment.sequence ASC", c, &c->repack_collect_order)
+   || do_prepare("SELECT ord, chunk_id, length(body), hash FROM repack_order"
+                 " INNER JOIN chunk USING (chunk_id)"
+                 " WHERE ord > ? ORDER BY ord LIMIT 256", c, &c->repack_next_batch)
+   /* The copy takes its hash once the original is gone, as hashes are unique */
+   || do_prepare("INSERT INTO chunk(hash, body, refcount, crc)"
+                 " SELECT NULL, body, refcount, crc FROM chunk WHERE chunk_id = ?", c, &c->repack_copy_chunk)
+   || do_prepare("UPDATE chunk SET hash = ? WHERE chunk_id = ?", c, &c->repack_set_hash)
+   || do_prepare("UPDATE segment SET chunk_id = ? WHERE chunk_id = ?", c, &c->repack_move_segments)
+   || do_prepare("DELETE FROM chunk WHERE chunk_id = ?", c, &c->repack_delete_chunk)
+   || do_prepare("VACUUM", c, &c->vacuum)
+   || do_prepare("SELECT chunk_id, hash, body, crc FROM chunk"
+                 " WHERE chunk_id >= ? AND chunk_id < ?"
+                 " ORDER BY chunk_id", c, &c->scrub_chunks)
+   || do_prepare("SELECT content_id, hash FROM content"
+                 " WHERE content_id >= ? AND content_id < ?"
+                 " ORDER BY content_id", c, &c->scrub_contents)
+   || do_prepare("SELECT body, segment.length FROM segment"
+                 " LEFT JOIN chunk USING (chunk_id)"
+                 " WHERE content_id = ?"
+                 " ORDER BY sequence ASC", c, &c->select_content_chunks)
+   || do_prepare("SELECT ifnull(max(chunk_id), 0), (SELECT ifnull(max(content_id), 0) FROM content) FROM chunk", c, &c->select_max_ids)
+   || do_prepare("UPDATE content SET zero_length = ? WHERE content_id = ?", c, &c->set_content_zero_length)
+   || do_prepare("UPDATE content SET hash = ?, length = ?, zero_length = ? WHERE content_id = ?", c, &c->set_content_hash)
+   || do_prepare("SELECT content_id, length FROM content"
+                 " WHERE content_id = (SELECT content_id FROM revision WHERE revision_id = ?)", c, &c->select_revision_length)
+   || do_prepare("SELECT segment.chunk_id, segment.offset, segment.length, chunk.crc FROM segment"
+                 " LEFT JOIN chunk USING (chunk_id)"
+                 " WHERE content_id = ?1"
+                 "   AND offset >= (SELECT max(offset) FROM segment WHERE content_id = ?1 AND offset <= ?2)"
+                 " ORDER BY offset", c, &c->select_segments_from)
+   || do_prepare("SELECT revision_id FROM revision"
+                 " WHERE content_id IN (SELECT content_id FROM segment WHERE chunk_id = ?)"
+                 " ORDER BY revision_id", c, &c->select_chunk_revisions)
+   || do_prepare("SELECT revision_id FROM revision"
+                 " WHERE content_id = ?"
+                 " ORDER BY revision_id", c, &c->select_content_revisions)
+  ){
+    return 1;
+  }
+  return 0;
+}
+
+static int ctx_open(ctx *c, const char *path, int flags){
+  memset(c, 0, sizeof(*c));
+  int err = sqlite3_open_v2(path, &c->db, flags, NULL);
+  if( err ){
+    ctx_errmsg(c, sqlite3_mprintf("Can't open database: %s", sqlite3_errmsg(c->db)));
+    return 1;
+  }
+  
+  sqlite3_busy_timeout(c->db, 5000);
+  return 0;
+}
+
+int ctx_init(ctx *c, const char *path){
+  if( ctx_open(c, path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)
+   || ctx_create_schema(c)
+   || ctx_prepare_statements(c)
+  ){
+    return 1;
+  }
+  return 0;
+}
+
+int ctx_init_readonly(ctx *c, const char *path){
+  if( ctx_open(c, path, SQLITE_OPEN_READONLY)
+   || ctx_prepare_statements(c)
   ){
     return 1;
   }
   return 0;
 }
 
+/* Milliseconds since some epoch, from the VFS so it works everywhere SQLite does */
+sqlite3_int64 ctx_now_ms(void){
+  sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+  sqlite3_int64 t = 0;
+  if( vfs && vfs->iVersion>=2 && vfs->xCurrentTimeInt64 ){
+    vfs->xCurrentTimeInt64(vfs, &t);
+  }
+  return t;
+}
+
+const char *ctx_path(ctx *c){
+  return sqlite3_db_filename(c->db, "main");
+}
+
 int ctx_close(ctx *c){
+  idmap_free(&c->chunk_refs);
+  idmap_free(&c->content_refs);
+  idmap_free(&c->delta_seen);
+  free(c->parent_chain);
+  free(c->journal_pending);
+  chunk_hints_free(&c->hints);
+  chunk_cache_destroy(c->restore_cache);
+  sqlite3_stmt *stmt;
+  while( (stmt = sqlite3_next_stmt(c->db, NULL)) ) sqlite3_finalize(stmt);
   sqlite3_close(c->db);
   sqlite3_free(c->errmsg);
+  return 0;
 }
 
 int ctx_collect_err(ctx *c, int errcode){
@@ -154,7 +787,7 @@ int ctx_collect_err(ctx *c, int errcode){
   
   ctx_errmsg(c, sqlite3_mprintf("An internal error occurred.\n\n"
                               "Technical details: While %s, the following error occured: %s",
-                              sqlite3_errmsg(c->db)));
+                              c->err_context, sqlite3_errmsg(c->db)));
   return 1;
 }
 
@@ -173,6 +806,7 @@ static sqlite3_int64 ctx_get_file_id(ctx *c, const char *path){
     /* Insert a new file */
     if( ctx_collect_err(c, sqlite3_reset(c->insert_file)) ) goto insert_out;
     if( ctx_collect_err(c, sqlite3_bind_text(c->insert_file, 1, path, -1, SQLITE_STATIC)) ) goto insert_out;
+    if( ctx_collect_err(c, sqlite3_bind_text(c->insert_file, 2, path, (int)ctx_dir_length(path), SQLITE_STATIC)) ) goto insert_out;
     if( ctx_collect_err(c, sqlite3_step(c->insert_file)) ) goto insert_out;
     id = sqlite3_last_insert_rowid(c->db);
     
@@ -185,8 +819,6 @@ static sqlite3_int64 ctx_get_file_id(ctx *c, const char *path){
   return id;
 }
 
-#define MAX_CHUNK_SIZE 8000
-
 static int exec_simple(ctx *c, sqlite3_stmt *stmt){
   int err;
   if( !stmt ){
@@ -204,16 +836,26 @@ static int exec_simple(ctx *c, sqlite3_stmt *stmt){
   return 0;
 }
 
-static int ctx_begin_transaction(ctx *c){
+int ctx_begin_transaction(ctx *c){
   return exec_simple(c, c->begin_transaction);
 }
-static int ctx_rollback(ctx *c){
+int ctx_rollback(ctx *c){
   return exec_simple(c, c->rollback);
 }
-static int ctx_commit(ctx *c){
+int ctx_commit(ctx *c){
   return exec_simple(c, c->commit);
 }
 
+/* Run a statement that takes at most one id parameter and returns no rows. */
+int ctx_exec_with_id(ctx *c, sqlite3_stmt *stmt, sqlite3_int64 id){
+  int err = 0;
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( id && ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, id)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_step(stmt)) ) err = 1;
+  sqlite3_clear_bindings(stmt);
+  return err;
+}
+
 sqlite3_int64 ctx_find_chunk(ctx *c, unsigned char *hash){
   c->err_context = "finding a data chunk";
   sqlite3_int64 id = 0;
@@ -230,13 +872,14 @@ sqlite3_int64 ctx_find_chunk(ctx *c, unsigned char *hash){
   return id;
 }
 
-sqlite3_int64 ctx_store_chunk(ctx *c, unsigned char *hash, unsigned char *data, unsigned int data_len){
+sqlite3_int64 ctx_store_chunk(ctx *c, unsigned char *hash, unsigned char *data, unsigned int data_len, uint32_t crc){
   c->err_context = "storing a data chunk";
   
   sqlite3_int64 id = 0;
   if( ctx_collect_err(c, sqlite3_reset(c->insert_chunk)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_blob(c->insert_chunk, 1, hash, HASH_LENGTH, SQLITE_STATIC)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_blob(c->insert_chunk, 2, data, data_len, SQLITE_STATIC)) ) goto out;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_chunk, 3, (sqlite3_int64)crc)) ) goto out;
   if( ctx_collect_err(c, sqlite3_step(c->insert_chunk)) ) goto out;
   id = sqlite3_last_insert_rowid(c->db);
   
@@ -245,7 +888,7 @@ sqlite3_int64 ctx_store_chunk(ctx *c, unsigned char *hash, unsigned char *data,
   return id;
 }
 
-sqlite3_int64 ctx_store_segment(ctx *c, sqlite3_int64 content_id, unsigned int sequence, sqlite3_int64 chunk_id){
+sqlite3_int64 ctx_store_segment(ctx *c, sqlite3_int64 content_id, unsigned int sequence, sqlite3_int64 chunk_id, unsigned int length, sqlite3_int64 offset){
   c->err_context = "storing a segment";
   
   sqlite3_int64 id = 0;
@@ -253,6 +896,8 @@ sqlite3_int64 ctx_store_segment(ctx *c, sqlite3_int64 content_id, unsigned int s
   if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_segment, 1, content_id)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_segment, 2, (sqlite3_int64)sequence)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_segment, 3, chunk_id)) ) goto out;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_segment, 4, (sqlite3_int64)length)) ) goto out;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_segment, 5, offset)) ) goto out;
   if( ctx_collect_err(c, sqlite3_step(c->insert_segment)) ) goto out;
   id = sqlite3_last_insert_rowid(c->db);
   
@@ -277,12 +922,13 @@ sqlite3_int64 ctx_get_content_id(ctx *c, unsigned char *hash){
   return id;
 }
 
-sqlite3_int64 ctx_insert_content(ctx *c, unsigned char *hash){
+sqlite3_int64 ctx_insert_content(ctx *c, unsigned char *hash, sqlite3_int64 length){
   c->err_context = "storing a data chunk";
   
   sqlite3_int64 id = 0;
   if( ctx_collect_err(c, sqlite3_reset(c->insert_content)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_blob(c->insert_content, 1, hash, HASH_LENGTH, SQLITE_STATIC)) ) goto out;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_content, 2, length)) ) goto out;
   if( ctx_collect_err(c, sqlite3_step(c->insert_content)) ) goto out;
   id = sqlite3_last_insert_rowid(c->db);
   
@@ -290,152 +936,1117 @@ sqlite3_int64 ctx_insert_content(ctx *c, unsigned char *hash){
   ctx_collect_err(c, sqlite3_clear_bindings(c->insert_content));
   return id;
 }
-sqlite3_int64 ctx_add_revision(ctx *c, sqlite3_int64 file_id, sqlite3_int64 content_id){
-  c->err_context = "adding a revision";
-  
+int file_meta_matches(const file_meta *now, const file_meta *then, int level){
+  if( level==CTX_REUSE_NEVER ) return 0;
+  if( now->size<0 || now->mtime_ns<0 || now->size!=then->size || now->mtime_ns!=then->mtime_ns ) return 0;
+  if( level==CTX_REUSE_MTIME ) return 1;
+  return now->ctime_ns>=0 && now->ctime_ns==then->ctime_ns
+      && now->has_inode && then->has_inode
+      && now->inode==then->inode && now->device==then->device;
+}
+
+/* The content of file_id's latest revision outside the open snapshot, if
+** its metadata matches meta closely enough for c->reuse. 0 otherwise. */
+sqlite3_int64 ctx_reusable_content(ctx *c, sqlite3_int64 file_id, const file_meta *meta){
+  sqlite3_stmt *stmt = c->select_previous_revision;
+  sqlite3_int64 content_id = 0;
+  int step_result;
+  if( c->reuse==CTX_REUSE_NEVER ) return 0;
+
+  c->err_context = "looking up a file's previous revision";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 0;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, file_id)) ) return 0;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, c->creating_snapshot_id)) ) return 0;
+  if( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW
+   && sqlite3_column_type(stmt, 1)!=SQLITE_NULL && sqlite3_column_type(stmt, 2)!=SQLITE_NULL
+  ){
+    file_meta then;
+    then.size = sqlite3_column_int64(stmt, 1);
+    then.mtime_ns = sqlite3_column_int64(stmt, 2);
+    then.ctime_ns = sqlite3_column_type(stmt, 3)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 3);
+    then.has_inode = sqlite3_column_type(stmt, 4)!=SQLITE_NULL;
+    then.inode = sqlite3_column_int64(stmt, 4);
+    then.device = sqlite3_column_int64(stmt, 5);
+    if( file_meta_matches(meta, &then, c->reuse) ) content_id = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_reset(stmt);
+  return content_id;
+}
+
+void ctx_set_reuse(ctx *c, int level){
+  c->reuse = level;
+}
+
+/* Whether snapshot_id is the open delta snapshot's parent or one of its
+** ancestors. The chain runs newest first, so its ids descend. */
+static int ctx_in_parent_chain(ctx *c, sqlite3_int64 snapshot_id){
+  unsigned int lo = 0, hi = c->parent_chain_count;
+  while( lo<hi ){
+    unsigned int mid = lo + (hi-lo)/2;
+    if( c->parent_chain[mid]==snapshot_id ) return 1;
+    if( c->parent_chain[mid] > snapshot_id ){
+      lo = mid+1;
+    }else{
+      hi = mid;
+    }
+  }
+  return 0;
+}
+
+/* The parent's revision of file_id, if it has content_id and the same
+** metadata, so that the open delta snapshot need not record it. 0 if
+** not. */
+static sqlite3_int64 ctx_inherited_revision(ctx *c, sqlite3_int64 file_id, sqlite3_int64 content_id, const file_meta *meta){
+  sqlite3_stmt *stmt = c->select_file_history;
+  sqlite3_int64 revision_id = 0;
+  int step_result;
+  file_meta unknown;
+  if( !meta ){
+    file_meta_unknown(&unknown);
+    meta = &unknown;
+  }
+
+  c->err_context = "looking up a file in the parent snapshot";
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, file_id))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, c->parent_snapshot_id))
+  ){
+    return 0;
+  }
+  /* Newest first: in a straight line of snapshots the first row is it */
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( !ctx_in_parent_chain(c, sqlite3_column_int64(stmt, 1)) ) continue;
+    if( sqlite3_column_type(stmt, 2)!=SQLITE_NULL && sqlite3_column_int64(stmt, 2)==content_id ){
+      file_meta then;
+      then.size = sqlite3_column_type(stmt, 3)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 3);
+      then.mtime_ns = sqlite3_column_type(stmt, 4)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 4);
+      then.ctime_ns = sqlite3_column_type(stmt, 5)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 5);
+      then.has_inode = sqlite3_column_type(stmt, 6)!=SQLITE_NULL;
+      then.inode = sqlite3_column_int64(stmt, 6);
+      then.device = sqlite3_column_int64(stmt, 7);
+      if( (meta->size<0 ? -1 : meta->size)==then.size
+       && (meta->mtime_ns<0 ? -1 : meta->mtime_ns)==then.mtime_ns
+       && (meta->ctime_ns<0 ? -1 : meta->ctime_ns)==then.ctime_ns
+       && meta->has_inode==then.has_inode
+       && (!meta->has_inode || (meta->inode==then.inode && meta->device==then.device))
+      ){
+        revision_id = sqlite3_column_int64(stmt, 0);
+      }
+    }
+    break;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return revision_id;
+}
+
+sqlite3_int64 ctx_add_revision(ctx *c, sqlite3_int64 file_id, sqlite3_int64 content_id, const file_meta *meta){
   sqlite3_int64 id = 0;
+  if( c->parent_snapshot_id ){
+    if( idmap_add(&c->delta_seen, file_id, 1) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      return 0;
+    }
+    id = ctx_inherited_revision(c, file_id, content_id, meta);
+    if( id || c->errtype!=CTX_ERR_NONE ) return id;
+  }
+
+  c->err_context = "adding a revision";
   if( ctx_collect_err(c, sqlite3_reset(c->insert_revision)) ) goto out;
   if( ctx_collect_err(c, sqlite3_reset(c->insert_revision)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 1, file_id)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 2, c->creating_snapshot_id)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 3, content_id)) ) goto out;
+  if( meta ){
+    /* Unknown fields stay NULL */
+    if( meta->size>=0 && ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 4, meta->size)) ) goto out;
+    if( meta->mtime_ns>=0 && ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 5, meta->mtime_ns)) ) goto out;
+    if( meta->ctime_ns>=0 && ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 6, meta->ctime_ns)) ) goto out;
+    if( meta->has_inode && ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 7, meta->inode)) ) goto out;
+    if( meta->has_inode && ctx_collect_err(c, sqlite3_bind_int64(c->insert_revision, 8, meta->device)) ) goto out;
+  }
   if( ctx_collect_err(c, sqlite3_step(c->insert_revision)) ) goto out;
   id = sqlite3_last_insert_rowid(c->db);
+  if( idmap_add(&c->content_refs, content_id, 1) ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    id = 0;
+  }
   
   out:
   ctx_collect_err(c, sqlite3_clear_bindings(c->insert_revision));
   return id;
 }
 
-typedef struct handler_ctx {
-  ctx *c;
-  int64_t content_id;
-} handler_ctx;
-
-static int handle_chunk(unsigned int sequence, unsigned char *data, int data_len, void *ptr){
-  handler_ctx *info = (handler_ctx *)ptr;
+int ctx_record_chunk(handler_ctx *info, unsigned int sequence, unsigned char *data, int data_len, unsigned char *hash, uint32_t crc){
   ctx *c = info->c;
-  unsigned char hash[HASH_LENGTH];
-  if( blake2b(hash, data, NULL, HASH_LENGTH, (uint64_t)data_len, 0) ) return 1;
   
-  printf("Chunk: len=%d, hash=",data_len);
-  int i;
-  for( i=0; i<HASH_LENGTH; i++ ){
-    printf("%02x", hash[i]);
+  sequence += info->first_sequence;
+  if( data==NULL ){
+    /* A run of zeros: no chunk to find or store */
+    info->zero_length += data_len;
+    info->offset += data_len;
+    return ctx_store_segment(c, info->content_id, sequence, 0, (unsigned int)data_len, info->offset - data_len)==0;
   }
-  printf("\n");
   
-  sqlite3_int64 chunk_id = ctx_find_chunk(c, hash);
+  sqlite3_int64 chunk_id = chunk_hints_find(&c->hints, hash);
+  if( chunk_id ){
+    c->hints.hits++;
+  }else{
+    if( c->hints.count ) c->hints.misses++;
+    chunk_id = ctx_find_chunk(c, hash);
+  }
   if( chunk_id==0 ){
-    chunk_id = ctx_store_chunk(c, hash, data, data_len);
+    chunk_id = ctx_store_chunk(c, hash, data, data_len, crc);
     if( chunk_id==0 ) return 1;
   }
-  ctx_store_segment(c, info->content_id, sequence, chunk_id);
+  if( ctx_store_segment(c, info->content_id, sequence, chunk_id, (unsigned int)data_len, info->offset)==0 ) return 1;
+  info->offset += data_len;
+  if( idmap_add(&c->chunk_refs, chunk_id, 1) ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
   
   return 0;
 }
 
-sqlite_int64 ctx_ensure_content(ctx *c, FILE *f){
+static int handle_chunk(unsigned int sequence, unsigned char *data, int data_len, void *ptr){
+  handler_ctx *info = (handler_ctx *)ptr;
   unsigned char hash[HASH_LENGTH];
-  /* This gets used for reading the file once to get the overall hash,
-  ** and then again to build chunks if we have a new hash. It is sized
-  ** for that second task.  */
-  unsigned char buf[MAX_CHUNK_SIZE];
   
+  if( info->hasher ){
+    static const unsigned char zeros[4096];
+    int left = data_len;
+    while( data==NULL && left>0 ){
+      int piece = left<(int)sizeof(zeros) ? left : (int)sizeof(zeros);
+      blake2b_update(info->hasher, zeros, (uint64_t)piece);
+      left -= piece;
+    }
+    if( data ) blake2b_update(info->hasher, data, (uint64_t)data_len);
+  }
+  
+  if( data==NULL ) return ctx_record_chunk(info, sequence, NULL, data_len, NULL, 0);
+  if( blake2b(hash, data, NULL, HASH_LENGTH, (uint64_t)data_len, 0) ) return 1;
+  return ctx_record_chunk(info, sequence, data, data_len, hash, crc32c(data, data_len));
+}
+
+/* At most this many of a previous revision's chunks are loaded as hints */
+#define CHUNK_HINTS_MAX 65536
+
+/* Replace c->hints with the chunks of file_id's latest revision outside the
+** open snapshot, which a changed file mostly still has. */
+static int ctx_load_hints(ctx *c, sqlite3_int64 file_id){
+  sqlite3_stmt *stmt = c->select_previous_revision;
+  sqlite3_int64 previous = 0;
+  int step_result;
+
+  chunk_hints_clear(&c->hints);
+  c->err_context = "loading a file's previous chunks";
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, file_id))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, c->creating_snapshot_id))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
+    return 1;
+  }
+  if( step_result==SQLITE_ROW ) previous = sqlite3_column_int64(stmt, 0);
+  sqlite3_reset(stmt);
+  if( previous==0 ) return 0;
+
+  stmt = c->select_content_chunk_ids;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, previous))
+   || ctx_collect_err(c, sqlite3_bind_int(stmt, 2, CHUNK_HINTS_MAX))
+  ){
+    return 1;
+  }
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( sqlite3_column_bytes(stmt, 1)!=HASH_LENGTH ) continue;
+    if( chunk_hints_add(&c->hints, sqlite3_column_blob(stmt, 1), sqlite3_column_int64(stmt, 0)) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      break;
+    }
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return c->errtype!=CTX_ERR_NONE;
+}
+
+void ctx_chunk_hint_stats(ctx *c, sqlite3_int64 *hits, sqlite3_int64 *misses){
+  *hits = c->hints.hits;
+  *misses = c->hints.misses;
+}
+
+/* Chunk and store a content of the given length (-1 if unknown), through
+** the pipeline when it is big enough to be worth the threads. */
+static int ctx_chunk_content(handler_ctx *info, size_t (*read_fn)(void *src, unsigned char *buf, size_t len), void *src, sqlite3_int64 length){
+  unsigned char buf[MAX_CHUNK_SIZE];
+  if( length<0 || length>=INGEST_PIPELINE_MIN ){
+    return ingest_pipeline(info->c, read_fn, src, info);
+  }
+  return stream_to_chunks(read_fn, src, buf, MAX_CHUNK_SIZE, handle_chunk, info);
+}
+
+static int ctx_set_zero_length(ctx *c, sqlite3_int64 content_id, sqlite3_int64 zero_length){
+  if( zero_length==0 ) return 0;
+  c->err_context = "recording zero extents";
+  if( ctx_collect_err(c, sqlite3_reset(c->set_content_zero_length)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->set_content_zero_length, 1, zero_length)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->set_content_zero_length, 2, content_id)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_step(c->set_content_zero_length)) ) return 1;
+  return 0;
+}
+
+/* Contents of INGEST_PIPELINE_MIN or more keep, in content_tail, the state
+** their hash had reached at a multiple of TAIL_INTERVAL at least two
+** chunks short of the end. A later revision of the file that has the same
+** bytes with more after them can be hashed on from there, and chunked on
+** from its last boundary that the new bytes could not have moved. */
+#define TAIL_INTERVAL (1024*1024)
+#define TAIL_STATE_BYTES (12*8 + 2*BLAKE2B_BLOCKBYTES + 8 + 1)
+
+typedef struct hash_mark {
+  sqlite3_int64 offset; /* -1 if not reached */
+  blake2b_state state;
+} hash_mark;
+
+static void put_u64(unsigned char *p, uint64_t v){
+  int i;
+  for( i=0; i<8; i++ ) p[i] = (unsigned char)(v >> (8*i));
+}
+
+static uint64_t get_u64(const unsigned char *p){
+  uint64_t v = 0;
+  int i;
+  for( i=7; i>=0; i-- ) v = (v<<8) | p[i];
+  return v;
+}
+
+/* A hasher's state in a form that does not depend on the machine */
+static void tail_encode(const blake2b_state *b, unsigned char *out){
+  int i;
+  for( i=0; i<8; i++ ) put_u64(out + 8*i, b->h[i]);
+  put_u64(out + 64, b->t[0]);
+  put_u64(out + 72, b->t[1]);
+  put_u64(out + 80, b->f[0]);
+  put_u64(out + 88, b->f[1]);
+  memcpy(out + 96, b->buf, sizeof(b->buf));
+  put_u64(out + 96 + sizeof(b->buf), (uint64_t)b->buflen);
+  out[TAIL_STATE_BYTES-1] = b->last_node;
+}
+
+static int tail_decode(blake2b_state *b, const unsigned char *in, int len){
+  int i;
+  if( !in || len!=TAIL_STATE_BYTES ) return 1;
+  memset(b, 0, sizeof(*b));
+  for( i=0; i<8; i++ ) b->h[i] = get_u64(in + 8*i);
+  b->t[0] = get_u64(in + 64);
+  b->t[1] = get_u64(in + 72);
+  b->f[0] = get_u64(in + 80);
+  b->f[1] = get_u64(in + 88);
+  memcpy(b->buf, in + 96, sizeof(b->buf));
+  uint64_t buflen = get_u64(in + 96 + sizeof(b->buf));
+  if( buflen > sizeof(b->buf) ) return 1;
+  b->buflen = (size_t)buflen;
+  b->last_node = in[TAIL_STATE_BYTES-1];
+  return 0;
+}
+
+/* Hash the rest of f into b, which has taken *total bytes so far, keeping
+** the state at the last two multiples of TAIL_INTERVAL passed */
+static int hash_rest(FILE *f, blake2b_state *b, sqlite3_int64 *total, hash_mark marks[2]){
+  unsigned char buf[MAX_CHUNK_SIZE];
+  while( 1 ){
+    sqlite3_int64 to_mark = TAIL_INTERVAL - *total % TAIL_INTERVAL;
+    size_t want = to_mark < (sqlite3_int64)sizeof(buf) ? (size_t)to_mark : sizeof(buf);
+    size_t len = fread(buf, 1, want, f);
+    if( len==0 ) break;
+    blake2b_update(b, buf, len);
+    *total += len;
+    if( *total % TAIL_INTERVAL==0 ){
+      marks[0] = marks[1];
+      marks[1].offset = *total;
+      marks[1].state = *b;
+    }
+  }
+  return ferror(f);
+}
+
+static int ctx_store_tail(ctx *c, sqlite3_int64 content_id, const hash_mark marks[2], sqlite3_int64 length){
+  unsigned char state[TAIL_STATE_BYTES];
+  const hash_mark *m = NULL;
+  int i;
+  if( length < INGEST_PIPELINE_MIN ) return 0;
+  for( i=1; i>=0 && !m; i-- ){
+    if( marks[i].offset>=0 && marks[i].offset <= length - 2*MAX_CHUNK_SIZE ) m = &marks[i];
+  }
+  if( !m ) return 0;
+  tail_encode(&m->state, state);
+
+  c->err_context = "recording where a content's hash can resume";
+  int err = ctx_collect_err(c, sqlite3_reset(c->insert_content_tail))
+         || ctx_collect_err(c, sqlite3_bind_int64(c->insert_content_tail, 1, content_id))
+         || ctx_collect_err(c, sqlite3_bind_int64(c->insert_content_tail, 2, m->offset))
+         || ctx_collect_err(c, sqlite3_bind_blob(c->insert_content_tail, 3, state, TAIL_STATE_BYTES, SQLITE_STATIC))
+         || ctx_collect_err(c, sqlite3_step(c->insert_content_tail));
+  sqlite3_clear_bindings(c->insert_content_tail);
+  return err;
+}
+
+/* The content of f, chunked and stored if it is new. The chunks of
+** file_id's previous revision, if any, are tried first. */
+sqlite_int64 ctx_ensure_content(ctx *c, sqlite3_int64 file_id, FILE *f){
+  unsigned char hash[HASH_LENGTH];
+  /* The file is read once to get the overall hash. Chunking a new content
+  ** reads it again through its own buffers. */
+  hash_mark marks[2];
   blake2b_state b;
   blake2b_init(&b, HASH_LENGTH);
-  int len;
-  while( 0 < (len=fread(buf, 1, sizeof(buf), f)) ){
-    blake2b_update(&b, buf, len);
+  sqlite3_int64 total = 0;
+  marks[0].offset = marks[1].offset = -1;
+  if( hash_rest(f, &b, &total, marks) ){
+    ctx_errmsg(c, sqlite3_mprintf("Error reading file"));
+    return 0;
   }
   blake2b_final(&b, hash, HASH_LENGTH);
   
   sqlite_int64 content_id = ctx_get_content_id(c, hash);
-  printf("Got content id: %lld\n", content_id);
   if( content_id ) return content_id;
   
-  content_id = ctx_insert_content(c, hash);
+  content_id = ctx_insert_content(c, hash, total);
+  if( content_id==0 || ctx_load_hints(c, file_id) ) return 0;
   
   handler_ctx info;
   info.c = c;
   info.content_id = content_id;
+  info.zero_length = 0;
+  info.offset = 0;
+  info.hasher = NULL;
+  info.first_sequence = 0;
   fseek(f, 0, SEEK_SET);
-  if( file_to_chunks(f, buf, MAX_CHUNK_SIZE, handle_chunk, &info) ){
-    ctx_errmsg(c, sqlite3_mprintf("Error reading file"));
+  if( ctx_chunk_content(&info, read_from_file, f, total) ){
+    if( c->errtype==CTX_ERR_NONE ) ctx_errmsg(c, sqlite3_mprintf("Error reading file"));
     return 0;
   }
   
+  if( ctx_set_zero_length(c, content_id, info.zero_length) ) return 0;
+  if( ctx_store_tail(c, content_id, marks, total) ) return 0;
+  
   return content_id;
 }
 
+typedef struct limited_reader {
+  FILE *f;
+  sqlite3_int64 left;
+} limited_reader;
+
+/* read_from_file, stopping where the hash stopped even if the file grows */
+static size_t read_limited(void *src, unsigned char *buf, size_t len){
+  limited_reader *r = (limited_reader *)src;
+  if( (sqlite3_int64)len > r->left ) len = (size_t)r->left;
+  size_t got = len ? fread(buf, 1, len, r->f) : 0;
+  r->left -= got;
+  return got;
+}
+
+/* Whether the next len bytes of f are all zero */
+static int read_zeros(FILE *f, sqlite3_int64 len, unsigned char *buf, size_t buf_len){
+  while( len>0 ){
+    size_t want = len < (sqlite3_int64)buf_len ? (size_t)len : buf_len;
+    if( fread(buf, 1, want, f)!=want ) return 0;
+    size_t i;
+    for( i=0; i<want; i++ ){
+      if( buf[i] ) return 0;
+    }
+    len -= want;
+  }
+  return 1;
+}
+
+/* Seek f to offset from its start, which may be beyond 2 GB */
+static int seek_to(FILE *f, sqlite3_int64 offset){
+#ifdef _WIN32
+  return _fseeki64(f, offset, SEEK_SET);
+#else
+  /* Without large file support off_t may be too small for the offset */
+  if( (sqlite3_int64)(off_t)offset!=offset ) return -1;
+  return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+/* A segment that bytes beyond the verified ones might still have cut
+** differently. A chunk is cut by looking at most MAX_CHUNK_SIZE bytes from
+** its start, and a zero run by where the zeros end, so at most
+** MAX_CHUNK_SIZE+2 are ever unsettled at once. */
+typedef struct unsettled_segment {
+  sqlite3_int64 chunk_id;
+  sqlite3_int64 offset;
+  unsigned int length;
+} unsettled_segment;
+#define UNSETTLED_MAX (MAX_CHUNK_SIZE+2)
+
+/* The content for f when f starts out like the content of file_id's
+** previous revision. The old content's segments are checked against f in
+** order, by CRC-32C and then by their chunks' BLAKE2b hashes, as far as
+** they match. Those that bytes past that point could not have cut
+** differently are shared with the new content, and only what follows is
+** chunked. When the match reaches the hash state saved in the old
+** content's tail, only what follows that is hashed: the bytes before it
+** are known to be the ones the state was taken over.
+** Returns 0, with no error set, when nothing matches. */
+static sqlite3_int64 ctx_extend_content(ctx *c, sqlite3_int64 file_id, FILE *f, const file_meta *meta){
+  unsigned char buf[MAX_CHUNK_SIZE];
+  unsigned char hash[HASH_LENGTH];
+  blake2b_state b;
+  hash_mark marks[2];
+  sqlite3_stmt *stmt;
+  sqlite3_int64 previous = 0;
+  sqlite3_int64 hashed_to = -1;
+  sqlite3_int64 verified = 0;
+  sqlite3_int64 resume_at = 0;
+  sqlite3_int64 total;
+  sqlite3_int64 content_id = 0;
+  unsigned int settled = 0;
+  unsigned int sequence;
+  int step_result;
+  unsettled_segment *unsettled = NULL;
+  unsigned int unsettled_head = 0, unsettled_count = 0;
+  handler_ctx info;
+  limited_reader r;
+
+  if( c->reuse==CTX_REUSE_NEVER || meta->size < INGEST_PIPELINE_MIN ) return 0;
+
+  c->err_context = "looking up a file's previous content";
+  stmt = c->select_previous_revision;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, file_id))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, c->creating_snapshot_id))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
+    return 0;
+  }
+  if( step_result==SQLITE_ROW ) previous = sqlite3_column_int64(stmt, 0);
+  sqlite3_reset(stmt);
+  if( previous==0 ) return 0;
+
+  stmt = c->select_content_tail;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, previous))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
+    return 0;
+  }
+  if( step_result==SQLITE_ROW
+   && 0==tail_decode(&b, sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1))
+  ){
+    hashed_to = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_reset(stmt);
+
+  unsettled = malloc(UNSETTLED_MAX*sizeof(*unsettled));
+  if( !unsettled ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 0;
+  }
+  if( seek_to(f, 0) ) goto out;
+  stmt = c->select_content_segments;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, previous))
+  ){
+    goto out;
+  }
+  sequence = 0;
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_int64 length = sqlite3_column_int64(stmt, 1);
+    int matches;
+    if( chunk_id==0 ){
+      matches = read_zeros(f, length, buf, sizeof(buf));
+    }else{
+      /* The CRC turns most mismatches away cheaply, but only the hash
+      ** shows these are the bytes the old content was hashed over */
+      matches = sqlite3_column_type(stmt, 2)!=SQLITE_NULL
+             && sqlite3_column_bytes(stmt, 3)==HASH_LENGTH
+             && length>0 && length<=(sqlite3_int64)sizeof(buf)
+             && fread(buf, 1, (size_t)length, f)==(size_t)length
+             && crc32c(buf, (size_t)length)==(uint32_t)sqlite3_column_int64(stmt, 2)
+             && 0==blake2b(hash, buf, NULL, HASH_LENGTH, (uint64_t)length, 0)
+             && 0==memcmp(hash, sqlite3_column_blob(stmt, 3), HASH_LENGTH);
+    }
+    if( !matches ) break;
+
+    if( unsettled_head+unsettled_count==UNSETTLED_MAX ){
+      memmove(unsettled, unsettled+unsettled_head, unsettled_count*sizeof(unsettled[0]));
+      unsettled_head = 0;
+    }
+    unsettled[unsettled_head+unsettled_count].chunk_id = chunk_id;
+    unsettled[unsettled_head+unsettled_count].offset = verified;
+    unsettled[unsettled_head+unsettled_count].length = (unsigned int)length;
+    unsettled_count++;
+    verified += length;
+    sequence++;
+
+    while( unsettled_count ){
+      int fixed = unsettled[unsettled_head].chunk_id
+                ? unsettled[unsettled_head].offset + MAX_CHUNK_SIZE <= verified
+                : unsettled[unsettled_head].offset + unsettled[unsettled_head].length < verified;
+      if( !fixed ) break;
+      unsettled_head++;
+      unsettled_count--;
+      settled++;
+    }
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if( c->errtype!=CTX_ERR_NONE ) goto out;
+  resume_at = unsettled_count ? unsettled[unsettled_head].offset : verified;
+  if( settled==0 ) goto out;
+  if( resume_at < hashed_to || hashed_to<0 ){
+    /* Changed before the saved state, or none was saved */
+    blake2b_init(&b, HASH_LENGTH);
+    hashed_to = 0;
+  }
+
+  /* Hash from the saved state to the end */
+  marks[0].offset = -1;
+  marks[1].offset = hashed_to;
+  marks[1].state = b;
+  total = hashed_to;
+  if( seek_to(f, hashed_to) || hash_rest(f, &b, &total, marks) ){
+    ctx_errmsg(c, sqlite3_mprintf("Error reading file"));
+    goto out;
+  }
+  blake2b_final(&b, hash, HASH_LENGTH);
+  content_id = ctx_get_content_id(c, hash);
+  if( content_id || c->errtype!=CTX_ERR_NONE ) goto out;
+  content_id = ctx_insert_content(c, hash, total);
+  if( content_id==0 || ctx_load_hints(c, file_id) ) goto error_out;
+
+  /* The settled segments, shared */
+  info.c = c;
+  info.content_id = content_id;
+  info.zero_length = 0;
+  info.offset = 0;
+  info.hasher = NULL;
+  info.first_sequence = settled;
+  c->err_context = "sharing a previous content's segments";
+  stmt = c->select_content_segments;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, previous))
+  ){
+    goto error_out;
+  }
+  for( sequence=0; sequence<settled; sequence++ ){
+    if( ctx_collect_err(c, step_result=sqlite3_step(stmt)) || step_result!=SQLITE_ROW ) break;
+    sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+    unsigned int length = (unsigned int)sqlite3_column_int64(stmt, 1);
+    if( ctx_store_segment(c, content_id, sequence, chunk_id, length, info.offset)==0 ) break;
+    if( chunk_id && idmap_add(&c->chunk_refs, chunk_id, 1) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      break;
+    }
+    if( chunk_id==0 ) info.zero_length += length;
+    info.offset += length;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if( sequence<settled ){
+    if( c->errtype==CTX_ERR_NONE ) ctx_errmsg(c, sqlite3_mprintf("Content %lld changed while being extended", previous));
+    goto error_out;
+  }
+
+  /* The rest, chunked as if the whole file had been */
+  r.f = f;
+  r.left = total - info.offset;
+  if( seek_to(f, info.offset)
+   || ctx_chunk_content(&info, read_limited, &r, total - info.offset)
+  ){
+    if( c->errtype==CTX_ERR_NONE ) ctx_errmsg(c, sqlite3_mprintf("Error reading file"));
+    goto error_out;
+  }
+  if( ctx_set_zero_length(c, content_id, info.zero_length)
+   || ctx_store_tail(c, content_id, marks, total)
+  ){
+    goto error_out;
+  }
+
+out:
+  free(unsettled);
+  return content_id;
+
+error_out:
+  free(unsettled);
+  return 0;
+}
+
+/* Undo a content added under the stream_content savepoint. The chunk
+** references it added are taken back first, since they live in memory and
+** the rollback does not reach them. */
+static void ctx_discard_content(ctx *c, sqlite3_int64 content_id){
+  sqlite3_stmt *stmt = c->select_content_segments;
+  if( SQLITE_OK==sqlite3_reset(stmt) && SQLITE_OK==sqlite3_bind_int64(stmt, 1, content_id) ){
+    while( sqlite3_step(stmt)==SQLITE_ROW ){
+      sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+      if( chunk_id ) idmap_add(&c->chunk_refs, chunk_id, -1);
+    }
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  sqlite3_reset(c->rollback_content);
+  sqlite3_step(c->rollback_content);
+  sqlite3_reset(c->release_content);
+  sqlite3_step(c->release_content);
+}
+
+/* Like ctx_ensure_content, but for a stream that can only be read once.
+** The content is stored as it is read, before its hash is known, inside a
+** savepoint that is rolled back if the hash shows it was already there. */
+static sqlite3_int64 ctx_stream_content(ctx *c, size_t (*read_fn)(void *src, unsigned char *buf, size_t len), void *src, sqlite3_int64 length){
+  unsigned char hash[HASH_LENGTH];
+  blake2b_state b;
+  handler_ctx info;
+
+  blake2b_init(&b, HASH_LENGTH);
+  if( exec_simple(c, c->savepoint_content) ) return 0;
+  sqlite3_int64 content_id = ctx_insert_content(c, NULL, 0);
+  if( content_id==0 ){
+    ctx_discard_content(c, 0);
+    return 0;
+  }
+
+  info.c = c;
+  info.content_id = content_id;
+  info.zero_length = 0;
+  info.offset = 0;
+  info.hasher = &b;
+  info.first_sequence = 0;
+  if( ctx_chunk_content(&info, read_fn, src, length) ){
+    if( c->errtype==CTX_ERR_NONE ) ctx_errmsg(c, sqlite3_mprintf("Error reading file"));
+    ctx_discard_content(c, content_id);
+    return 0;
+  }
+  blake2b_final(&b, hash, HASH_LENGTH);
+
+  sqlite3_int64 existing = ctx_get_content_id(c, hash);
+  if( existing || c->errtype!=CTX_ERR_NONE ){
+    ctx_discard_content(c, content_id);
+    return existing;
+  }
+
+  c->err_context = "recording a streamed content";
+  if( ctx_collect_err(c, sqlite3_reset(c->set_content_hash))
+   || ctx_collect_err(c, sqlite3_bind_blob(c->set_content_hash, 1, hash, HASH_LENGTH, SQLITE_STATIC))
+   || ctx_collect_err(c, sqlite3_bind_int64(c->set_content_hash, 2, info.offset))
+   || ctx_collect_err(c, sqlite3_bind_int64(c->set_content_hash, 3, info.zero_length))
+   || ctx_collect_err(c, sqlite3_bind_int64(c->set_content_hash, 4, content_id))
+   || ctx_collect_err(c, sqlite3_step(c->set_content_hash))
+  ){
+    sqlite3_clear_bindings(c->set_content_hash);
+    ctx_discard_content(c, content_id);
+    return 0;
+  }
+  sqlite3_clear_bindings(c->set_content_hash);
+  if( exec_simple(c, c->release_content) ) return 0;
+  return content_id;
+}
+
+int ctx_add_reader_to_snapshot(ctx *c, const char *path, size_t (*read_fn)(void *src, unsigned char *buf, size_t len), void *src, sqlite3_int64 length, sqlite3_int64 mtime_ns){
+  sqlite3_int64 file_id = ctx_get_file_id(c, path);
+  if( file_id==0 || ctx_load_hints(c, file_id) ) return 1;
+  sqlite3_int64 content_id = ctx_stream_content(c, read_fn, src, length);
+  chunk_hints_clear(&c->hints);
+  if( content_id==0 ) return 1;
+  file_meta meta;
+  file_meta_unknown(&meta);
+  meta.mtime_ns = mtime_ns;
+  if( ctx_add_revision(c, file_id, content_id, &meta)==0 ) return 1;
+  return 0;
+}
+
+int ctx_add_stream_to_snapshot(ctx *c, const char *path, FILE *f, sqlite3_int64 mtime_ns){
+  return ctx_add_reader_to_snapshot(c, path, read_from_file, f, -1, mtime_ns);
+}
+
+int ctx_add_hashed_to_snapshot(ctx *c, const char *path, const unsigned char *hash, sqlite3_int64 length, const hashed_chunk *chunks, unsigned int chunk_count, const file_meta *meta){
+  sqlite3_int64 file_id = ctx_get_file_id(c, path);
+  if( file_id==0 ) return 1;
+  
+  sqlite3_int64 content_id = ctx_get_content_id(c, (unsigned char *)hash);
+  if( content_id==0 ){
+    if( c->errtype!=CTX_ERR_NONE ) return 1;
+    content_id = ctx_insert_content(c, (unsigned char *)hash, length);
+    if( content_id==0 || ctx_load_hints(c, file_id) ) return 1;
+    
+    handler_ctx info;
+    info.c = c;
+    info.content_id = content_id;
+    info.zero_length = 0;
+    info.offset = 0;
+    info.hasher = NULL;
+    info.first_sequence = 0;
+    unsigned int i;
+    int err = 0;
+    for( i=0; i<chunk_count && !err; i++ ){
+      const hashed_chunk *ch = &chunks[i];
+      err = ctx_record_chunk(&info, ch->sequence, (unsigned char *)ch->data, ch->length, (unsigned char *)ch->hash, ch->crc);
+    }
+    chunk_hints_clear(&c->hints);
+    if( err || ctx_set_zero_length(c, content_id, info.zero_length) ) return 1;
+  }
+  
+  if( ctx_add_revision(c, file_id, content_id, meta)==0 ) return 1;
+  return 0;
+}
+
+int ctx_add_known_to_snapshot(ctx *c, const char *path, sqlite3_int64 content_id, const file_meta *meta){
+  sqlite3_int64 file_id = ctx_get_file_id(c, path);
+  if( file_id==0 ) return 1;
+  if( ctx_add_revision(c, file_id, content_id, meta)==0 ) return 1;
+  return 0;
+}
+
+void file_meta_unknown(file_meta *meta){
+  meta->size = -1;
+  meta->mtime_ns = -1;
+  meta->ctime_ns = -1;
+  meta->has_inode = 0;
+  meta->inode = 0;
+  meta->device = 0;
+}
+
+/* What stat says about an open file, as far as it is known */
+static void file_meta_of(FILE *f, file_meta *meta){
+  file_meta_unknown(meta);
+#ifdef _WIN32
+  struct _stat64 st;
+  if( _fstat64(_fileno(f), &st) ) return;
+  meta->size = (sqlite3_int64)st.st_size;
+  meta->mtime_ns = (sqlite3_int64)st.st_mtime*1000000000;
+#else
+  struct stat st;
+  if( fstat(fileno(f), &st) ) return;
+  file_meta_from_stat(meta, &st);
+#endif
+}
+
+#ifndef _WIN32
+void file_meta_from_stat(file_meta *meta, const struct stat *st){
+  meta->size = (sqlite3_int64)st->st_size;
+  meta->mtime_ns = (sqlite3_int64)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+  meta->ctime_ns = (sqlite3_int64)st->st_ctim.tv_sec*1000000000 + st->st_ctim.tv_nsec;
+  meta->has_inode = 1;
+  meta->inode = (sqlite3_int64)st->st_ino;
+  meta->device = (sqlite3_int64)st->st_dev;
+}
+#endif
+
+int blake2b_file(FILE *f, unsigned char *hash){
+  unsigned char buf[MAX_CHUNK_SIZE];
+  blake2b_state b;
+  size_t len;
+  blake2b_init(&b, HASH_LENGTH);
+  while( 0 < (len=fread(buf, 1, sizeof(buf), f)) ){
+    blake2b_update(&b, buf, len);
+  }
+  if( ferror(f) ) return 1;
+  return blake2b_final(&b, hash, HASH_LENGTH);
+}
+
 int ctx_add_to_snapshot(ctx *c, const char *path, FILE *f){
-  printf("Adding to snapshot: %s\n", path);
   int file_id = ctx_get_file_id(c, path);
   if( file_id==0 ) goto error_out;
   
-  int content_id = ctx_ensure_content(c, f);
+  file_meta meta;
+  file_meta_of(f, &meta);
+  sqlite3_int64 content_id = ctx_reusable_content(c, file_id, &meta);
+  if( content_id==0 && c->errtype==CTX_ERR_NONE ) content_id = ctx_extend_content(c, file_id, f, &meta);
+  if( content_id==0 ){
+    if( c->errtype!=CTX_ERR_NONE ) goto error_out;
+    fseek(f, 0, SEEK_SET);
+    content_id = ctx_ensure_content(c, file_id, f);
+  }
+  chunk_hints_clear(&c->hints);
   if( content_id==0 ) goto error_out;
   
-  int revision_id = ctx_add_revision(c, file_id, content_id);
-  if( file_id==0 ) goto error_out;
+  sqlite3_int64 revision_id = ctx_add_revision(c, file_id, content_id, &meta);
+  if( revision_id==0 ) goto error_out;
   
   return 0;
 error_out:
   return 1;
 }
 
-int ctx_begin_snapshot(ctx *c, const char *note){
-  c->err_context = "beginning a snapshot";
-  c->creating_snapshot_id = 0;
-  
-  if( ctx_begin_transaction(c) ) goto out;
-  
+/* Forget the open snapshot's parent, if it had one */
+static void ctx_end_delta(ctx *c){
+  c->parent_snapshot_id = 0;
+  free(c->parent_chain);
+  c->parent_chain = NULL;
+  c->parent_chain_count = 0;
+  idmap_clear(&c->delta_seen);
+}
+
+/* Add the snapshot row, inside the transaction already begun */
+static int ctx_insert_snapshot(ctx *c, const char *note, sqlite3_int64 parent_snapshot_id){
   if( ctx_collect_err(c, sqlite3_reset(c->insert_snapshot)) ) goto out;
   if( ctx_collect_err(c, sqlite3_reset(c->insert_snapshot)) ) goto out;
   if( ctx_collect_err(c, sqlite3_bind_text(c->insert_snapshot, 1, note, -1, SQLITE_STATIC)) ) goto out;
+  if( parent_snapshot_id && ctx_collect_err(c, sqlite3_bind_int64(c->insert_snapshot, 2, parent_snapshot_id)) ) goto out;
   if( ctx_collect_err(c, sqlite3_step(c->insert_snapshot)) ) goto out;
   c->creating_snapshot_id = sqlite3_last_insert_rowid(c->db);
   
   out:
   ctx_collect_err(c, sqlite3_clear_bindings(c->insert_snapshot));
+  return c->creating_snapshot_id==0;
+}
+
+int ctx_begin_snapshot(ctx *c, const char *note){
+  c->err_context = "beginning a snapshot";
+  c->creating_snapshot_id = 0;
+  ctx_end_delta(c);
+  
+  if( ctx_begin_transaction(c) ) return 1;
+  return ctx_insert_snapshot(c, note, 0);
+}
+
+/* Load the chain of snapshots that parent_snapshot_id resolves through */
+static int ctx_load_parent_chain(ctx *c, sqlite3_int64 parent_snapshot_id){
+  sqlite3_stmt *stmt = c->select_snapshot_chain;
+  unsigned int capacity = 0;
+  int step_result;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, parent_snapshot_id))
+  ){
+    return 1;
+  }
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( c->parent_chain_count==capacity ){
+      capacity = capacity ? capacity*2 : 16;
+      sqlite3_int64 *grown = realloc(c->parent_chain, capacity*sizeof(*grown));
+      if( !grown ){
+        ctx_errtype(c, CTX_ERR_NO_MEMORY);
+        break;
+      }
+      c->parent_chain = grown;
+    }
+    c->parent_chain[c->parent_chain_count++] = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return c->errtype!=CTX_ERR_NONE;
+}
+
+int ctx_begin_delta_snapshot(ctx *c, const char *note, sqlite3_int64 parent_snapshot_id){
+  int step_result;
+  c->err_context = "beginning a snapshot";
+  c->creating_snapshot_id = 0;
+  ctx_end_delta(c);
+  
+  if( ctx_begin_transaction(c) ) return 1;
+  if( parent_snapshot_id==0 ){
+    if( ctx_collect_err(c, sqlite3_reset(c->select_latest_snapshot))
+     || ctx_collect_err(c, step_result=sqlite3_step(c->select_latest_snapshot))
+    ){
+      goto error_out;
+    }
+    if( step_result==SQLITE_ROW ) parent_snapshot_id = sqlite3_column_int64(c->select_latest_snapshot, 0);
+    sqlite3_reset(c->select_latest_snapshot);
+  }else{
+    if( ctx_collect_err(c, sqlite3_reset(c->select_snapshot_exists))
+     || ctx_collect_err(c, sqlite3_bind_int64(c->select_snapshot_exists, 1, parent_snapshot_id))
+     || ctx_collect_err(c, step_result=sqlite3_step(c->select_snapshot_exists))
+    ){
+      goto error_out;
+    }
+    sqlite3_reset(c->select_snapshot_exists);
+    if( step_result!=SQLITE_ROW ){
+      ctx_errmsg(c, sqlite3_mprintf("There is no snapshot %lld", parent_snapshot_id));
+      goto error_out;
+    }
+  }
+  
+  if( parent_snapshot_id && ctx_load_parent_chain(c, parent_snapshot_id) ) goto error_out;
+  if( ctx_insert_snapshot(c, note, parent_snapshot_id) ) goto error_out;
+  c->parent_snapshot_id = parent_snapshot_id;
+  return 0;
+
+error_out:
+  ctx_end_delta(c);
+  ctx_rollback(c);
+  return 1;
+}
+
+/* A tombstone in the open delta snapshot for every file its parent has
+** that was not added to it */
+static int ctx_bury_unseen(ctx *c){
+  sqlite3_stmt *stmt = c->select_snapshot_file_ids;
+  sqlite3_int64 *gone = NULL;
+  size_t count = 0, capacity = 0, i;
+  int step_result;
+  int err = 0;
+
+  c->err_context = "recording deleted files";
+  /* Collected first, so the revision table is not written while it is read */
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, c->parent_snapshot_id))
+  ){
+    return 1;
+  }
+  while( 0==(err=ctx_collect_err(c, step_result=sqlite3_step(stmt))) && step_result==SQLITE_ROW ){
+    sqlite3_int64 file_id = sqlite3_column_int64(stmt, 0);
+    if( idmap_get(&c->delta_seen, file_id) ) continue;
+    if( count==capacity ){
+      capacity = capacity ? capacity*2 : 64;
+      sqlite3_int64 *grown = realloc(gone, capacity*sizeof(*grown));
+      if( !grown ){
+        ctx_errtype(c, CTX_ERR_NO_MEMORY);
+        err = 1;
+        break;
+      }
+      gone = grown;
+    }
+    gone[count++] = file_id;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  stmt = c->insert_revision;
+  for( i=0; i<count && !err; i++ ){
+    err = ctx_collect_err(c, sqlite3_reset(stmt))
+       || ctx_collect_err(c, sqlite3_clear_bindings(stmt))
+       || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, gone[i]))
+       || ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, c->creating_snapshot_id))
+       || ctx_collect_err(c, sqlite3_step(stmt));
+  }
+  sqlite3_clear_bindings(stmt);
+  free(gone);
+  return err;
+}
+
+/* Apply the reference counts accumulated in memory during a snapshot, one
+** UPDATE per distinct row rather than one per segment or revision.
+*/
+static int ctx_flush_refs(ctx *c, idmap *m, sqlite3_stmt *stmt){
+  unsigned int i;
+  for( i=0; i<m->capacity; i++ ){
+    if( m->keys[i]==0 || m->values[i]==0 ) continue;
+    if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+    if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, m->values[i])) ) return 1;
+    if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, m->keys[i])) ) return 1;
+    if( ctx_collect_err(c, sqlite3_step(stmt)) ) return 1;
+  }
+  idmap_clear(m);
+  return 0;
 }
 
 int ctx_finish_snapshot(ctx *c){
-  return ctx_commit(c);
+  sqlite3_int64 snapshot_id = c->creating_snapshot_id;
+  int err;
+
+  chunk_hints_clear(&c->hints);
+  if( (c->parent_snapshot_id && ctx_bury_unseen(c)) || ctx_hash_directories(c) ){
+    ctx_abort_snapshot(c);
+    return 1;
+  }
+  c->err_context = "updating reference counts";
+  c->creating_snapshot_id = 0;
+  ctx_end_delta(c);
+  if( ctx_flush_refs(c, &c->chunk_refs, c->add_chunk_refs)
+   || ctx_flush_refs(c, &c->content_refs, c->add_content_refs)
+  ){
+    ctx_abort_snapshot(c);
+    return 1;
+  }
+  err = ctx_commit(c);
+  /* A journal may only count on the snapshot once it is sure to stay */
+  if( !err ) err = journal_confirm(c, snapshot_id);
+  free(c->journal_pending);
+  c->journal_pending = NULL;
+  return err;
 }
 
 int ctx_abort_snapshot(ctx *c){
+  c->creating_snapshot_id = 0;
+  chunk_hints_clear(&c->hints);
+  ctx_end_delta(c);
+  idmap_clear(&c->chunk_refs);
+  idmap_clear(&c->content_refs);
+  free(c->journal_pending);
+  c->journal_pending = NULL;
   return ctx_rollback(c);
 }
 
-int ctx_spew(ctx *c, const char *dest_path, sqlite3_int64 revision_id){
-  /* TODO: Consider encoding of dest_path */
-  FILE *f = fopen(dest_path, "wb+");
-  if( !f ){
-    ctx_errmsg(c, sqlite3_mprintf("Could not write to %s", dest_path));
+/* Give each snapshot made relative to snapshot_id a copy of every revision
+** and directory hash of it that the child did not override, revisions with
+** a reference of their own, and make the child relative to snapshot_id's
+** parent instead. Tombstones are dropped from children left with no
+** parent, where they mean nothing. */
+static int ctx_hand_down_revisions(ctx *c, sqlite3_int64 snapshot_id){
+  sqlite3_stmt *stmt = c->select_max_revision_id;
+  sqlite3_int64 since = 0;
+  int step_result;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
     return 1;
   }
-  
-  if( ctx_collect_err(c, sqlite3_reset(c->select_revision_chunks)) ) goto out;
-  if( ctx_collect_err(c, sqlite3_bind_int64(c->select_revision_chunks, 1, revision_id)) ) goto out;
-  int step_result;
-  while( 0==ctx_collect_err(c, step_result=sqlite3_step(c->select_revision_chunks)) && step_result==SQLITE_ROW) {
-    const void *contents = sqlite3_column_blob(c->select_revision_chunks, 0);
-    int contents_len = sqlite3_column_bytes(c->select_revision_chunks, 0);
-    if( contents==NULL || contents_len<=0){
-      ctx_errmsg(c, sqlite3_mprintf("Got an invalid file chunk while restoring a revision"));
-      goto out;
-    }
-    size_t written = fwrite(contents, 1, (unsigned int)contents_len, f);
-    if( written!=(unsigned int)contents_len ){
-      ctx_errmsg(c, sqlite3_mprintf("Error writing to %s", dest_path));
-      goto out;
+  if( step_result==SQLITE_ROW ) since = sqlite3_column_int64(stmt, 0);
+  sqlite3_reset(stmt);
+
+  if( ctx_exec_with_id(c, c->inherit_child_revisions, snapshot_id) ) return 1;
+  stmt = c->select_revisions_since;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, since))
+  ){
+    return 1;
+  }
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( idmap_add(&c->content_refs, sqlite3_column_int64(stmt, 0), 1) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      break;
     }
   }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if( c->errtype!=CTX_ERR_NONE || ctx_flush_refs(c, &c->content_refs, c->add_content_refs) ){
+    idmap_clear(&c->content_refs);
+    return 1;
+  }
+  return ctx_exec_with_id(c, c->drop_rootless_tombstones, snapshot_id)
+      || ctx_exec_with_id(c, c->inherit_child_directories, snapshot_id)
+      || ctx_exec_with_id(c, c->drop_rootless_directories, snapshot_id)
+      || ctx_exec_with_id(c, c->reparent_children, snapshot_id);
+}
+
+int ctx_delete_snapshot(ctx *c, sqlite3_int64 snapshot_id){
+  if( c->creating_snapshot_id ){
+    ctx_errmsg(c, sqlite3_mprintf("Cannot delete a snapshot while another is being created"));
+    return 1;
+  }
+  if( ctx_begin_transaction(c) ) return 1;
   
-  out:
+  c->err_context = "deleting a snapshot";
+  if( ctx_hand_down_revisions(c, snapshot_id) ){
+    ctx_rollback(c);
+    return 1;
+  }
+  /* Revisions release their contents; any content left with no revisions
+  ** releases its chunks, and chunks left with no segments are dropped. Each
+  ** step only touches rows reachable from the snapshot being deleted. */
+  if( ctx_exec_with_id(c, c->release_snapshot_contents, snapshot_id)
+   || ctx_exec_with_id(c, c->delete_snapshot_revisions, snapshot_id)
+   || ctx_exec_with_id(c, c->delete_snapshot_directories, snapshot_id)
+   || ctx_exec_with_id(c, c->clear_dead_chunks, 0)
+   || ctx_exec_with_id(c, c->collect_dead_chunks, 0)
+   || ctx_exec_with_id(c, c->release_dead_chunks, 0)
+   || ctx_exec_with_id(c, c->delete_dead_segments, 0)
+   || ctx_exec_with_id(c, c->delete_dead_tails, 0)
+   || ctx_exec_with_id(c, c->delete_dead_contents, 0)
+   || ctx_exec_with_id(c, c->delete_dead_chunks, 0)
+   || ctx_exec_with_id(c, c->clear_dead_chunks, 0)
+   || ctx_exec_with_id(c, c->delete_snapshot, snapshot_id)
+  ){
+    ctx_rollback(c);
+    return 1;
+  }
   
-  ctx_collect_err(c, sqlite3_clear_bindings(c->select_revision_chunks));
-  fclose(f);
-  return c->errtype != CTX_ERR_NONE;
-}
\ No newline at end of file
+  return ctx_commit(c);
+}
@@ -0,0 +1,201 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <string.h>
+
+/* Snapshot diffs.
+**
+** Each side streams, in file_id order, the files it has among those that
+** could differ, and the two streams are merged: a file_id on one side
+** only was added or removed, and one on both was modified or touched if
+** its revisions disagree. Neither side is held in memory. Snapshots whose
+** chains meet skip the files both inherit from a shared ancestor; others
+** skip the directories whose hashes agree, using the diff_dir table.
+*/
+
+static sqlite3_int64 column_or(sqlite3_stmt *stmt, int column, sqlite3_int64 otherwise){
+  return sqlite3_column_type(stmt, column)==SQLITE_NULL ? otherwise : sqlite3_column_int64(stmt, column);
+}
+
+static int diff_note_dir(void *arg, const char *path){
+  ctx *c = (ctx *)arg;
+  sqlite3_stmt *stmt = c->insert_diff_dir;
+  int err = ctx_collect_err(c, sqlite3_reset(stmt))
+         || ctx_collect_err(c, sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC))
+         || ctx_collect_err(c, sqlite3_step(stmt));
+  sqlite3_clear_bindings(stmt);
+  return err;
+}
+
+/* Choose the statements for each side: by directory when the two chains
+** are apart and both have directory hashes, filling in diff_dir */
+static int diff_choose_sides(ctx *c, sqlite3_int64 from_snapshot_id, sqlite3_int64 to_snapshot_id,
+                             sqlite3_stmt **from, sqlite3_stmt **to){
+  sqlite3_stmt *stmt = c->select_chains_meet;
+  int step_result, from_has, to_has;
+
+  *from = c->select_diff_from;
+  *to = c->select_diff_to;
+  c->err_context = "comparing snapshots";
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, from_snapshot_id))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, to_snapshot_id))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
+    return 1;
+  }
+  sqlite3_reset(stmt);
+  if( step_result==SQLITE_ROW ) return 0;
+  if( ctx_has_directory_hashes(c, from_snapshot_id, &from_has)
+   || ctx_has_directory_hashes(c, to_snapshot_id, &to_has)
+  ){
+    return 1;
+  }
+  if( !from_has || !to_has ) return 0;
+
+  if( ctx_exec_with_id(c, c->clear_diff_dirs, 0)
+   || ctx_changed_dirs(c, from_snapshot_id, to_snapshot_id, diff_note_dir, c)
+  ){
+    return 1;
+  }
+  *from = c->select_diff_dirs_from;
+  *to = c->select_diff_dirs_to;
+  return 0;
+}
+
+/* Count e->to_content_id's chunks and those e->from_content_id lacks */
+static int diff_count_chunks(ctx *c, ctx_diff_entry *e){
+  sqlite3_stmt *stmt = c->select_chunk_changes;
+  int step_result;
+
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, e->from_content_id ? sqlite3_bind_int64(stmt, 1, e->from_content_id) : sqlite3_bind_null(stmt, 1))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, e->to_content_id))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
+    return 1;
+  }
+  if( step_result==SQLITE_ROW ){
+    e->chunks = sqlite3_column_int64(stmt, 0);
+    e->new_chunks = sqlite3_column_int64(stmt, 1);
+    e->new_bytes = sqlite3_column_int64(stmt, 2);
+  }
+  sqlite3_reset(stmt);
+  return 0;
+}
+
+int ctx_diff_snapshots(ctx *c, sqlite3_int64 from_snapshot_id, sqlite3_int64 to_snapshot_id,
+                       const ctx_diff_opts *opts, ctx_diff_stats *stats){
+  sqlite3_stmt *from, *to;
+  int from_result, to_result;
+  ctx_diff_stats local_stats;
+  int err = 1;
+  int i;
+
+  if( !stats ) stats = &local_stats;
+  memset(stats, 0, sizeof(*stats));
+
+  c->err_context = "finding the snapshots to compare";
+  for( i=0; i<2; i++ ){
+    sqlite3_int64 snapshot_id = i ? to_snapshot_id : from_snapshot_id;
+    int step_result;
+    if( ctx_collect_err(c, sqlite3_reset(c->select_snapshot_exists))
+     || ctx_collect_err(c, sqlite3_bind_int64(c->select_snapshot_exists, 1, snapshot_id))
+     || ctx_collect_err(c, step_result=sqlite3_step(c->select_snapshot_exists))
+    ){
+      return 1;
+    }
+    sqlite3_reset(c->select_snapshot_exists);
+    if( step_result!=SQLITE_ROW ){
+      ctx_errmsg(c, sqlite3_mprintf("There is no snapshot %lld", snapshot_id));
+      return 1;
+    }
+  }
+
+  if( diff_choose_sides(c, from_snapshot_id, to_snapshot_id, &from, &to) ) return 1;
+  c->err_context = "comparing snapshots";
+  if( ctx_collect_err(c, sqlite3_reset(from))
+   || ctx_collect_err(c, sqlite3_bind_int64(from, 1, from_snapshot_id))
+   || ctx_collect_err(c, sqlite3_bind_int64(from, 2, to_snapshot_id))
+   || ctx_collect_err(c, from_result=sqlite3_step(from))
+   || ctx_collect_err(c, sqlite3_reset(to))
+   || ctx_collect_err(c, sqlite3_bind_int64(to, 1, to_snapshot_id))
+   || ctx_collect_err(c, sqlite3_bind_int64(to, 2, from_snapshot_id))
+   || ctx_collect_err(c, to_result=sqlite3_step(to))
+  ){
+    goto out;
+  }
+  while( from_result==SQLITE_ROW || to_result==SQLITE_ROW ){
+    sqlite3_int64 from_file_id = from_result==SQLITE_ROW ? sqlite3_column_int64(from, 0) : 0;
+    sqlite3_int64 to_file_id = to_result==SQLITE_ROW ? sqlite3_column_int64(to, 0) : 0;
+    int order = from_result!=SQLITE_ROW ? 1 : to_result!=SQLITE_ROW ? -1
+              : from_file_id<to_file_id ? -1 : from_file_id>to_file_id;
+    ctx_diff_entry e;
+
+    memset(&e, 0, sizeof(e));
+    if( order<0 ){
+      e.change = CTX_DIFF_REMOVED;
+      e.file_id = from_file_id;
+      e.path = (const char *)sqlite3_column_text(from, 1);
+      e.from_content_id = sqlite3_column_int64(from, 2);
+      stats->removed++;
+    }else{
+      e.file_id = to_file_id;
+      e.path = (const char *)sqlite3_column_text(to, 1);
+      e.to_content_id = sqlite3_column_int64(to, 2);
+      if( order>0 ){
+        e.change = CTX_DIFF_ADDED;
+        stats->added++;
+      }else{
+        e.from_content_id = sqlite3_column_int64(from, 2);
+        if( e.from_content_id!=e.to_content_id ){
+          e.change = CTX_DIFF_MODIFIED;
+          stats->modified++;
+        }else if( column_or(from, 3, -1)!=column_or(to, 3, -1)
+               || column_or(from, 4, -1)!=column_or(to, 4, -1)
+        ){
+          e.change = CTX_DIFF_TOUCHED;
+          stats->touched++;
+        }
+      }
+    }
+
+    if( e.change ){
+      if( opts->chunks && (e.change==CTX_DIFF_ADDED || e.change==CTX_DIFF_MODIFIED) ){
+        if( diff_count_chunks(c, &e) ) goto out;
+        stats->new_chunks += e.new_chunks;
+        stats->new_bytes += e.new_bytes;
+      }
+      if( opts->each && (err = opts->each(opts->arg, &e))!=0 ) goto out;
+      err = 1;
+    }
+
+    if( order<=0 && ctx_collect_err(c, from_result=sqlite3_step(from)) ) goto out;
+    if( order>=0 && ctx_collect_err(c, to_result=sqlite3_step(to)) ) goto out;
+  }
+  err = 0;
+
+out:
+  sqlite3_reset(from);
+  sqlite3_clear_bindings(from);
+  sqlite3_reset(to);
+  sqlite3_clear_bindings(to);
+  return err;
+}
@@ -18,18 +18,60 @@
 */
 
 #include <stdio.h>
+#include <stdint.h>
 #include "sqlite3.h"
 
 #define CTX_ERR_NONE 0
 #define CTX_ERR_MESSAGE 1
 #define CTX_ERR_NO_MEMORY 2
 
+/* Pending reference count changes, keyed by row id. Counts are accumulated
+** here while a snapshot is being built and written out when it commits.
+*/
+typedef struct idmap {
+  sqlite3_int64 *keys;
+  sqlite3_int64 *values;
+  unsigned int capacity;
+  unsigned int count;
+} idmap;
+
+int idmap_add(idmap *m, sqlite3_int64 key, sqlite3_int64 delta);
+/* The count for key, 0 if it has none */
+sqlite3_int64 idmap_get(const idmap *m, sqlite3_int64 key);
+void idmap_clear(idmap *m);
+void idmap_free(idmap *m);
+
+/* Chunk ids by chunk hash, for the chunks of the previous revision of the
+** file being added. It holds one file's worth at a time, so it stays small
+** and is looked in before the chunk table's hash index.
+*/
+typedef struct chunk_hints {
+  unsigned char *hashes; /* HASH_LENGTH bytes per slot */
+  sqlite3_int64 *ids;
+  unsigned int capacity;
+  unsigned int count;
+  sqlite3_int64 hits; /* Chunks found in the hints */
+  sqlite3_int64 misses; /* Chunks looked for in vain while hints were loaded */
+} chunk_hints;
+
+int chunk_hints_add(chunk_hints *h, const unsigned char *hash, sqlite3_int64 chunk_id);
+/* The chunk id for hash, or 0 if it is not among the hints */
+sqlite3_int64 chunk_hints_find(const chunk_hints *h, const unsigned char *hash);
+/* Forget the hints, but not the hit counts */
+void chunk_hints_clear(chunk_hints *h);
+void chunk_hints_free(chunk_hints *h);
+
+typedef struct chunk_cache chunk_cache;
+
 typedef struct ctx {
   sqlite3 *db;
   
   sqlite3_stmt *begin_transaction;
   sqlite3_stmt *rollback;
   sqlite3_stmt *commit;
+  sqlite3_stmt *savepoint_content;
+  sqlite3_stmt *release_content;
+  sqlite3_stmt *rollback_content;
   
   sqlite3_stmt *insert_snapshot;
   sqlite3_stmt *lookup_file_id;
@@ -41,27 +83,314 @@ typedef struct ctx {
   sqlite3_stmt *select_content_id;
   sqlite3_stmt *insert_content;
 
-  sqlite3_stmt *select_revision_chunks;
+  sqlite3_stmt *select_revision_content;
+  sqlite3_stmt *select_content_segments;
+  sqlite3_stmt *select_snapshot_entries;
+
+  sqlite3_stmt *add_chunk_refs;
+  sqlite3_stmt *add_content_refs;
+  sqlite3_stmt *release_snapshot_contents;
+  sqlite3_stmt *delete_snapshot_revisions;
+  sqlite3_stmt *clear_dead_chunks;
+  sqlite3_stmt *collect_dead_chunks;
+  sqlite3_stmt *release_dead_chunks;
+  sqlite3_stmt *delete_dead_segments;
+  sqlite3_stmt *delete_dead_contents;
+  sqlite3_stmt *delete_dead_chunks;
+  sqlite3_stmt *delete_snapshot;
+
+  sqlite3_stmt *repack_clear_order;
+  sqlite3_stmt *repack_collect_order;
+  sqlite3_stmt *repack_next_batch;
+  sqlite3_stmt *repack_copy_chunk;
+  sqlite3_stmt *repack_set_hash;
+  sqlite3_stmt *repack_move_segments;
+  sqlite3_stmt *repack_delete_chunk;
+  sqlite3_stmt *vacuum;
+
+  sqlite3_stmt *scrub_chunks;
+  sqlite3_stmt *scrub_contents;
+  sqlite3_stmt *select_content_chunks;
+  sqlite3_stmt *select_max_ids;
+  sqlite3_stmt *set_content_zero_length;
+  sqlite3_stmt *set_content_hash;
+  sqlite3_stmt *select_revision_length;
+  sqlite3_stmt *select_segments_from;
+  sqlite3_stmt *select_chunk_revisions;
+  sqlite3_stmt *select_content_revisions;
+  sqlite3_stmt *select_previous_revision;
+  sqlite3_stmt *select_prior_revisions;
+  sqlite3_stmt *select_snapshot_exists;
+  sqlite3_stmt *select_snapshot_time;
+  sqlite3_stmt *select_snapshot_files;
+  sqlite3_stmt *select_content_tail;
+  sqlite3_stmt *insert_content_tail;
+  sqlite3_stmt *delete_dead_tails;
+  sqlite3_stmt *select_content_chunk_ids;
+  sqlite3_stmt *select_latest_snapshot;
+  sqlite3_stmt *select_snapshot_chain;
+  sqlite3_stmt *select_file_history;
+  sqlite3_stmt *select_snapshot_file_ids;
+  sqlite3_stmt *select_max_revision_id;
+  sqlite3_stmt *inherit_child_revisions;
+  sqlite3_stmt *select_revisions_since;
+  sqlite3_stmt *drop_rootless_tombstones;
+  sqlite3_stmt *reparent_children;
+  sqlite3_stmt *select_snapshot_tree;
+  sqlite3_stmt *select_snapshot_dirs;
+  sqlite3_stmt *select_changed_file_dirs;
+  sqlite3_stmt *select_dir_files;
+  sqlite3_stmt *select_dir_subdirs;
+  sqlite3_stmt *select_dir_subdirs_other;
+  sqlite3_stmt *select_directory_hash;
+  sqlite3_stmt *select_chains_meet;
+  sqlite3_stmt *insert_directory;
+  sqlite3_stmt *inherit_child_directories;
+  sqlite3_stmt *drop_rootless_directories;
+  sqlite3_stmt *delete_snapshot_directories;
+  sqlite3_stmt *select_diff_from;
+  sqlite3_stmt *select_diff_to;
+  sqlite3_stmt *select_diff_dirs_from;
+  sqlite3_stmt *select_diff_dirs_to;
+  sqlite3_stmt *clear_diff_dirs;
+  sqlite3_stmt *insert_diff_dir;
+  sqlite3_stmt *select_chunk_changes;
 
   int errtype; /* A  CTX_ERR_* constant */
   char *errmsg; /* Allocated with sqlite3_mprintf */
   const char *err_context;
   
   sqlite3_int64 creating_snapshot_id;
+  idmap chunk_refs; /* Segments added to each chunk by the open snapshot */
+  idmap content_refs; /* Revisions added to each content by the open snapshot */
+  chunk_hints hints; /* The chunks of the previous revision of the file being added */
+  /* The parent of the open snapshot, if it is a delta, with the parent's
+  ** own ancestry from newest to oldest, and the files added to it so far */
+  sqlite3_int64 parent_snapshot_id;
+  sqlite3_int64 *parent_chain;
+  unsigned int parent_chain_count;
+  idmap delta_seen;
+  
+  chunk_cache *restore_cache; /* Shared by every restore through this ctx, if set */
+  unsigned int ingest_threads; /* See ctx_set_ingest_pipeline */
+  unsigned int ingest_queue_depth;
+  int reuse; /* A CTX_REUSE_* constant */
+  /* The change journal ctx_snapshot_tree read for the open snapshot, to be
+  ** marked taken up to journal_upto once the snapshot is committed */
+  char *journal_pending;
+  sqlite3_int64 journal_upto;
 } ctx;
 
 #define HASH_LENGTH 32
+#define MAX_CHUNK_SIZE 8000
 
 int ctx_init(ctx *ctx, const char *path);
+/* Open an existing repository for reading only, e.g. from a worker thread. */
+int ctx_init_readonly(ctx *ctx, const char *path);
+const char *ctx_path(ctx *ctx);
 int ctx_close(ctx *ctx);
 void ctx_errmsg(ctx *ctx, char *errmsg);
 void ctx_errtype(ctx *ctx, int errtype);
 
 int ctx_begin_snapshot(ctx *c, const char *note);
+/*
+ * Begin a snapshot that records only how it differs from a parent: a
+ * revision for each file added that the parent lacks or has with other
+ * content or metadata, and, when it finishes, a tombstone for each file
+ * of the parent that was not added again. Files added unchanged cost no
+ * rows. parent_snapshot_id 0 picks the latest snapshot, and with none
+ * this is ctx_begin_snapshot. Listing, restoring and exporting resolve a
+ * snapshot through its parents, and deleting one folds its revisions
+ * into its children.
+ */
+int ctx_begin_delta_snapshot(ctx *c, const char *note, sqlite3_int64 parent_snapshot_id);
+/*
+ * Every snapshot records, as it finishes, a hash for each directory its
+ * paths imply, covering the names, sizes, times and content hashes below
+ * it, so two snapshots agree under a directory exactly when its hashes
+ * do. A delta snapshot rehashes only the directories its own revisions
+ * fall in, and their ancestors. each is called for every directory whose
+ * hash differs between the two snapshots or that only one of them has,
+ * each one before its subdirectories, and for nothing below a directory
+ * they agree on. '' is the top. Snapshots taken before directories were
+ * hashed have none, so every directory of the other would be reported.
+ * A nonzero return from each stops the walk and is returned.
+ */
+int ctx_changed_dirs(ctx *c, sqlite3_int64 from_snapshot_id, sqlite3_int64 to_snapshot_id,
+                     int (*each)(void *arg, const char *path), void *arg);
+
+#define CTX_DIFF_ADDED 1    /* Only the later snapshot has the file */
+#define CTX_DIFF_REMOVED 2  /* Only the earlier snapshot has the file */
+#define CTX_DIFF_MODIFIED 3 /* The file's content differs */
+#define CTX_DIFF_TOUCHED 4  /* Same content, but another size or mtime */
+
+typedef struct ctx_diff_entry {
+  int change; /* A CTX_DIFF_* constant */
+  sqlite3_int64 file_id;
+  const char *path;
+  sqlite3_int64 from_content_id; /* 0 when added */
+  sqlite3_int64 to_content_id; /* 0 when removed */
+  /* With opts->chunks, for an added or modified file: its chunks in the
+  ** later snapshot, and how many of them, and how many bytes, the earlier
+  ** revision of it does not have */
+  sqlite3_int64 chunks;
+  sqlite3_int64 new_chunks;
+  sqlite3_int64 new_bytes;
+} ctx_diff_entry;
+
+typedef struct ctx_diff_opts {
+  int chunks; /* Fill in the chunk counts, at a query per changed file */
+  int (*each)(void *arg, const ctx_diff_entry *entry);
+  void *arg;
+} ctx_diff_opts;
+
+typedef struct ctx_diff_stats {
+  sqlite3_int64 added;
+  sqlite3_int64 removed;
+  sqlite3_int64 modified;
+  sqlite3_int64 touched;
+  sqlite3_int64 new_chunks; /* Totals of the entries' counts, with opts->chunks */
+  sqlite3_int64 new_bytes;
+} ctx_diff_stats;
+
+/*
+ * Stream every file that differs between two snapshots to opts->each, in
+ * file_id order, by merging the two snapshots' files. Snapshots that
+ * share ancestry only look at the files their own deltas touch, and
+ * others only at the files of the directories whose hashes differ, so the
+ * work follows the size of the difference rather than of the snapshots.
+ * A nonzero return from each stops the diff and is returned. stats may
+ * be NULL.
+ */
+int ctx_diff_snapshots(ctx *c, sqlite3_int64 from_snapshot_id, sqlite3_int64 to_snapshot_id,
+                       const ctx_diff_opts *opts, ctx_diff_stats *stats);
+
+#define CTX_REUSE_NEVER 0  /* Read every file (the default) */
+#define CTX_REUSE_MTIME 1  /* Trust a file whose size and mtime are unchanged */
+#define CTX_REUSE_STRICT 2 /* ...and whose ctime, inode and device are too */
+
+/*
+ * Choose when a file added to a snapshot may keep the content of its
+ * latest revision in an earlier snapshot without being read. Each
+ * revision records the size, times, inode and device the file had when
+ * it was stored; at CTX_REUSE_MTIME or CTX_REUSE_STRICT a file whose
+ * metadata still matches is not hashed or chunked again. A write that
+ * leaves the size and both times as they were goes unnoticed, so
+ * CTX_REUSE_NEVER is the choice when that cannot be ruled out.
+ *
+ * The same levels let a large file that has only grown, or changed near
+ * its end, since its previous revision share that revision's chunks: the
+ * old part is read back and each chunk's bytes checked against its CRC-32C
+ * and its BLAKE2b hash, rather than cut into chunks again. Only what comes
+ * after them is chunked anew.
+ */
+void ctx_set_reuse(ctx *c, int level);
 int ctx_add_to_snapshot(ctx *c, const char *path, FILE *);
+/*
+ * Before a file with a previous revision is chunked, that revision's chunk
+ * ids are loaded by hash, and each chunk is looked for there before in the
+ * chunk table. Since the ctx was opened, hits chunks were found that way
+ * and misses were not, counting only files that had such a revision.
+ */
+void ctx_chunk_hint_stats(ctx *c, sqlite3_int64 *hits, sqlite3_int64 *misses);
+/*
+ * Add a file read from a stream that cannot seek, such as a pipe. The
+ * content is chunked and hashed in the same pass; if it turns out to be
+ * stored already, the chunks just written are rolled back. mtime_ns is
+ * the file's modification time, or -1 if unknown. f is left open.
+ */
+int ctx_add_stream_to_snapshot(ctx *c, const char *path, FILE *f, sqlite3_int64 mtime_ns);
+/*
+ * Add every regular file in a tar archive read from in, in one pass,
+ * under the member's name. Other members (directories, links, devices)
+ * are skipped. in need not be seekable.
+ */
+int ctx_add_tar_to_snapshot(ctx *c, FILE *in);
+typedef struct ctx_tree_stats {
+  sqlite3_int64 files; /* Regular files added */
+  sqlite3_int64 bytes;
+  sqlite3_int64 skipped; /* Files and directories that could not be read */
+  sqlite3_int64 reused; /* Files kept from their earlier revision without being read */
+  sqlite3_int64 carried; /* Files the journal says are unchanged, kept without being visited */
+} ctx_tree_stats;
+
+typedef struct ctx_tree_opts {
+  unsigned int threads; /* 0 to use one per core */
+  /* Add files in sorted path order, so that the same tree always gives the
+  ** same snapshot. The whole tree is listed before any file is read. */
+  int deterministic;
+  /* A journal kept by ctx_watch on the same root, or NULL. See below. */
+  const char *journal;
+} ctx_tree_opts;
+
+/*
+ * Add every regular file under root to the open snapshot, stored under
+ * root's path joined to its own. Symbolic links and other special files
+ * are left out, and directories are not followed through links. Worker
+ * threads list directories and read, hash and chunk files concurrently;
+ * the calling thread writes their results to the database, a batch at a
+ * time, as the only writer. Files too large to hold in memory are stored
+ * by the calling thread through the ingest pipeline. With ctx_set_reuse
+ * on, the earlier revisions under root are loaded first, and a file whose
+ * metadata still matches is stat'ed but not opened. Files and directories
+ * that cannot be read are counted in stats and passed over. opts and
+ * stats may be NULL.
+ *
+ * With opts->journal set, only the paths the journal lists are visited,
+ * and every other file under root keeps its revision from the snapshot
+ * that last took the journal. The journal is taken when ctx_finish_snapshot
+ * has committed the open snapshot: it then covers the changes since that
+ * one. Until then, and for good if the snapshot is aborted or never
+ * finishes, it still covers the changes since the one before. The whole
+ * tree is walked by a snapshot whose journal has no watcher running,
+ * names a snapshot that is gone, belongs to another root
+ * or repository, or has recorded that the kernel dropped events. A change
+ * made in the last second or so before a snapshot may only be picked up
+ * by the one after it.
+ */
+int ctx_snapshot_tree(ctx *c, const char *root, const ctx_tree_opts *opts, ctx_tree_stats *stats);
+
+/*
+ * Record in the journal at journal_path, created if need be, the path of
+ * every file and directory under root that changes, until *stop is set.
+ * This is meant for a long-running process of its own, with snapshots
+ * taken elsewhere through ctx_tree_opts.journal. Where it is permitted, a
+ * single fanotify mark on root's filesystem reports every change; other
+ * users, and roots with other filesystems mounted under them, get an
+ * inotify watch on each directory. Linux only.
+ */
+int ctx_watch(ctx *c, const char *root, const char *journal_path, volatile int *stop);
 int ctx_finish_snapshot(ctx *c);
+/*
+ * Tune how large new contents are stored. They are read, chunked, hashed
+ * on hash_threads threads and written to the database by the calling
+ * thread, all at once, with up to queue_depth batches of chunks between
+ * the chunker and the database. More depth rides out a slow stage at the
+ * cost of a quarter megabyte a batch. 0 for either picks a default: one
+ * hashing thread per core, and two batches per hashing thread.
+ */
+void ctx_set_ingest_pipeline(ctx *c, unsigned int hash_threads, unsigned int queue_depth);
 int ctx_abort_snapshot(ctx *c);
 
+/*
+ * Remove a snapshot and its revisions, then free whatever contents and
+ * chunks are no longer referenced by any remaining snapshot. Snapshots
+ * made relative to it first take over the revisions they were relying on.
+ */
+int ctx_delete_snapshot(ctx *c, sqlite3_int64 snapshot_id);
+
+/*
+ * Rewrite live chunks so that they are numbered in the order the most
+ * recent snapshots read them, newest first. Use 0 for recent_snapshots to
+ * follow every snapshot. Chunks are moved in small transactions, at most
+ * bytes_per_second bytes per second (0 for no limit), so other readers and
+ * writers can proceed while it runs. Moved chunks reuse free pages
+ * wherever they are, so only with compact set, which rebuilds the database
+ * file afterwards and gives back the space left by moved and deleted
+ * chunks, do they also lie in that order on disk.
+ */
+int ctx_repack(ctx *c, unsigned int recent_snapshots, unsigned int bytes_per_second, int compact);
+
 
 /* Create a revision and, if necessary, the associated file for the current contents
  * at path.
@@ -73,6 +402,263 @@ int ctx_ingest(ctx *c, const char *path);
  */
 int ctx_spew(ctx *c, const char *dest_path, sqlite3_int64 revision_id);
 
+typedef struct ctx_delta_stats {
+  sqlite3_int64 bytes_reused;  /* Kept from, or copied out of, the existing file */
+  sqlite3_int64 bytes_fetched; /* Read from the repository */
+  int in_place; /* The existing file was patched rather than replaced */
+} ctx_delta_stats;
+
+/*
+ * Bring dest_path up to a stored revision, reading from the repository
+ * only what the file does not already hold. The existing file is chunked
+ * the way it would be stored, and its chunks are matched against the
+ * revision's. When every chunk it keeps is already at the right offset the
+ * file is patched in place, so an interruption leaves it part-updated;
+ * otherwise a new copy is put together beside it and renamed over it. A
+ * missing dest_path is restored in full. stats may be NULL.
+ */
+int ctx_spew_delta(ctx *c, const char *dest_path, sqlite3_int64 revision_id, ctx_delta_stats *stats);
+
+/*
+ * Keep up to budget bytes of recently restored chunks in memory, so that
+ * chunks shared between the files and revisions restored through this ctx
+ * are read from the database once. 0 turns the cache off. Hit counts
+ * accumulate until the cache is replaced.
+ */
+int ctx_set_restore_cache(ctx *c, size_t budget);
+void ctx_restore_cache_stats(ctx *c, sqlite3_int64 *hits, sqlite3_int64 *misses);
+
+/*
+ * Read part of a stored revision without restoring it. The segment holding
+ * offset is found through an index on each segment's starting offset, and
+ * recently used chunks are kept decoded in the handle. ctx_pread returns
+ * the number of bytes read, which is short only at the end of the
+ * revision, or -1 on error. A handle must not outlive its ctx.
+ */
+typedef struct ctx_revision ctx_revision;
+ctx_revision *ctx_open_revision(ctx *c, sqlite3_int64 revision_id);
+sqlite3_int64 ctx_revision_size(ctx_revision *r);
+sqlite3_int64 ctx_pread(ctx_revision *r, void *buf, size_t len, sqlite3_int64 offset);
+void ctx_close_revision(ctx_revision *r);
+
+typedef struct ctx_restore_progress {
+  sqlite3_int64 files_done;
+  sqlite3_int64 files_total;
+  sqlite3_int64 files_skipped; /* Already up to date; not counted in files_total */
+  sqlite3_int64 bytes_done;
+  sqlite3_int64 bytes_total;
+  sqlite3_int64 elapsed_ms;
+  sqlite3_int64 bytes_per_second;
+  sqlite3_int64 cache_hits;
+  sqlite3_int64 cache_misses;
+} ctx_restore_progress;
+
+#define CTX_SYNC_NONE 0   /* Write every file */
+#define CTX_SYNC_MTIME 1  /* Skip files whose size and modification time match */
+#define CTX_SYNC_VERIFY 2 /* Skip files whose size and BLAKE2b hash match */
+
+typedef struct ctx_restore_opts {
+  unsigned int threads; /* 0 to use one per core */
+  int sync; /* One of CTX_SYNC_* */
+  /* Make files that share a content hard links to one copy, rather than
+  ** copies of it. The links share one modification time. */
+  int hardlink;
+  /* Chunk cache for this restore, when the ctx has none set; 0 for the default */
+  size_t cache_bytes;
+  /* Memory per thread for the files being put together; 0 for the default */
+  size_t plan_bytes;
+  /* With CTX_SYNC_MTIME, the snapshot dest_root was last restored or synced
+  ** to, or 0. Files in directories whose hashes are the same in both are
+  ** taken to be up to date without a stat. */
+  sqlite3_int64 since_snapshot_id;
+  /* Called from worker threads, one call at a time, at most twice a second */
+  void (*on_progress)(void *arg, const ctx_restore_progress *progress);
+  void *arg;
+} ctx_restore_opts;
+
+/*
+ * Recreate every file of a snapshot under dest_root. Files are restored in
+ * parallel, each worker reading through its own read-only connection.
+ * Each worker puts together up to plan_bytes of files at a time, reading
+ * their chunks in the order they are stored rather than the order they
+ * appear in the files. Each distinct content is read from the repository
+ * once; other files with that content are copied or linked from it. A
+ * file already at the destination is replaced rather than written
+ * through, so its other links keep what they had. Restored files get back
+ * the modification time they were stored with, so that a later
+ * CTX_SYNC_MTIME restore onto the same tree only has to stat them. opts
+ * may be NULL.
+ */
+int ctx_restore_snapshot(ctx *c, sqlite3_int64 snapshot_id, const char *dest_root, const ctx_restore_opts *opts);
+
+/*
+ * Write a snapshot to fd as a tar archive, without touching the disk.
+ * Chunks are read on the calling thread while a second thread writes out
+ * what has been read, in large blocks, so fd may be a slow pipe or socket.
+ * Paths are stored relative, the way ctx_restore_snapshot would place them.
+ */
+int ctx_export_tar(ctx *c, sqlite3_int64 snapshot_id, int fd);
+
+#define CTX_SCRUB_CHUNK 1   /* A chunk body no longer matches its hash or CRC */
+#define CTX_SCRUB_CONTENT 2 /* A content's segments no longer reproduce its hash */
+
+typedef struct ctx_scrub_problem {
+  int kind; /* A CTX_SCRUB_* constant */
+  sqlite3_int64 id; /* chunk_id or content_id, depending on kind */
+  const sqlite3_int64 *revision_ids; /* Every revision that reads the damaged data */
+  unsigned int revision_count;
+} ctx_scrub_problem;
+
+/* How far a scrub has got. Everything below these ids has been verified. */
+typedef struct ctx_scrub_checkpoint {
+  sqlite3_int64 chunk_id;
+  sqlite3_int64 content_id;
+} ctx_scrub_checkpoint;
+
+#define CTX_SCRUB_DEEP 0 /* Check CRCs, re-hash chunks and chain content hashes */
+#define CTX_SCRUB_FAST 1 /* Only check each chunk's CRC-32C */
+
+typedef struct ctx_scrub_opts {
+  int mode; /* A CTX_SCRUB_DEEP or CTX_SCRUB_FAST constant */
+  unsigned int threads; /* 0 to use one per core */
+  ctx_scrub_checkpoint resume_from; /* Zeroes to start from the beginning */
+  void (*on_problem)(void *arg, const ctx_scrub_problem *problem);
+  void (*on_checkpoint)(void *arg, const ctx_scrub_checkpoint *checkpoint);
+  void *arg;
+} ctx_scrub_opts;
+
+typedef struct ctx_scrub_stats {
+  sqlite3_int64 chunks;
+  sqlite3_int64 contents;
+  sqlite3_int64 bytes; /* Chunk bytes only, each counted once */
+  sqlite3_int64 bad_chunks;
+  sqlite3_int64 bad_contents;
+} ctx_scrub_stats;
+
+/*
+ * Check every stored chunk against its CRC-32C and, in deep mode, re-hash
+ * every chunk and check that every content's chunks still hash to the
+ * content's hash. Work is spread over a thread pool, each
+ * thread reading through its own read-only connection, so normal reads
+ * carry on meanwhile. Damage is reported through opts->on_problem; the
+ * return value only reports failures to run the scrub itself.
+ */
+int ctx_scrub(ctx *c, const ctx_scrub_opts *opts, ctx_scrub_stats *stats);
+
+/* Shared between the library's source files */
+int ctx_collect_err(ctx *c, int errcode);
+int ctx_begin_transaction(ctx *c);
+int ctx_rollback(ctx *c);
+int ctx_commit(ctx *c);
+sqlite3_int64 ctx_find_chunk(ctx *c, unsigned char *hash);
+/* ctx_add_stream_to_snapshot, reading through read_fn. length is what it
+** will yield, or -1 if unknown. */
+int ctx_add_reader_to_snapshot(ctx *c, const char *path, size_t (*read_fn)(void *src, unsigned char *buf, size_t len), void *src, sqlite3_int64 length, sqlite3_int64 mtime_ns);
+
+/* Contents smaller than this are chunked on one thread, without the pipeline */
+#define INGEST_PIPELINE_MIN (4*1024*1024)
+
+/* A chunk whose hashes were worked out ahead of time, off the writer's thread */
+typedef struct hashed_chunk {
+  unsigned int sequence;
+  int length;
+  const unsigned char *data; /* NULL for a run of zeros */
+  unsigned char hash[HASH_LENGTH];
+  uint32_t crc;
+} hashed_chunk;
+/* A file's stat fields kept with each revision. Unknown numbers are -1. */
+typedef struct file_meta {
+  sqlite3_int64 size;
+  sqlite3_int64 mtime_ns;
+  sqlite3_int64 ctime_ns;
+  int has_inode;
+  sqlite3_int64 inode;
+  sqlite3_int64 device;
+} file_meta;
+void file_meta_unknown(file_meta *meta);
+#ifndef _WIN32
+struct stat;
+void file_meta_from_stat(file_meta *meta, const struct stat *st);
+#endif
+/* Whether a file's metadata now is close enough to then for a CTX_REUSE_* level */
+int file_meta_matches(const file_meta *now, const file_meta *then, int level);
+/* ctx_add_to_snapshot for a file already hashed and chunked. The chunks
+** are stored only if no content has the hash. */
+int ctx_add_hashed_to_snapshot(ctx *c, const char *path, const unsigned char *hash, sqlite3_int64 length, const hashed_chunk *chunks, unsigned int chunk_count, const file_meta *meta);
+/* ctx_add_to_snapshot for a file whose content is already stored */
+int ctx_add_known_to_snapshot(ctx *c, const char *path, sqlite3_int64 content_id, const file_meta *meta);
+
+/* Where a content's chunks are being stored */
+typedef struct handler_ctx {
+  ctx *c;
+  int64_t content_id;
+  sqlite3_int64 zero_length;
+  sqlite3_int64 offset;
+  struct __blake2b_state *hasher; /* Fed every byte, when hashing as the file is chunked */
+  unsigned int first_sequence; /* Added to every chunk's sequence, when chunking resumes partway */
+} handler_ctx;
+/* Store one chunk of stream_to_chunks output, already hashed. data is NULL
+** for a run of zeros, and hash and crc are then unused. */
+int ctx_record_chunk(handler_ctx *info, unsigned int sequence, unsigned char *data, int data_len, unsigned char *hash, uint32_t crc);
+/* stream_to_chunks into info's content, with ctx_record_chunk, on the
+** threads set up by ctx_set_ingest_pipeline */
+int ingest_pipeline(ctx *c, size_t (*read_fn)(void *src, unsigned char *buf, size_t len), void *src, handler_ctx *info);
+int ctx_exec_with_id(ctx *c, sqlite3_stmt *stmt, sqlite3_int64 id);
+/* Record the directory hashes of the open snapshot, as it finishes */
+int ctx_hash_directories(ctx *c);
+/* The length of the directory part of path: up to its last '/', or 0 */
+size_t ctx_dir_length(const char *path);
+/* Set *has if snapshot_id has directory hashes to compare */
+int ctx_has_directory_hashes(ctx *c, sqlite3_int64 snapshot_id, int *has);
+/* Record file_id's content in the open snapshot and take a reference to
+** it. Returns the new revision_id, or the parent's when a delta snapshot
+** inherits it unchanged, or 0 on error. */
+sqlite3_int64 ctx_add_revision(ctx *c, sqlite3_int64 file_id, sqlite3_int64 content_id, const file_meta *meta);
+
+/* The change journal that ctx_watch keeps and ctx_snapshot_tree takes */
+sqlite3 *journal_open(ctx *c, const char *path);
+void journal_close(sqlite3 *j);
+/* root as the journal spells it, malloc'd */
+char *journal_root(const char *root);
+/* Call each for every path recorded up to *upto, and set *base to the
+** snapshot they are changes since. *base is 0, and each is not called,
+** when the journal cannot be trusted for root. */
+int journal_read(ctx *c, sqlite3 *j, const char *journal_path, const char *root, sqlite3_int64 *base, sqlite3_int64 *upto,
+                 int (*each)(void *arg, const char *path, int subtree), void *arg);
+/* Forget the paths up to upto, which snapshot_id has taken into account */
+int journal_taken(ctx *c, sqlite3 *j, sqlite3_int64 upto, sqlite3_int64 snapshot_id);
+/* Mark c->journal_pending, if set, taken by snapshot_id, now committed */
+int journal_confirm(ctx *c, sqlite3_int64 snapshot_id);
+sqlite3_int64 ctx_now_ms(void);
+
+typedef struct pool pool;
+unsigned int pool_default_threads(void);
+pool *pool_create(unsigned int thread_count);
+unsigned int pool_size(pool *p);
+/* Run fn for every task in [0, task_count) across the pool and wait for them all. */
+void pool_run(pool *p, void (*fn)(void *arg, unsigned int worker, unsigned int task), void *arg, unsigned int task_count);
+void pool_destroy(pool *p);
+
+chunk_cache *chunk_cache_create(size_t budget);
+/* Copy a cached chunk into dest and return 1, or return 0 if it is not cached */
+int chunk_cache_get(chunk_cache *cc, sqlite3_int64 chunk_id, unsigned char *dest, unsigned int length);
+void chunk_cache_put(chunk_cache *cc, sqlite3_int64 chunk_id, const unsigned char *data, unsigned int length);
+void chunk_cache_stats(chunk_cache *cc, sqlite3_int64 *hits, sqlite3_int64 *misses);
+void chunk_cache_destroy(chunk_cache *cc);
+
+uint32_t crc32c(const void *data, size_t len);
+
+int stream_to_chunks(
+  size_t (*read_fn)(void *src, unsigned char *buf, size_t len),
+  void *src,
+  unsigned char *chunk_buf,
+  unsigned int chunk_buf_len,
+  int (*handle_chunk)(unsigned int sequence, unsigned char *data, int data_len, void *ptr),
+  void *ptr
+);
+/* A read_fn for stream_to_chunks that freads from a FILE * */
+size_t read_from_file(void *src, unsigned char *buf, size_t len);
+/* stream_to_chunks over f, which is closed afterwards */
 int file_to_chunks(
   FILE *f,
   unsigned char *chunk_buf,
@@ -82,3 +668,6 @@ int file_to_chunks(
 );
 
 int blake2b_file(FILE *f, unsigned char *hash);
+
+/* A malloc'd path for a stored path under dest_root, which cannot escape it */
+char *restore_dest_path(const char *dest_root, const char *stored);
@@ -0,0 +1,180 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* An open-addressed table from row id to a signed count. Row ids handed
+** out by SQLite are never 0, so 0 marks an empty slot.
+*/
+
+static unsigned int idmap_slot(sqlite3_int64 key, unsigned int capacity){
+  uint64_t h = (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+  return (unsigned int)(h >> 32) & (capacity-1);
+}
+
+static int idmap_grow(idmap *m){
+  unsigned int new_capacity = m->capacity ? m->capacity*2 : 1024;
+  sqlite3_int64 *keys = calloc(new_capacity, sizeof(*keys));
+  sqlite3_int64 *values = calloc(new_capacity, sizeof(*values));
+  if( !keys || !values ){
+    free(keys);
+    free(values);
+    return 1;
+  }
+
+  unsigned int i;
+  for( i=0; i<m->capacity; i++ ){
+    if( m->keys[i]==0 ) continue;
+    unsigned int slot = idmap_slot(m->keys[i], new_capacity);
+    while( keys[slot] ) slot = (slot+1) & (new_capacity-1);
+    keys[slot] = m->keys[i];
+    values[slot] = m->values[i];
+  }
+  free(m->keys);
+  free(m->values);
+  m->keys = keys;
+  m->values = values;
+  m->capacity = new_capacity;
+  return 0;
+}
+
+int idmap_add(idmap *m, sqlite3_int64 key, sqlite3_int64 delta){
+  if( (m->count+1)*4 > m->capacity*3 ){
+    if( idmap_grow(m) ) return 1;
+  }
+  unsigned int slot = idmap_slot(key, m->capacity);
+  while( m->keys[slot] && m->keys[slot]!=key ){
+    slot = (slot+1) & (m->capacity-1);
+  }
+  if( m->keys[slot]==0 ){
+    m->keys[slot] = key;
+    m->values[slot] = 0;
+    m->count++;
+  }
+  m->values[slot] += delta;
+  return 0;
+}
+
+sqlite3_int64 idmap_get(const idmap *m, sqlite3_int64 key){
+  if( m->count==0 ) return 0;
+  unsigned int slot = idmap_slot(key, m->capacity);
+  while( m->keys[slot] ){
+    if( m->keys[slot]==key ) return m->values[slot];
+    slot = (slot+1) & (m->capacity-1);
+  }
+  return 0;
+}
+
+void idmap_clear(idmap *m){
+  if( m->count==0 ) return;
+  memset(m->keys, 0, m->capacity*sizeof(*m->keys));
+  m->count = 0;
+}
+
+void idmap_free(idmap *m){
+  free(m->keys);
+  free(m->values);
+  memset(m, 0, sizeof(*m));
+}
+
+/* chunk_hints is laid out the same way, keyed by chunk hash. The hashes
+** are BLAKE2b output, so their first bytes already pick a slot well.
+*/
+
+static unsigned int chunk_hints_slot(const unsigned char *hash, unsigned int capacity){
+  uint32_t h;
+  memcpy(&h, hash, sizeof(h));
+  return (unsigned int)h & (capacity-1);
+}
+
+static int chunk_hints_grow(chunk_hints *h){
+  unsigned int new_capacity = h->capacity ? h->capacity*2 : 256;
+  unsigned char *hashes = malloc((size_t)new_capacity*HASH_LENGTH);
+  sqlite3_int64 *ids = calloc(new_capacity, sizeof(*ids));
+  if( !hashes || !ids ){
+    free(hashes);
+    free(ids);
+    return 1;
+  }
+
+  unsigned int i;
+  for( i=0; i<h->capacity; i++ ){
+    if( h->ids[i]==0 ) continue;
+    unsigned int slot = chunk_hints_slot(h->hashes+(size_t)i*HASH_LENGTH, new_capacity);
+    while( ids[slot] ) slot = (slot+1) & (new_capacity-1);
+    memcpy(hashes+(size_t)slot*HASH_LENGTH, h->hashes+(size_t)i*HASH_LENGTH, HASH_LENGTH);
+    ids[slot] = h->ids[i];
+  }
+  free(h->hashes);
+  free(h->ids);
+  h->hashes = hashes;
+  h->ids = ids;
+  h->capacity = new_capacity;
+  return 0;
+}
+
+int chunk_hints_add(chunk_hints *h, const unsigned char *hash, sqlite3_int64 chunk_id){
+  if( (h->count+1)*4 > h->capacity*3 ){
+    if( chunk_hints_grow(h) ) return 1;
+  }
+  unsigned int slot = chunk_hints_slot(hash, h->capacity);
+  while( h->ids[slot] && memcmp(h->hashes+(size_t)slot*HASH_LENGTH, hash, HASH_LENGTH) ){
+    slot = (slot+1) & (h->capacity-1);
+  }
+  if( h->ids[slot]==0 ){
+    memcpy(h->hashes+(size_t)slot*HASH_LENGTH, hash, HASH_LENGTH);
+    h->count++;
+  }
+  h->ids[slot] = chunk_id;
+  return 0;
+}
+
+sqlite3_int64 chunk_hints_find(const chunk_hints *h, const unsigned char *hash){
+  if( h->count==0 ) return 0;
+  unsigned int slot = chunk_hints_slot(hash, h->capacity);
+  while( h->ids[slot] ){
+    if( 0==memcmp(h->hashes+(size_t)slot*HASH_LENGTH, hash, HASH_LENGTH) ) return h->ids[slot];
+    slot = (slot+1) & (h->capacity-1);
+  }
+  return 0;
+}
+
+void chunk_hints_clear(chunk_hints *h){
+  if( h->count==0 ) return;
+  if( h->capacity > 4096 ){
+    /* One large file's hints should not make every small file pay to clear them */
+    free(h->hashes);
+    free(h->ids);
+    h->hashes = NULL;
+    h->ids = NULL;
+    h->capacity = 0;
+  }else{
+    memset(h->ids, 0, h->capacity*sizeof(*h->ids));
+  }
+  h->count = 0;
+}
+
+void chunk_hints_free(chunk_hints *h){
+  free(h->hashes);
+  free(h->ids);
+  memset(h, 0, sizeof(*h));
+}
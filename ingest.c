@@ -0,0 +1,415 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include "blake2.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Storing a large content as a pipeline of threads:
+**
+**   reader -> chunker -> hashers (several) -> writer
+**
+** The reader fills big blocks from the source so the chunker is not held
+** up by I/O. The chunker cuts segments and packs them into numbered
+** batches. Any idle hasher takes the next batch and works out each chunk's
+** BLAKE2b and CRC32C. The writer is the calling thread, which owns the
+** database connection: it takes batches strictly in number order, so
+** segments are stored in sequence within the caller's transaction, exactly
+** as the one-thread path would store them. When the whole content is being
+** hashed too (a stream that can only be read once), one more thread feeds
+** every batch to that hash in order alongside the others.
+**
+** Batches live in a ring of queue_depth slots; batch n uses slot
+** n % queue_depth and the chunker waits for it to come free, which bounds
+** the memory in flight and stalls the early stages when the writer falls
+** behind.
+*/
+#define INGEST_READ_BLOCKS 4
+#define INGEST_READ_SIZE (1024*1024)
+#define INGEST_BATCH_BYTES (256*1024)
+#define INGEST_BATCH_CHUNKS 1024
+
+#define SLOT_FREE 0
+#define SLOT_FILLING 1
+#define SLOT_FILLED 2
+#define SLOT_HASHING 3
+#define SLOT_HASHED 4
+#define SLOT_WRITTEN 5
+
+typedef struct ingest_chunk {
+  unsigned int sequence;
+  unsigned int offset; /* Into the batch's buffer */
+  int length;
+  int zero; /* A run of zeros, with nothing in the buffer */
+  unsigned char hash[HASH_LENGTH];
+  uint32_t crc;
+} ingest_chunk;
+
+typedef struct ingest_batch {
+  int state; /* A SLOT_* constant */
+  unsigned int number;
+  int file_hashed;
+  unsigned int count;
+  unsigned int used;
+  unsigned char *buf;
+  ingest_chunk *chunks;
+} ingest_batch;
+
+typedef struct read_block {
+  int full;
+  size_t length;
+  unsigned char *data;
+} read_block;
+
+typedef struct ingest_pipe {
+  pthread_mutex_t lock;
+  pthread_cond_t changed; /* Broadcast on every state change */
+  int stop; /* Set on any failure; every stage winds down */
+
+  size_t (*read_fn)(void *src, unsigned char *buf, size_t len);
+  void *src;
+  read_block blocks[INGEST_READ_BLOCKS];
+  unsigned int blocks_read;
+  int read_done;
+  unsigned int block_taken; /* The chunker's position in the blocks */
+  size_t block_pos;
+
+  ingest_batch *batches;
+  unsigned int depth;
+  ingest_batch *filling;
+  unsigned int published;
+  int chunk_err;
+  int chunker_done;
+
+  blake2b_state *hasher;
+} ingest_pipe;
+
+static void pipe_stop(ingest_pipe *p){
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void *reader_run(void *arg){
+  ingest_pipe *p = (ingest_pipe *)arg;
+  pthread_mutex_lock(&p->lock);
+  while( !p->stop ){
+    read_block *b = &p->blocks[p->blocks_read % INGEST_READ_BLOCKS];
+    while( b->full && !p->stop ) pthread_cond_wait(&p->changed, &p->lock);
+    if( p->stop ) break;
+    pthread_mutex_unlock(&p->lock);
+
+    size_t got = 0, n;
+    while( got<INGEST_READ_SIZE && 0<(n=p->read_fn(p->src, b->data+got, INGEST_READ_SIZE-got)) ){
+      got += n;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if( got ){
+      b->length = got;
+      b->full = 1;
+      p->blocks_read++;
+    }
+    if( got<INGEST_READ_SIZE ){
+      p->read_done = 1;
+      pthread_cond_broadcast(&p->changed);
+      break;
+    }
+    pthread_cond_broadcast(&p->changed);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/* The chunker's read_fn, served from the reader's blocks */
+static size_t pipe_read(void *src, unsigned char *buf, size_t len){
+  ingest_pipe *p = (ingest_pipe *)src;
+  size_t done = 0;
+  pthread_mutex_lock(&p->lock);
+  while( done<len ){
+    read_block *b = &p->blocks[p->block_taken % INGEST_READ_BLOCKS];
+    while( !b->full && !p->read_done && !p->stop ) pthread_cond_wait(&p->changed, &p->lock);
+    if( !b->full || p->stop ) break;
+    size_t piece = b->length - p->block_pos;
+    if( piece > len-done ) piece = len-done;
+    memcpy(buf+done, b->data+p->block_pos, piece);
+    done += piece;
+    p->block_pos += piece;
+    if( p->block_pos==b->length ){
+      b->full = 0;
+      p->block_pos = 0;
+      p->block_taken++;
+      pthread_cond_broadcast(&p->changed);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return done;
+}
+
+/* Called with the lock held */
+static void batch_release_if_done(ingest_pipe *p, ingest_batch *b){
+  if( b->state==SLOT_WRITTEN && (b->file_hashed || !p->hasher) ){
+    b->state = SLOT_FREE;
+    pthread_cond_broadcast(&p->changed);
+  }
+}
+
+/* Called with the lock held */
+static void batch_publish(ingest_pipe *p){
+  ingest_batch *b = p->filling;
+  p->filling = NULL;
+  if( !b ) return;
+  b->number = p->published++;
+  b->state = SLOT_FILLED;
+  pthread_cond_broadcast(&p->changed);
+}
+
+/* The chunker's handle_chunk: copy the chunk into the batch being filled */
+static int pipe_take_chunk(unsigned int sequence, unsigned char *data, int data_len, void *ptr){
+  ingest_pipe *p = (ingest_pipe *)ptr;
+  ingest_batch *b = p->filling;
+
+  if( b && (b->count==INGEST_BATCH_CHUNKS || (data && b->used+(unsigned int)data_len > INGEST_BATCH_BYTES)) ){
+    pthread_mutex_lock(&p->lock);
+    batch_publish(p);
+    pthread_mutex_unlock(&p->lock);
+    b = NULL;
+  }
+  if( !b ){
+    pthread_mutex_lock(&p->lock);
+    b = &p->batches[p->published % p->depth];
+    while( b->state!=SLOT_FREE && !p->stop ) pthread_cond_wait(&p->changed, &p->lock);
+    int stopped = p->stop;
+    if( !stopped ){
+      b->state = SLOT_FILLING;
+      b->file_hashed = 0;
+      b->count = 0;
+      b->used = 0;
+      p->filling = b;
+    }
+    pthread_mutex_unlock(&p->lock);
+    if( stopped ) return 1;
+  }
+
+  ingest_chunk *ch = &b->chunks[b->count++];
+  ch->sequence = sequence;
+  ch->length = data_len;
+  ch->zero = data==NULL;
+  ch->offset = b->used;
+  if( data ){
+    memcpy(b->buf+b->used, data, (size_t)data_len);
+    b->used += (unsigned int)data_len;
+  }
+  return 0;
+}
+
+static void *chunker_run(void *arg){
+  ingest_pipe *p = (ingest_pipe *)arg;
+  unsigned char buf[MAX_CHUNK_SIZE];
+  int err = stream_to_chunks(pipe_read, p, buf, MAX_CHUNK_SIZE, pipe_take_chunk, p);
+  pthread_mutex_lock(&p->lock);
+  if( err ){
+    p->chunk_err = 1;
+    p->stop = 1;
+  }
+  batch_publish(p);
+  p->chunker_done = 1;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void *hasher_run(void *arg){
+  ingest_pipe *p = (ingest_pipe *)arg;
+  pthread_mutex_lock(&p->lock);
+  while( 1 ){
+    /* The oldest waiting batch is the one the writer needs first */
+    ingest_batch *b = NULL;
+    unsigned int i;
+    for( i=0; i<p->depth; i++ ){
+      ingest_batch *x = &p->batches[i];
+      if( x->state==SLOT_FILLED && (!b || x->number<b->number) ) b = x;
+    }
+    if( p->stop ) break;
+    if( !b ){
+      if( p->chunker_done ) break;
+      pthread_cond_wait(&p->changed, &p->lock);
+      continue;
+    }
+    b->state = SLOT_HASHING;
+    pthread_mutex_unlock(&p->lock);
+
+    for( i=0; i<b->count; i++ ){
+      ingest_chunk *ch = &b->chunks[i];
+      if( ch->zero ) continue;
+      blake2b(ch->hash, b->buf+ch->offset, NULL, HASH_LENGTH, (uint64_t)ch->length, 0);
+      ch->crc = crc32c(b->buf+ch->offset, (size_t)ch->length);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    b->state = SLOT_HASHED;
+    pthread_cond_broadcast(&p->changed);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/* Feeds the whole content's hash, taking batches in order */
+static void *file_hasher_run(void *arg){
+  static const unsigned char zeros[4096];
+  ingest_pipe *p = (ingest_pipe *)arg;
+  unsigned int next;
+  for( next=0; ; next++ ){
+    ingest_batch *b = &p->batches[next % p->depth];
+    pthread_mutex_lock(&p->lock);
+    while( !p->stop && !(b->state>=SLOT_FILLED && b->number==next) && !(p->chunker_done && next==p->published) ){
+      pthread_cond_wait(&p->changed, &p->lock);
+    }
+    int finished = p->stop || next==p->published;
+    pthread_mutex_unlock(&p->lock);
+    if( finished ) break;
+
+    unsigned int i;
+    for( i=0; i<b->count; i++ ){
+      ingest_chunk *ch = &b->chunks[i];
+      int left = ch->length;
+      while( ch->zero && left>0 ){
+        int piece = left<(int)sizeof(zeros) ? left : (int)sizeof(zeros);
+        blake2b_update(p->hasher, zeros, (uint64_t)piece);
+        left -= piece;
+      }
+      if( !ch->zero ) blake2b_update(p->hasher, b->buf+ch->offset, (uint64_t)ch->length);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    b->file_hashed = 1;
+    batch_release_if_done(p, b);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+
+/* The calling thread's part: store the batches in order */
+static int writer_run(ingest_pipe *p, handler_ctx *info){
+  unsigned int next;
+  int err = 0;
+  for( next=0; !err; next++ ){
+    ingest_batch *b = &p->batches[next % p->depth];
+    pthread_mutex_lock(&p->lock);
+    while( !p->stop && !(b->state==SLOT_HASHED && b->number==next) && !(p->chunker_done && next==p->published) ){
+      pthread_cond_wait(&p->changed, &p->lock);
+    }
+    int finished = p->stop || next==p->published;
+    pthread_mutex_unlock(&p->lock);
+    if( finished ) break;
+
+    unsigned int i;
+    for( i=0; i<b->count && !err; i++ ){
+      ingest_chunk *ch = &b->chunks[i];
+      err = ctx_record_chunk(info, ch->sequence, ch->zero ? NULL : b->buf+ch->offset, ch->length, ch->hash, ch->crc);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    b->state = SLOT_WRITTEN;
+    batch_release_if_done(p, b);
+    pthread_mutex_unlock(&p->lock);
+  }
+  if( err ) pipe_stop(p);
+  return err;
+}
+
+static void pipe_free(ingest_pipe *p){
+  unsigned int i;
+  for( i=0; i<INGEST_READ_BLOCKS; i++ ) free(p->blocks[i].data);
+  if( p->batches ){
+    for( i=0; i<p->depth; i++ ){
+      free(p->batches[i].buf);
+      free(p->batches[i].chunks);
+    }
+    free(p->batches);
+  }
+  pthread_cond_destroy(&p->changed);
+  pthread_mutex_destroy(&p->lock);
+}
+
+void ctx_set_ingest_pipeline(ctx *c, unsigned int hash_threads, unsigned int queue_depth){
+  c->ingest_threads = hash_threads;
+  c->ingest_queue_depth = queue_depth;
+}
+
+int ingest_pipeline(ctx *c, size_t (*read_fn)(void *src, unsigned char *buf, size_t len), void *src, handler_ctx *info){
+  ingest_pipe p;
+  unsigned int hash_threads = c->ingest_threads ? c->ingest_threads : pool_default_threads();
+  unsigned int i;
+  int err = 1;
+
+  memset(&p, 0, sizeof(p));
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.changed, NULL);
+  p.read_fn = read_fn;
+  p.src = src;
+  p.hasher = info->hasher;
+  p.depth = c->ingest_queue_depth ? c->ingest_queue_depth : 2*hash_threads+2;
+  if( p.depth<2 ) p.depth = 2;
+
+  pthread_t *threads = calloc(hash_threads+3, sizeof(*threads));
+  unsigned int started = 0;
+  p.batches = calloc(p.depth, sizeof(*p.batches));
+  if( !threads || !p.batches ) goto no_memory;
+  for( i=0; i<INGEST_READ_BLOCKS; i++ ){
+    if( !(p.blocks[i].data = malloc(INGEST_READ_SIZE)) ) goto no_memory;
+  }
+  for( i=0; i<p.depth; i++ ){
+    p.batches[i].buf = malloc(INGEST_BATCH_BYTES);
+    p.batches[i].chunks = malloc(INGEST_BATCH_CHUNKS*sizeof(ingest_chunk));
+    if( !p.batches[i].buf || !p.batches[i].chunks ) goto no_memory;
+  }
+
+  if( pthread_create(&threads[started], NULL, reader_run, &p)==0 ) started++;
+  if( started==1 && pthread_create(&threads[started], NULL, chunker_run, &p)==0 ) started++;
+  if( started==2 && p.hasher && pthread_create(&threads[started], NULL, file_hasher_run, &p)==0 ) started++;
+  if( started==2+(p.hasher!=NULL) ){
+    for( i=0; i<hash_threads; i++ ){
+      if( pthread_create(&threads[started], NULL, hasher_run, &p) ) break;
+      started++;
+    }
+  }
+  if( started < 3+(p.hasher!=NULL) ){
+    /* Every stage needs at least one thread */
+    pipe_stop(&p);
+    ctx_errmsg(c, sqlite3_mprintf("Could not start the ingest threads"));
+  }else{
+    err = writer_run(&p, info);
+  }
+
+  for( i=0; i<started; i++ ) pthread_join(threads[i], NULL);
+  if( p.chunk_err ) err = 1;
+  free(threads);
+  pipe_free(&p);
+  return err;
+
+no_memory:
+  ctx_errtype(c, CTX_ERR_NO_MEMORY);
+  free(threads);
+  pipe_free(&p);
+  return 1;
+}
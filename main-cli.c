@@ -21,7 +21,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include "freezefile.h"
+#ifndef _WIN32
+#include <signal.h>
+#endif
+#ifdef _WIN32
 #include <Windows.h>
+#include <io.h>
+#include <fcntl.h>
 
 /* I couldn't link to wcscpy_s with mingw... */
 void wstrcpy_s(WCHAR *dest, size_t capacity, WCHAR *source){
@@ -127,15 +133,188 @@ int make_snapshot(ctx *c, WCHAR *path, WCHAR *note){
   
   ctx_finish_snapshot(c);
 }
+#else
+/* Everything under path, walked and read on one thread per core. Files
+** whose stat is unchanged since the last snapshot are not read again, and
+** with a journal kept by the watch verb only the changed paths are
+** visited at all. Only what changed since the latest snapshot is
+** recorded. */
+int make_snapshot(ctx *c, const char *path, const char *note, const char *journal){
+  ctx_tree_stats stats;
+  ctx_tree_opts opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.journal = journal;
+  ctx_set_reuse(c, CTX_REUSE_STRICT);
+  if( ctx_begin_delta_snapshot(c, note, 0) ) return 1;
+  if( ctx_snapshot_tree(c, path, &opts, &stats) ){
+    ctx_abort_snapshot(c);
+    return 1;
+  }
+  if( ctx_finish_snapshot(c) ) return 1;
+  fprintf(stderr, "Added %lld files (%lld bytes, %lld unchanged, %lld not visited); %lld could not be read\n",
+          stats.files, stats.bytes, stats.reused, stats.carried, stats.skipped);
+  sqlite3_int64 hits, misses;
+  ctx_chunk_hint_stats(c, &hits, &misses);
+  if( hits+misses ){
+    fprintf(stderr, "%lld of %lld chunks of changed files found among their previous chunks\n", hits, hits+misses);
+  }
+  return 0;
+}
+
+static volatile int watch_stop;
+
+static void stop_watching(int sig){
+  (void)sig;
+  watch_stop = 1;
+}
+
+/* watch dir journal, until interrupted */
+int watch(ctx *c, int argc, char *args[]){
+  if( argc<2 ){
+    fprintf(stderr, "Usage: watch dir journal\n");
+    return 1;
+  }
+  signal(SIGINT, stop_watching);
+  signal(SIGTERM, stop_watching);
+  return ctx_watch(c, args[0], args[1], &watch_stop);
+}
+#endif
+
+static void print_scrub_problem(void *arg, const ctx_scrub_problem *problem){
+  (void)arg;
+  printf("%s %lld is damaged; affected revisions:",
+         problem->kind==CTX_SCRUB_CHUNK ? "Chunk" : "Content", problem->id);
+  unsigned int i;
+  for( i=0; i<problem->revision_count; i++ ){
+    printf(" %lld", problem->revision_ids[i]);
+  }
+  printf("\n");
+}
+
+static void print_scrub_checkpoint(void *arg, const ctx_scrub_checkpoint *checkpoint){
+  (void)arg;
+  printf("Checkpoint: %lld %lld\n", checkpoint->chunk_id, checkpoint->content_id);
+}
+
+/* scrub [fast|deep] [chunk_id content_id], where the ids come from a previous
+** run's last checkpoint */
+int scrub(ctx *c, int argc, char *args[]){
+  ctx_scrub_opts opts;
+  ctx_scrub_stats stats;
+  memset(&opts, 0, sizeof(opts));
+  opts.mode = CTX_SCRUB_DEEP;
+  if( argc>=1 && (strcmp(args[0], "fast")==0 || strcmp(args[0], "deep")==0) ){
+    if( strcmp(args[0], "fast")==0 ) opts.mode = CTX_SCRUB_FAST;
+    argc--;
+    args++;
+  }
+  if( argc>=2 ){
+    opts.resume_from.chunk_id = atoll(args[0]);
+    opts.resume_from.content_id = atoll(args[1]);
+  }
+  opts.on_problem = print_scrub_problem;
+  opts.on_checkpoint = print_scrub_checkpoint;
+  
+  if( ctx_scrub(c, &opts, &stats) ) return 1;
+  printf("Checked %lld chunks and %lld contents (%lld bytes): %lld damaged chunks, %lld damaged contents\n",
+         stats.chunks, stats.contents, stats.bytes, stats.bad_chunks, stats.bad_contents);
+  return stats.bad_chunks || stats.bad_contents;
+}
+
+/* export-tar snapshot_id, writing the archive to stdout */
+int export_tar(ctx *c, int argc, char *args[]){
+  if( argc<1 ){
+    fprintf(stderr, "Usage: export-tar snapshot_id > archive.tar\n");
+    return 1;
+  }
+  fflush(stdout);
+#ifdef _WIN32
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  return ctx_export_tar(c, atoll(args[0]), fileno(stdout));
+}
+
+static int print_diff_entry(void *arg, const ctx_diff_entry *e){
+  static const char marks[] = " ADMT";
+  printf("%c %s", marks[e->change], e->path);
+  if( *(int *)arg && (e->change==CTX_DIFF_ADDED || e->change==CTX_DIFF_MODIFIED) ){
+    printf(" (%lld of %lld chunks new, %lld bytes)", e->new_chunks, e->chunks, e->new_bytes);
+  }
+  printf("\n");
+  return 0;
+}
+
+/* diff from_id to_id [chunks] */
+int diff(ctx *c, int argc, char *args[]){
+  ctx_diff_opts opts;
+  ctx_diff_stats stats;
+  if( argc<2 ){
+    fprintf(stderr, "Usage: diff from_id to_id [chunks]\n");
+    return 1;
+  }
+  memset(&opts, 0, sizeof(opts));
+  opts.chunks = argc>=3 && strcmp(args[2], "chunks")==0;
+  opts.each = print_diff_entry;
+  opts.arg = &opts.chunks;
+  if( ctx_diff_snapshots(c, atoll(args[0]), atoll(args[1]), &opts, &stats) ) return 1;
+  printf("%lld added, %lld removed, %lld modified, %lld touched",
+         stats.added, stats.removed, stats.modified, stats.touched);
+  if( opts.chunks ) printf("; %lld new chunks, %lld bytes", stats.new_chunks, stats.new_bytes);
+  printf("\n");
+  return 0;
+}
+
+/* import-tar [note], reading the archive from stdin into a new snapshot */
+int import_tar(ctx *c, int argc, char *args[]){
+#ifdef _WIN32
+  _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  if( ctx_begin_snapshot(c, argc>=1 ? args[0] : "Imported from tar") ) return 1;
+  if( ctx_add_tar_to_snapshot(c, stdin) ){
+    ctx_abort_snapshot(c);
+    return 1;
+  }
+  return ctx_finish_snapshot(c);
+}
 
 int main(int argc, char *args[]){
   ctx c;
-  printf("here");
+  int status = 0; /* The process's exit status: nonzero if the verb failed or found damage */
   if (ctx_init(&c, "db.freezefile")) goto out;
   
+  if( argc>1 && strcmp(args[1], "scrub")==0 ){
+    status = scrub(&c, argc-2, args+2);
+    goto out;
+  }
+  if( argc>1 && strcmp(args[1], "export-tar")==0 ){
+    status = export_tar(&c, argc-2, args+2);
+    goto out;
+  }
+  if( argc>1 && strcmp(args[1], "diff")==0 ){
+    status = diff(&c, argc-2, args+2);
+    goto out;
+  }
+  if( argc>1 && strcmp(args[1], "import-tar")==0 ){
+    status = import_tar(&c, argc-2, args+2);
+    goto out;
+  }
+  
+#ifdef _WIN32
   WCHAR path[MAX_PATH] = L".\\proj\\";
   
   make_snapshot(&c, path, L"Initial commit");
+#else
+  /* snapshot [dir [note [journal]]] */
+  if( argc>1 && strcmp(args[1], "snapshot")==0 ){
+    status = make_snapshot(&c, argc>2 ? args[2] : "proj", argc>3 ? args[3] : "Initial commit", argc>4 ? args[4] : NULL);
+    goto out;
+  }
+  if( argc>1 && strcmp(args[1], "watch")==0 ){
+    status = watch(&c, argc-2, args+2);
+    goto out;
+  }
+  status = make_snapshot(&c, "proj", "Initial commit", NULL);
+#endif
   
   //if (ctx_ingest(&c, "test.txt")) goto out;
   
@@ -143,9 +322,11 @@ int main(int argc, char *args[]){
   
 out:
   if( c.errmsg ){
-    printf("%s\n", c.errmsg);
+    fprintf(stderr, "%s\n", c.errmsg);
   }else if( c.errtype ){
-    printf("Error code %d\n", c.errtype);
+    fprintf(stderr, "Error code %d\n", c.errtype);
   }
+  if( c.errtype ) status = 1;
   ctx_close(&c);
+  return status;
 }
@@ -0,0 +1,579 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include "blake2.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Directory hashes.
+**
+** The directories of a snapshot are the ones its paths imply: every
+** prefix of a path that ends just before a '/', other than the empty one,
+** and '' above them all. A directory's hash is the BLAKE2b of its entries
+** in path order, where a directory sorts as the paths under it do, each
+** one
+**
+**   'f' name 0 size mtime_ns content-hash   for a file
+**   'd' name 0 directory-hash               for a directory
+**
+** with size and mtime_ns as 8 little-endian bytes, -1 when unknown.
+**
+** A snapshot with nothing to build on works them all out bottom-up from
+** its files sorted by path, in which everything under a directory comes
+** together, keeping only the directories from the top down to the current
+** file open. A delta snapshot whose parent has hashes only rehashes the
+** directories its own revisions fall in, and their ancestors, deepest
+** first, each from its files and the hashes of its subdirectories.
+*/
+
+typedef struct dir_hash {
+  char *path;
+  unsigned char hash[HASH_LENGTH];
+} dir_hash;
+
+typedef struct open_dir {
+  char *path;
+  blake2b_state b;
+} open_dir;
+
+typedef struct dir_builder {
+  open_dir *stack;
+  unsigned int depth;
+  unsigned int stack_capacity;
+  dir_hash *done;
+  size_t done_count;
+  size_t done_capacity;
+} dir_builder;
+
+size_t ctx_dir_length(const char *path){
+  const char *slash = strrchr(path, '/');
+  return slash ? (size_t)(slash-path) : 0;
+}
+
+/* Whether dir is ancestor or one of its subdirectories */
+static int dir_within(const char *ancestor, const char *dir){
+  size_t len = strlen(ancestor);
+  if( len==0 ) return 1;
+  return strncmp(ancestor, dir, len)==0 && (dir[len]=='\0' || dir[len]=='/');
+}
+
+/* The name of path within its directory */
+static const char *dir_entry_name(const char *path){
+  const char *slash = strrchr(path, '/');
+  return slash && slash!=path ? slash+1 : (path[0]=='/' ? path+1 : path);
+}
+
+static void dir_feed_entry(blake2b_state *b, char kind, const char *name){
+  blake2b_update(b, (const uint8_t *)&kind, 1);
+  blake2b_update(b, (const uint8_t *)name, strlen(name)+1);
+}
+
+static void dir_feed_int(blake2b_state *b, sqlite3_int64 value){
+  unsigned char bytes[8];
+  uint64_t v = (uint64_t)value;
+  int i;
+  for( i=0; i<8; i++ ){
+    bytes[i] = (unsigned char)(v >> (8*i));
+  }
+  blake2b_update(b, bytes, sizeof(bytes));
+}
+
+/* Enter the file of stmt's row: path, size, mtime_ns, content hash */
+static void dir_feed_file(blake2b_state *b, sqlite3_stmt *stmt){
+  dir_feed_entry(b, 'f', dir_entry_name((const char *)sqlite3_column_text(stmt, 0)));
+  dir_feed_int(b, sqlite3_column_type(stmt, 1)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 1));
+  dir_feed_int(b, sqlite3_column_type(stmt, 2)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 2));
+  if( sqlite3_column_bytes(stmt, 3)==HASH_LENGTH ){
+    blake2b_update(b, sqlite3_column_blob(stmt, 3), HASH_LENGTH);
+  }
+}
+
+static void dir_feed_dir(blake2b_state *b, const char *path, const void *hash){
+  dir_feed_entry(b, 'd', dir_entry_name(path));
+  blake2b_update(b, hash, HASH_LENGTH);
+}
+
+static int dir_push(dir_builder *d, const char *path, size_t len){
+  if( d->depth==d->stack_capacity ){
+    unsigned int capacity = d->stack_capacity ? d->stack_capacity*2 : 32;
+    open_dir *grown = realloc(d->stack, capacity*sizeof(*grown));
+    if( !grown ) return 1;
+    d->stack = grown;
+    d->stack_capacity = capacity;
+  }
+  open_dir *o = &d->stack[d->depth];
+  o->path = malloc(len+1);
+  if( !o->path ) return 1;
+  memcpy(o->path, path, len);
+  o->path[len] = '\0';
+  blake2b_init(&o->b, HASH_LENGTH);
+  d->depth++;
+  return 0;
+}
+
+/* Finish the innermost open directory and enter it in its parent */
+static int dir_pop(dir_builder *d){
+  open_dir *o = &d->stack[--d->depth];
+  if( d->done_count==d->done_capacity ){
+    size_t capacity = d->done_capacity ? d->done_capacity*2 : 256;
+    dir_hash *grown = realloc(d->done, capacity*sizeof(*grown));
+    if( !grown ){
+      free(o->path);
+      return 1;
+    }
+    d->done = grown;
+    d->done_capacity = capacity;
+  }
+  dir_hash *h = &d->done[d->done_count++];
+  h->path = o->path;
+  blake2b_final(&o->b, h->hash, HASH_LENGTH);
+  if( d->depth ){
+    dir_feed_dir(&d->stack[d->depth-1].b, h->path, h->hash);
+  }
+  return 0;
+}
+
+/* Open the directories from the innermost open one down to dir, the
+** first dir_len bytes of a file's path */
+static int dir_descend(dir_builder *d, const char *path, size_t dir_len){
+  while( 1 ){
+    const char *top = d->stack[d->depth-1].path;
+    size_t top_len = strlen(top);
+    if( top_len==dir_len && (top_len==0 || strncmp(top, path, dir_len)==0) ) return 0;
+    /* The next '/' past the open one; a leading '/' names no directory */
+    size_t next = top_len ? top_len+1 : 1;
+    while( next<dir_len && path[next]!='/' ) next++;
+    if( dir_push(d, path, next) ) return 1;
+  }
+}
+
+static void dir_builder_free(dir_builder *d){
+  size_t i;
+  for( i=0; i<d->depth; i++ ) free(d->stack[i].path);
+  for( i=0; i<d->done_count; i++ ) free(d->done[i].path);
+  free(d->stack);
+  free(d->done);
+}
+
+static int dir_hash_cmp(const void *a, const void *b){
+  return strcmp(((const dir_hash *)a)->path, ((const dir_hash *)b)->path);
+}
+
+static int ctx_insert_directory(ctx *c, const char *path, const unsigned char *hash){
+  sqlite3_stmt *stmt = c->insert_directory;
+  int err = ctx_collect_err(c, sqlite3_reset(stmt))
+         || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, c->creating_snapshot_id))
+         || ctx_collect_err(c, sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC))
+         || (hash && ctx_collect_err(c, sqlite3_bind_blob(stmt, 3, hash, HASH_LENGTH, SQLITE_STATIC)))
+         || (path[0] && ctx_collect_err(c, sqlite3_bind_text(stmt, 4, path, (int)ctx_dir_length(path), SQLITE_STATIC)))
+         || ctx_collect_err(c, sqlite3_step(stmt));
+  sqlite3_clear_bindings(stmt);
+  return err;
+}
+
+/* Store the hashes that differ from the parent's, and a tombstone for
+** each directory of the parent that is gone, by merging the two lists in
+** path order */
+static int ctx_store_directories(ctx *c, dir_hash *dirs, size_t count){
+  sqlite3_stmt *stmt = c->select_snapshot_dirs;
+  size_t i = 0;
+  int step_result = SQLITE_DONE;
+  int err = 0;
+
+  if( c->parent_snapshot_id ){
+    if( ctx_collect_err(c, sqlite3_reset(stmt))
+     || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, c->parent_snapshot_id))
+     || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+    ){
+      return 1;
+    }
+  }
+  while( !err && (i<count || step_result==SQLITE_ROW) ){
+    int order;
+    if( step_result!=SQLITE_ROW ){
+      order = -1;
+    }else if( i==count ){
+      order = 1;
+    }else{
+      order = strcmp(dirs[i].path, (const char *)sqlite3_column_text(stmt, 0));
+    }
+
+    if( order<0 ){
+      err = ctx_insert_directory(c, dirs[i].path, dirs[i].hash);
+      i++;
+      continue;
+    }
+    if( order>0 ){
+      err = ctx_insert_directory(c, (const char *)sqlite3_column_text(stmt, 0), NULL);
+    }else{
+      if( sqlite3_column_bytes(stmt, 1)!=HASH_LENGTH
+       || memcmp(sqlite3_column_blob(stmt, 1), dirs[i].hash, HASH_LENGTH)
+      ){
+        err = ctx_insert_directory(c, dirs[i].path, dirs[i].hash);
+      }
+      i++;
+    }
+    if( !err ) err = ctx_collect_err(c, step_result=sqlite3_step(stmt));
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return err;
+}
+
+/* Hash every directory of the open snapshot */
+static int ctx_hash_all_directories(ctx *c){
+  sqlite3_stmt *stmt = c->select_snapshot_tree;
+  dir_builder d;
+  int step_result;
+  int err = 0;
+
+  memset(&d, 0, sizeof(d));
+  if( dir_push(&d, "", 0) ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, c->creating_snapshot_id))
+  ){
+    err = 1;
+  }
+  while( !err && 0==(err=ctx_collect_err(c, step_result=sqlite3_step(stmt))) && step_result==SQLITE_ROW ){
+    const char *path = (const char *)sqlite3_column_text(stmt, 0);
+
+    while( !err && !dir_within(d.stack[d.depth-1].path, path) ) err = dir_pop(&d);
+    if( !err ) err = dir_descend(&d, path, ctx_dir_length(path));
+    if( err ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      break;
+    }
+    dir_feed_file(&d.stack[d.depth-1].b, stmt);
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  while( !err && d.depth ){
+    if( dir_pop(&d) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      err = 1;
+    }
+  }
+  if( !err ){
+    qsort(d.done, d.done_count, sizeof(*d.done), dir_hash_cmp);
+    err = ctx_store_directories(c, d.done, d.done_count);
+  }
+  dir_builder_free(&d);
+  return err;
+}
+
+
+/* Look up path's hash in snapshot_id. *found is set only if it has one. */
+static int dir_lookup_hash(ctx *c, sqlite3_int64 snapshot_id, const char *path,
+                           unsigned char *hash, int *found){
+  sqlite3_stmt *stmt = c->select_directory_hash;
+  int step_result;
+
+  *found = 0;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, snapshot_id))
+   || ctx_collect_err(c, sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
+    sqlite3_clear_bindings(stmt);
+    return 1;
+  }
+  if( step_result==SQLITE_ROW && sqlite3_column_bytes(stmt, 0)==HASH_LENGTH ){
+    memcpy(hash, sqlite3_column_blob(stmt, 0), HASH_LENGTH);
+    *found = 1;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return 0;
+}
+
+int ctx_has_directory_hashes(ctx *c, sqlite3_int64 snapshot_id, int *has){
+  unsigned char hash[HASH_LENGTH];
+  c->err_context = "looking up directory hashes";
+  return dir_lookup_hash(c, snapshot_id, "", hash, has);
+}
+
+/* Whether a file's path sorts before (<0) or after (>0) what is under dir */
+static int dir_file_order(const char *file, const char *dir){
+  size_t len = strlen(dir);
+  int order = strncmp(file, dir, len);
+  return order ? order : (int)(unsigned char)file[len] - '/';
+}
+
+/* Whether two directories' paths sort before (<0) or after (>0) each other
+** once each has a '/' on the end */
+static int dir_path_order(const char *a, const char *b){
+  while( *a && *a==*b ){
+    a++;
+    b++;
+  }
+  return (int)(unsigned char)(*a ? *a : '/') - (int)(unsigned char)(*b ? *b : '/');
+}
+
+static int dir_open_subdirs(ctx *c, sqlite3_stmt *stmt, sqlite3_int64 snapshot_id, const char *path, int *step_result){
+  return ctx_collect_err(c, sqlite3_reset(stmt))
+      || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, snapshot_id))
+      || ctx_collect_err(c, sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC))
+      || ctx_collect_err(c, *step_result=sqlite3_step(stmt));
+}
+
+/* Hash path in the open snapshot from its files and the hashes of its
+** subdirectories, which are already up to date. *empty is set if it has
+** neither. */
+static int ctx_hash_one_directory(ctx *c, const char *path, unsigned char *hash, int *empty){
+  sqlite3_stmt *files = c->select_dir_files;
+  sqlite3_stmt *dirs = c->select_dir_subdirs;
+  int files_result, dirs_result;
+  blake2b_state b;
+  int err = 1;
+
+  *empty = 1;
+  blake2b_init(&b, HASH_LENGTH);
+  if( ctx_collect_err(c, sqlite3_reset(files))
+   || ctx_collect_err(c, sqlite3_bind_int64(files, 1, c->creating_snapshot_id))
+   || ctx_collect_err(c, sqlite3_bind_text(files, 2, path, -1, SQLITE_STATIC))
+   || ctx_collect_err(c, files_result=sqlite3_step(files))
+   || dir_open_subdirs(c, dirs, c->creating_snapshot_id, path, &dirs_result)
+  ){
+    goto out;
+  }
+  while( files_result==SQLITE_ROW || dirs_result==SQLITE_ROW ){
+    const char *dir_path = dirs_result==SQLITE_ROW ? (const char *)sqlite3_column_text(dirs, 0) : NULL;
+    *empty = 0;
+    if( files_result==SQLITE_ROW
+     && (!dir_path || dir_file_order((const char *)sqlite3_column_text(files, 0), dir_path)<0)
+    ){
+      dir_feed_file(&b, files);
+      if( ctx_collect_err(c, files_result=sqlite3_step(files)) ) goto out;
+    }else{
+      dir_feed_dir(&b, dir_path, sqlite3_column_blob(dirs, 1));
+      if( ctx_collect_err(c, dirs_result=sqlite3_step(dirs)) ) goto out;
+    }
+  }
+  blake2b_final(&b, hash, HASH_LENGTH);
+  err = 0;
+
+out:
+  sqlite3_reset(files);
+  sqlite3_clear_bindings(files);
+  sqlite3_reset(dirs);
+  sqlite3_clear_bindings(dirs);
+  return err;
+}
+
+static int dir_path_cmp(const void *a, const void *b){
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* The directories the open snapshot's revisions fall in, and every one
+** above them, sorted by path and without repeats */
+static int ctx_changed_directories(ctx *c, char ***dirs, size_t *count){
+  sqlite3_stmt *stmt = c->select_changed_file_dirs;
+  size_t capacity = 0, i, kept;
+  int step_result;
+  int err = 0;
+
+  *dirs = NULL;
+  *count = 0;
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, c->creating_snapshot_id))
+  ){
+    return 1;
+  }
+  while( !err && 0==(err=ctx_collect_err(c, step_result=sqlite3_step(stmt))) && step_result==SQLITE_ROW ){
+    const char *path = (const char *)sqlite3_column_text(stmt, 0);
+    size_t len;
+    if( !path ) path = "";
+    len = strlen(path);
+    while( 1 ){
+      if( *count==capacity ){
+        capacity = capacity ? capacity*2 : 64;
+        char **grown = realloc(*dirs, capacity*sizeof(*grown));
+        if( !grown ){
+          err = 1;
+          break;
+        }
+        *dirs = grown;
+      }
+      char *dir = malloc(len+1);
+      if( !dir ){
+        err = 1;
+        break;
+      }
+      memcpy(dir, path, len);
+      dir[len] = '\0';
+      (*dirs)[(*count)++] = dir;
+      if( len==0 ) break;
+      len = ctx_dir_length(dir);
+    }
+    if( err ) ctx_errtype(c, CTX_ERR_NO_MEMORY);
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  qsort(*dirs, *count, sizeof(**dirs), dir_path_cmp);
+  for( i=0, kept=0; i<*count; i++ ){
+    if( kept && 0==strcmp((*dirs)[kept-1], (*dirs)[i]) ){
+      free((*dirs)[i]);
+    }else{
+      (*dirs)[kept++] = (*dirs)[i];
+    }
+  }
+  *count = kept;
+  return err;
+}
+
+/* Rehash the directories the open delta snapshot changed. Every directory
+** sorts after those above it, so going backwards finishes each one's
+** subdirectories before it. */
+static int ctx_rehash_directories(ctx *c){
+  char **dirs;
+  size_t count, i;
+  int err;
+
+  err = ctx_changed_directories(c, &dirs, &count);
+  for( i=count; !err && i>0; i-- ){
+    const char *path = dirs[i-1];
+    unsigned char hash[HASH_LENGTH], old_hash[HASH_LENGTH];
+    int empty, found;
+
+    err = ctx_hash_one_directory(c, path, hash, &empty)
+       || dir_lookup_hash(c, c->parent_snapshot_id, path, old_hash, &found);
+    if( err ) break;
+    if( empty && path[0] ){
+      /* Nothing is left under it */
+      if( found ) err = ctx_insert_directory(c, path, NULL);
+    }else if( !found || memcmp(hash, old_hash, HASH_LENGTH) ){
+      err = ctx_insert_directory(c, path, hash);
+    }
+  }
+  for( i=0; i<count; i++ ) free(dirs[i]);
+  free(dirs);
+  return err;
+}
+
+int ctx_hash_directories(ctx *c){
+  int incremental = 0;
+
+  if( c->parent_snapshot_id
+   && ctx_has_directory_hashes(c, c->parent_snapshot_id, &incremental)
+  ){
+    return 1;
+  }
+  c->err_context = "hashing directories";
+  return incremental ? ctx_rehash_directories(c) : ctx_hash_all_directories(c);
+}
+
+/* The walk's directories still to visit */
+typedef struct dir_stack {
+  char **paths;
+  size_t depth;
+  size_t capacity;
+} dir_stack;
+
+static int dir_stack_push(dir_stack *s, const char *path){
+  if( s->depth==s->capacity ){
+    size_t capacity = s->capacity ? s->capacity*2 : 64;
+    char **grown = realloc(s->paths, capacity*sizeof(*grown));
+    if( !grown ) return 1;
+    s->paths = grown;
+    s->capacity = capacity;
+  }
+  s->paths[s->depth] = strdup(path);
+  if( !s->paths[s->depth] ) return 1;
+  s->depth++;
+  return 0;
+}
+
+/* Push the subdirectories of path that differ between the two snapshots,
+** so that they come off in path order */
+static int ctx_push_changed_subdirs(ctx *c, sqlite3_int64 from_snapshot_id, sqlite3_int64 to_snapshot_id,
+                                    const char *path, dir_stack *s){
+  sqlite3_stmt *from = c->select_dir_subdirs;
+  sqlite3_stmt *to = c->select_dir_subdirs_other;
+  size_t first = s->depth, lo, hi;
+  int from_result, to_result;
+  int err = 1;
+
+  if( dir_open_subdirs(c, from, from_snapshot_id, path, &from_result)
+   || dir_open_subdirs(c, to, to_snapshot_id, path, &to_result)
+  ){
+    goto out;
+  }
+  while( from_result==SQLITE_ROW || to_result==SQLITE_ROW ){
+    const char *from_path = from_result==SQLITE_ROW ? (const char *)sqlite3_column_text(from, 0) : NULL;
+    const char *to_path = to_result==SQLITE_ROW ? (const char *)sqlite3_column_text(to, 0) : NULL;
+    int order = !from_path ? 1 : !to_path ? -1 : dir_path_order(from_path, to_path);
+
+    if( order!=0 || memcmp(sqlite3_column_blob(from, 1), sqlite3_column_blob(to, 1), HASH_LENGTH) ){
+      if( dir_stack_push(s, order>0 ? to_path : from_path) ){
+        ctx_errtype(c, CTX_ERR_NO_MEMORY);
+        goto out;
+      }
+    }
+    if( order<=0 && ctx_collect_err(c, from_result=sqlite3_step(from)) ) goto out;
+    if( order>=0 && ctx_collect_err(c, to_result=sqlite3_step(to)) ) goto out;
+  }
+  for( lo=first, hi=s->depth; lo+1<hi; lo++, hi-- ){
+    char *swap = s->paths[lo];
+    s->paths[lo] = s->paths[hi-1];
+    s->paths[hi-1] = swap;
+  }
+  err = 0;
+
+out:
+  sqlite3_reset(from);
+  sqlite3_clear_bindings(from);
+  sqlite3_reset(to);
+  sqlite3_clear_bindings(to);
+  return err;
+}
+
+int ctx_changed_dirs(ctx *c, sqlite3_int64 from_snapshot_id, sqlite3_int64 to_snapshot_id,
+                     int (*each)(void *arg, const char *path), void *arg){
+  unsigned char from_hash[HASH_LENGTH], to_hash[HASH_LENGTH];
+  int from_found, to_found;
+  dir_stack s;
+  int err;
+
+  memset(&s, 0, sizeof(s));
+  c->err_context = "comparing directory hashes";
+  if( dir_lookup_hash(c, from_snapshot_id, "", from_hash, &from_found)
+   || dir_lookup_hash(c, to_snapshot_id, "", to_hash, &to_found)
+  ){
+    return 1;
+  }
+  if( from_found && to_found && 0==memcmp(from_hash, to_hash, HASH_LENGTH) ) return 0;
+  if( (err = dir_stack_push(&s, ""))!=0 ) ctx_errtype(c, CTX_ERR_NO_MEMORY);
+
+  /* From the top down, only into the directories that differ */
+  while( !err && s.depth ){
+    char *path = s.paths[--s.depth];
+    err = each(arg, path);
+    if( !err ) err = ctx_push_changed_subdirs(c, from_snapshot_id, to_snapshot_id, path, &s);
+    free(path);
+  }
+  while( s.depth ) free(s.paths[--s.depth]);
+  free(s.paths);
+  return err;
+}
@@ -0,0 +1,151 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* A fixed set of threads that run numbered tasks. pool_run hands out task
+** indexes from a shared counter and returns once every task has finished,
+** so callers write ordinary loops and keep results in per-task slots.
+*/
+struct pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+  pthread_t *threads;
+  unsigned int thread_count;
+
+  void (*fn)(void *arg, unsigned int worker, unsigned int task);
+  void *arg;
+  unsigned int next_task;
+  unsigned int task_count;
+  unsigned int running;
+  unsigned int generation;
+  int shutting_down;
+};
+
+typedef struct pool_worker {
+  pool *p;
+  unsigned int index;
+} pool_worker;
+
+static void *pool_main(void *ptr){
+  pool_worker *w = (pool_worker *)ptr;
+  pool *p = w->p;
+  unsigned int seen_generation = 0;
+
+  pthread_mutex_lock(&p->lock);
+  while( 1 ){
+    while( !p->shutting_down && seen_generation==p->generation ){
+      pthread_cond_wait(&p->work_ready, &p->lock);
+    }
+    if( p->shutting_down ) break;
+    seen_generation = p->generation;
+
+    p->running++;
+    while( p->next_task < p->task_count ){
+      unsigned int task = p->next_task++;
+      pthread_mutex_unlock(&p->lock);
+      p->fn(p->arg, w->index, task);
+      pthread_mutex_lock(&p->lock);
+    }
+    p->running--;
+    if( p->running==0 ) pthread_cond_broadcast(&p->work_done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  free(w);
+  return NULL;
+}
+
+unsigned int pool_default_threads(void){
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n>0 ? (unsigned int)n : 1;
+}
+
+pool *pool_create(unsigned int thread_count){
+  if( thread_count==0 ) thread_count = pool_default_threads();
+  pool *p = calloc(1, sizeof(*p));
+  if( !p ) return NULL;
+  p->threads = calloc(thread_count, sizeof(*p->threads));
+  if( !p->threads ){
+    free(p);
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work_ready, NULL);
+  pthread_cond_init(&p->work_done, NULL);
+
+  unsigned int i;
+  for( i=0; i<thread_count; i++ ){
+    pool_worker *w = malloc(sizeof(*w));
+    if( !w ) break;
+    w->p = p;
+    w->index = i;
+    if( pthread_create(&p->threads[i], NULL, pool_main, w) ){
+      free(w);
+      break;
+    }
+  }
+  p->thread_count = i;
+  if( i==0 ){
+    pool_destroy(p);
+    return NULL;
+  }
+  return p;
+}
+
+unsigned int pool_size(pool *p){
+  return p->thread_count;
+}
+
+void pool_run(pool *p, void (*fn)(void *arg, unsigned int worker, unsigned int task), void *arg, unsigned int task_count){
+  pthread_mutex_lock(&p->lock);
+  p->fn = fn;
+  p->arg = arg;
+  p->next_task = 0;
+  p->task_count = task_count;
+  p->generation++;
+  pthread_cond_broadcast(&p->work_ready);
+
+  /* Wait until the tasks are all handed out and the workers are idle again */
+  while( p->next_task < p->task_count || p->running > 0 ){
+    pthread_cond_wait(&p->work_done, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy(pool *p){
+  if( !p ) return;
+  pthread_mutex_lock(&p->lock);
+  p->shutting_down = 1;
+  pthread_cond_broadcast(&p->work_ready);
+  pthread_mutex_unlock(&p->lock);
+
+  unsigned int i;
+  for( i=0; i<p->thread_count; i++ ){
+    pthread_join(p->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work_ready);
+  pthread_cond_destroy(&p->work_done);
+  free(p->threads);
+  free(p);
+}
@@ -0,0 +1,137 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <string.h>
+
+/* Chunks are appended to the chunk table in rowid order, so giving a chunk
+** a fresh chunk_id moves its body to the end of the table's b-tree. Moving
+** chunks in the order a snapshot reads them therefore puts them in that
+** order in the b-tree, and the chunk_id is the only location record that
+** has to be swapped. The pages they land on are whichever the freelist
+** hands out, though, including those the moved originals just gave up, so
+** they only lie sequentially in the file once compact has run VACUUM,
+** which rewrites each table in rowid order.
+*/
+
+static int move_chunk(ctx *c, sqlite3_int64 chunk_id, const unsigned char *hash){
+  if( ctx_exec_with_id(c, c->repack_copy_chunk, chunk_id) ) return 1;
+  sqlite3_int64 new_id = sqlite3_last_insert_rowid(c->db);
+
+  if( ctx_collect_err(c, sqlite3_reset(c->repack_move_segments)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->repack_move_segments, 1, new_id)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->repack_move_segments, 2, chunk_id)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_step(c->repack_move_segments)) ) return 1;
+
+  if( ctx_exec_with_id(c, c->repack_delete_chunk, chunk_id) ) return 1;
+  if( ctx_collect_err(c, sqlite3_reset(c->repack_set_hash))
+   || ctx_collect_err(c, sqlite3_bind_blob(c->repack_set_hash, 1, hash, HASH_LENGTH, SQLITE_STATIC))
+   || ctx_collect_err(c, sqlite3_bind_int64(c->repack_set_hash, 2, new_id))
+   || ctx_collect_err(c, sqlite3_step(c->repack_set_hash))
+  ){
+    return 1;
+  }
+  return 0;
+}
+
+/* Move one batch of chunks in its own transaction. Returns the number of
+** bytes moved through *bytes, and leaves *ord at the last position done.
+*/
+static int move_batch(ctx *c, sqlite3_int64 *ord, sqlite3_int64 *bytes, int *done){
+  sqlite3_int64 ids[256];
+  unsigned char hashes[256][HASH_LENGTH];
+  int count = 0, rows = 0;
+  int step_result;
+
+  if( ctx_begin_transaction(c) ) return 1;
+
+  if( ctx_collect_err(c, sqlite3_reset(c->repack_next_batch)) ) goto error_out;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->repack_next_batch, 1, *ord)) ) goto error_out;
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(c->repack_next_batch)) && step_result==SQLITE_ROW ){
+    *ord = sqlite3_column_int64(c->repack_next_batch, 0);
+    rows++;
+    if( sqlite3_column_bytes(c->repack_next_batch, 3)!=HASH_LENGTH ) continue;
+    ids[count] = sqlite3_column_int64(c->repack_next_batch, 1);
+    memcpy(hashes[count++], sqlite3_column_blob(c->repack_next_batch, 3), HASH_LENGTH);
+    *bytes += sqlite3_column_int64(c->repack_next_batch, 2);
+  }
+  sqlite3_reset(c->repack_next_batch);
+  if( c->errtype!=CTX_ERR_NONE ) goto error_out;
+
+  int i;
+  for( i=0; i<count; i++ ){
+    if( move_chunk(c, ids[i], hashes[i]) ) goto error_out;
+  }
+  *done = rows==0;
+
+  return ctx_commit(c);
+
+error_out:
+  ctx_rollback(c);
+  return 1;
+}
+
+int ctx_repack(ctx *c, unsigned int recent_snapshots, unsigned int bytes_per_second, int compact){
+  if( c->creating_snapshot_id ){
+    ctx_errmsg(c, sqlite3_mprintf("Cannot repack while a snapshot is being created"));
+    return 1;
+  }
+  c->err_context = "planning a repack";
+
+  /* The order is fixed up front, so a chunk shared by many files is moved
+  ** once, next to the first file that reads it. */
+  if( ctx_begin_transaction(c) ) return 1;
+  if( ctx_exec_with_id(c, c->repack_clear_order, 0) ) goto plan_error;
+  if( ctx_collect_err(c, sqlite3_reset(c->repack_collect_order)) ) goto plan_error;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->repack_collect_order, 1,
+                         recent_snapshots ? (sqlite3_int64)recent_snapshots : ((sqlite3_int64)1)<<62)) ) goto plan_error;
+  if( ctx_collect_err(c, sqlite3_step(c->repack_collect_order)) ) goto plan_error;
+  if( ctx_commit(c) ) return 1;
+
+  c->err_context = "repacking chunks";
+  sqlite3_int64 ord = 0;
+  sqlite3_int64 bytes = 0;
+  sqlite3_int64 start = ctx_now_ms();
+  int done = 0;
+  while( !done ){
+    if( move_batch(c, &ord, &bytes, &done) ) return 1;
+
+    if( bytes_per_second ){
+      sqlite3_int64 due = start + bytes*1000/bytes_per_second;
+      sqlite3_int64 now = ctx_now_ms();
+      if( due > now ) sqlite3_sleep((int)(due - now));
+    }
+  }
+  ctx_exec_with_id(c, c->repack_clear_order, 0);
+
+  if( compact ){
+    c->err_context = "compacting the database";
+    /* Lookups elsewhere leave their statements positioned on a row, which
+    ** VACUUM refuses to run alongside. */
+    sqlite3_stmt *stmt = NULL;
+    while( (stmt = sqlite3_next_stmt(c->db, stmt)) ) sqlite3_reset(stmt);
+    if( ctx_exec_with_id(c, c->vacuum, 0) ) return 1;
+  }
+  return c->errtype != CTX_ERR_NONE;
+
+plan_error:
+  sqlite3_reset(c->repack_collect_order);
+  ctx_rollback(c);
+  return 1;
+}
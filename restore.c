@@ -0,0 +1,1580 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include "freezefile.h"
+#include "blake2.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Segments resolved from the index before any chunk body is read */
+#define RESTORE_BATCH 4096
+/* Chunk bodies are gathered here and written out in one go */
+#define RESTORE_BUFFER_SIZE (4*1024*1024)
+/* Chunk cache for a snapshot restore when neither the ctx nor the caller sets one */
+#define RESTORE_CACHE_DEFAULT (64*1024*1024)
+/* Image of the files being restored, per worker, when the caller sets no size */
+#define RESTORE_PLAN_DEFAULT (16*1024*1024)
+/* Most files a snapshot restore worker has open at once */
+#define RESTORE_PLAN_FILES 256
+/* Chunks the read-ahead may get in front of the copy */
+#define RESTORE_READAHEAD 512
+/* Minimum time between progress reports */
+#define RESTORE_PROGRESS_MS 500
+
+typedef struct restore_segment {
+  sqlite3_int64 chunk_id; /* 0 for a run of zeros */
+  unsigned int length;
+  int has_crc;
+  uint32_t crc;
+} restore_segment;
+
+typedef struct restore_out {
+  int fd;
+  const char *path;
+  unsigned char *buf;
+  size_t used;
+  sqlite3_int64 offset; /* Where buf[0] belongs in the file */
+  sqlite3_blob *blob; /* Reopened on each chunk instead of running a query */
+  chunk_cache *cache; /* May be NULL */
+} restore_out;
+
+static int restore_pwrite(ctx *c, int fd, const unsigned char *buf, size_t len, sqlite3_int64 offset, const char *path){
+  size_t done = 0;
+  while( done<len ){
+    ssize_t n = pwrite(fd, buf+done, len-done, (off_t)(offset+done));
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ){
+      ctx_errmsg(c, sqlite3_mprintf("Error writing to %s: %s", path, strerror(errno)));
+      return 1;
+    }
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+static int restore_flush(ctx *c, restore_out *out){
+  if( restore_pwrite(c, out->fd, out->buf, out->used, out->offset, out->path) ) return 1;
+  out->offset += out->used;
+  out->used = 0;
+  return 0;
+}
+
+static int restore_read_chunk(ctx *c, restore_out *out, const restore_segment *seg){
+  int rc;
+  if( seg->chunk_id==0 ){
+    /* Leave a hole. The file is truncated to its full length at the end,
+    ** so a trailing run is covered too. */
+    if( restore_flush(c, out) ) return 1;
+    out->offset += seg->length;
+    return 0;
+  }
+
+  if( RESTORE_BUFFER_SIZE-out->used < seg->length && restore_flush(c, out) ) return 1;
+  unsigned char *dest = out->buf + out->used;
+  if( out->cache && chunk_cache_get(out->cache, seg->chunk_id, dest, seg->length) ){
+    out->used += seg->length;
+    return 0;
+  }
+
+  if( out->blob ){
+    rc = sqlite3_blob_reopen(out->blob, seg->chunk_id);
+  }else{
+    rc = sqlite3_blob_open(c->db, "main", "chunk", "body", seg->chunk_id, 0, &out->blob);
+  }
+  if( rc!=SQLITE_OK || sqlite3_blob_bytes(out->blob)!=(int)seg->length ){
+    ctx_errmsg(c, sqlite3_mprintf("Got an invalid file chunk while restoring a revision"));
+    return 1;
+  }
+
+  if( ctx_collect_err(c, sqlite3_blob_read(out->blob, dest, (int)seg->length, 0)) ) return 1;
+  if( seg->has_crc && seg->crc!=crc32c(dest, seg->length) ){
+    ctx_errmsg(c, sqlite3_mprintf("Chunk %lld is damaged; %s is incomplete", seg->chunk_id, out->path));
+    return 1;
+  }
+  if( out->cache ) chunk_cache_put(out->cache, seg->chunk_id, dest, seg->length);
+  out->used += seg->length;
+  return 0;
+}
+
+/* Write a content's chunks, in order, to an open file starting at offset 0 */
+static int restore_content(ctx *c, sqlite3_int64 content_id, restore_out *out){
+  restore_segment *batch = malloc(RESTORE_BATCH*sizeof(*batch));
+  sqlite3_stmt *stmt = c->select_content_segments;
+  int step_result = SQLITE_ROW;
+  int err = 1;
+
+  if( !batch ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+
+  c->err_context = "restoring a revision";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) goto out;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, content_id)) ) goto out;
+  while( step_result==SQLITE_ROW ){
+    unsigned int count = 0, i;
+    while( count<RESTORE_BATCH
+        && 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW
+    ){
+      restore_segment *seg = &batch[count++];
+      seg->chunk_id = sqlite3_column_int64(stmt, 0);
+      seg->length = (unsigned int)sqlite3_column_int64(stmt, 1);
+      seg->has_crc = sqlite3_column_type(stmt, 2)!=SQLITE_NULL;
+      seg->crc = (uint32_t)sqlite3_column_int64(stmt, 2);
+    }
+    if( c->errtype!=CTX_ERR_NONE ) goto out;
+
+    for( i=0; i<count; i++ ){
+      if( restore_read_chunk(c, out, &batch[i]) ) goto out;
+    }
+  }
+  if( restore_flush(c, out) ) goto out;
+  err = 0;
+
+out:
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  free(batch);
+  return err;
+}
+
+/* Create path as a new file for writing. Whatever was there before is
+** unlinked rather than written through, so another hard link to it, or
+** the target of a symlink put in its place, is left as it was. */
+static int restore_create(const char *path){
+  if( unlink(path) && errno!=ENOENT ) return -1;
+  return open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0666);
+}
+
+/* Create or replace dest_path with a content. length, when known (not -1),
+** is used to preallocate the file; it is left unknown for sparse contents
+** so that their zero runs stay unallocated. */
+static int restore_file(ctx *c, restore_out *out, sqlite3_int64 content_id, sqlite3_int64 length, const char *dest_path){
+  int err = 1;
+
+  out->path = dest_path;
+  out->used = 0;
+  out->offset = 0;
+  /* TODO: Consider encoding of dest_path */
+  out->fd = restore_create(dest_path);
+  if( out->fd<0 ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not write to %s", dest_path));
+    return 1;
+  }
+
+#ifdef __linux__
+  /* Reserve the space up front so the file is laid out contiguously. Not
+  ** every filesystem supports this, and it is only a hint. */
+  if( length>0 ) fallocate(out->fd, 0, 0, (off_t)length);
+#endif
+
+  if( restore_content(c, content_id, out) ) goto out;
+  if( ftruncate(out->fd, (off_t)out->offset) ){
+    ctx_errmsg(c, sqlite3_mprintf("Error writing to %s: %s", dest_path, strerror(errno)));
+    goto out;
+  }
+  err = 0;
+
+out:
+  if( close(out->fd) && !err ){
+    ctx_errmsg(c, sqlite3_mprintf("Error writing to %s: %s", dest_path, strerror(errno)));
+    err = 1;
+  }
+  out->fd = -1;
+  return err;
+}
+
+static int restore_out_init(ctx *c, restore_out *out){
+  memset(out, 0, sizeof(*out));
+  out->fd = -1;
+  out->buf = malloc(RESTORE_BUFFER_SIZE);
+  if( !out->buf ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  return 0;
+}
+
+static void restore_out_free(restore_out *out){
+  if( out->blob ) sqlite3_blob_close(out->blob);
+  free(out->buf);
+  memset(out, 0, sizeof(*out));
+}
+
+int ctx_set_restore_cache(ctx *c, size_t budget){
+  chunk_cache_destroy(c->restore_cache);
+  c->restore_cache = NULL;
+  if( budget==0 ) return 0;
+  c->restore_cache = chunk_cache_create(budget);
+  if( !c->restore_cache ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  return 0;
+}
+
+void ctx_restore_cache_stats(ctx *c, sqlite3_int64 *hits, sqlite3_int64 *misses){
+  *hits = 0;
+  *misses = 0;
+  if( c->restore_cache ) chunk_cache_stats(c->restore_cache, hits, misses);
+}
+
+int ctx_spew(ctx *c, const char *dest_path, sqlite3_int64 revision_id){
+  restore_out out;
+  int err;
+
+  c->err_context = "finding a revision to restore";
+  sqlite3_int64 content_id = 0, length = -1;
+  int step_result;
+  if( ctx_collect_err(c, sqlite3_reset(c->select_revision_content)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(c->select_revision_content, 1, revision_id)) ) return 1;
+  if( ctx_collect_err(c, step_result=sqlite3_step(c->select_revision_content)) ) return 1;
+  if( step_result==SQLITE_ROW ){
+    content_id = sqlite3_column_int64(c->select_revision_content, 0);
+    if( sqlite3_column_type(c->select_revision_content, 1)!=SQLITE_NULL ){
+      length = sqlite3_column_int64(c->select_revision_content, 1);
+    }
+  }
+  sqlite3_reset(c->select_revision_content);
+  if( content_id==0 ){
+    ctx_errmsg(c, sqlite3_mprintf("There is no revision %lld", revision_id));
+    return 1;
+  }
+
+  if( restore_out_init(c, &out) ) return 1;
+  out.cache = c->restore_cache;
+  err = restore_file(c, &out, content_id, length, dest_path);
+  restore_out_free(&out);
+  return err;
+}
+
+/* A chunk of the existing file that the repository also holds */
+typedef struct local_chunk {
+  sqlite3_int64 chunk_id;
+  sqlite3_int64 offset;
+} local_chunk;
+
+typedef struct local_index {
+  ctx *c;
+  chunk_hints target; /* The chunks of the revision being restored, by hash */
+  local_chunk *by_offset; /* In the order the chunker found them */
+  local_chunk *by_chunk;  /* The same, sorted by chunk_id */
+  size_t count;
+  size_t capacity;
+  sqlite3_int64 offset;
+} local_index;
+
+static int index_local_chunk(unsigned int sequence, unsigned char *data, int data_len, void *ptr){
+  local_index *ix = (local_index *)ptr;
+  unsigned char hash[HASH_LENGTH];
+  (void)sequence;
+
+  if( data ){
+    if( blake2b(hash, data, NULL, HASH_LENGTH, (uint64_t)data_len, 0) ) return 1;
+    sqlite3_int64 chunk_id = chunk_hints_find(&ix->target, hash);
+    if( chunk_id ){
+      if( ix->count==ix->capacity ){
+        size_t wanted = ix->capacity ? ix->capacity*2 : 4096;
+        local_chunk *grown = realloc(ix->by_offset, wanted*sizeof(*grown));
+        if( !grown ){
+          ctx_errtype(ix->c, CTX_ERR_NO_MEMORY);
+          return 1;
+        }
+        ix->by_offset = grown;
+        ix->capacity = wanted;
+      }
+      ix->by_offset[ix->count].chunk_id = chunk_id;
+      ix->by_offset[ix->count].offset = ix->offset;
+      ix->count++;
+    }
+  }
+  ix->offset += data_len;
+  return 0;
+}
+
+static int local_chunk_cmp(const void *a, const void *b){
+  const local_chunk *la = (const local_chunk *)a;
+  const local_chunk *lb = (const local_chunk *)b;
+  if( la->chunk_id!=lb->chunk_id ) return la->chunk_id < lb->chunk_id ? -1 : 1;
+  if( la->offset!=lb->offset ) return la->offset < lb->offset ? -1 : 1;
+  return 0;
+}
+
+/* Whether the existing file has chunk_id at offset */
+static int local_has_at(const local_index *ix, sqlite3_int64 chunk_id, sqlite3_int64 offset){
+  size_t lo = 0, hi = ix->count;
+  while( lo<hi ){
+    size_t mid = lo + (hi-lo)/2;
+    if( ix->by_offset[mid].offset<offset ) lo = mid+1; else hi = mid;
+  }
+  return lo<ix->count && ix->by_offset[lo].offset==offset && ix->by_offset[lo].chunk_id==chunk_id;
+}
+
+/* Where the existing file has chunk_id, or -1 */
+static sqlite3_int64 local_find(const local_index *ix, sqlite3_int64 chunk_id){
+  size_t lo = 0, hi = ix->count;
+  while( lo<hi ){
+    size_t mid = lo + (hi-lo)/2;
+    if( ix->by_chunk[mid].chunk_id<chunk_id ) lo = mid+1; else hi = mid;
+  }
+  return lo<ix->count && ix->by_chunk[lo].chunk_id==chunk_id ? ix->by_chunk[lo].offset : -1;
+}
+
+/* Only chunks the revision has are worth remembering, so the existing
+** file's chunks are looked up among those rather than in the repository */
+static int local_index_load_target(ctx *c, local_index *ix, sqlite3_int64 content_id){
+  sqlite3_stmt *stmt = c->select_content_chunk_ids;
+  int step_result;
+
+  c->err_context = "loading a revision's chunks";
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, content_id))
+   || ctx_collect_err(c, sqlite3_bind_int(stmt, 2, -1))
+  ){
+    return 1;
+  }
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( sqlite3_column_bytes(stmt, 1)!=HASH_LENGTH ) continue;
+    if( chunk_hints_add(&ix->target, sqlite3_column_blob(stmt, 1), sqlite3_column_int64(stmt, 0)) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      break;
+    }
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return c->errtype!=CTX_ERR_NONE;
+}
+
+static int local_index_build(ctx *c, local_index *ix, const char *path){
+  unsigned char buf[MAX_CHUNK_SIZE];
+  FILE *f = fopen(path, "rb");
+  if( !f ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not read %s", path));
+    return 1;
+  }
+  /* file_to_chunks closes f */
+  if( file_to_chunks(f, buf, MAX_CHUNK_SIZE, index_local_chunk, ix) ){
+    if( c->errtype==CTX_ERR_NONE ) ctx_errmsg(c, sqlite3_mprintf("Could not read %s", path));
+    return 1;
+  }
+  ix->by_chunk = malloc((ix->count ? ix->count : 1)*sizeof(*ix->by_chunk));
+  if( !ix->by_chunk ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  memcpy(ix->by_chunk, ix->by_offset, ix->count*sizeof(*ix->by_chunk));
+  qsort(ix->by_chunk, ix->count, sizeof(*ix->by_chunk), local_chunk_cmp);
+  return 0;
+}
+
+/* Copy a chunk out of the existing file into out's buffer. Returns -1 on
+** error, 0 if it was copied, and 1 if the bytes there no longer match the
+** chunk, in which case the caller fetches it instead. */
+static int delta_copy_local(ctx *c, restore_out *out, int local_fd, sqlite3_int64 local_offset, const restore_segment *seg){
+  if( RESTORE_BUFFER_SIZE-out->used < seg->length && restore_flush(c, out) ) return -1;
+  unsigned char *dest = out->buf + out->used;
+  size_t done = 0;
+  while( done<seg->length ){
+    ssize_t n = pread(local_fd, dest+done, seg->length-done, (off_t)(local_offset+done));
+    if( n<0 && errno==EINTR ) continue;
+    if( n<=0 ) return 1;
+    done += (size_t)n;
+  }
+  if( seg->has_crc && seg->crc!=crc32c(dest, seg->length) ) return 1;
+  out->used += seg->length;
+  return 0;
+}
+
+/* Make a range of the file read as zeros, as a hole where possible */
+static int delta_zero(ctx *c, int fd, sqlite3_int64 offset, sqlite3_int64 length, const char *path){
+  static const unsigned char zeros[4096];
+#ifdef __linux__
+  if( 0==fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) ) return 0;
+#endif
+  while( length>0 ){
+    size_t piece = length>(sqlite3_int64)sizeof(zeros) ? sizeof(zeros) : (size_t)length;
+    if( restore_pwrite(c, fd, zeros, piece, offset, path) ) return 1;
+    offset += piece;
+    length -= piece;
+  }
+  return 0;
+}
+
+/* Walk the revision's segments, either patching out->fd in place or
+** writing every segment to a new file through out */
+static int delta_apply(ctx *c, sqlite3_int64 content_id, const local_index *ix, int local_fd, int in_place, restore_out *out, ctx_delta_stats *stats){
+  sqlite3_stmt *stmt = c->select_segments_from;
+  int step_result;
+  int err = 1;
+
+  c->err_context = in_place ? "patching a file" : "rebuilding a file";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, content_id)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, 0)) ) return 1;
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    restore_segment seg;
+    sqlite3_int64 seg_offset = sqlite3_column_int64(stmt, 1);
+    seg.chunk_id = sqlite3_column_int64(stmt, 0);
+    seg.length = (unsigned int)sqlite3_column_int64(stmt, 2);
+    seg.has_crc = sqlite3_column_type(stmt, 3)!=SQLITE_NULL;
+    seg.crc = (uint32_t)sqlite3_column_int64(stmt, 3);
+
+    if( in_place ){
+      if( seg.chunk_id!=0 && local_has_at(ix, seg.chunk_id, seg_offset) ){
+        stats->bytes_reused += seg.length;
+        continue;
+      }
+      if( out->offset+(sqlite3_int64)out->used!=seg_offset ){
+        if( restore_flush(c, out) ) goto out;
+        out->offset = seg_offset;
+      }
+      if( seg.chunk_id==0 ){
+        if( restore_flush(c, out) ) goto out;
+        if( delta_zero(c, out->fd, seg_offset, seg.length, out->path) ) goto out;
+        out->offset += seg.length;
+        continue;
+      }
+    }else if( seg.chunk_id!=0 ){
+      sqlite3_int64 local_offset = local_find(ix, seg.chunk_id);
+      if( local_offset>=0 ){
+        int copied = delta_copy_local(c, out, local_fd, local_offset, &seg);
+        if( copied<0 ) goto out;
+        if( copied==0 ){
+          stats->bytes_reused += seg.length;
+          continue;
+        }
+      }
+    }
+    if( restore_read_chunk(c, out, &seg) ) goto out;
+    if( seg.chunk_id!=0 ) stats->bytes_fetched += seg.length;
+  }
+  if( c->errtype!=CTX_ERR_NONE ) goto out;
+  if( restore_flush(c, out) ) goto out;
+  err = 0;
+
+out:
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return err;
+}
+
+/* Whether every chunk the revision shares with the existing file is
+** already at the offset the revision wants it */
+static int delta_fits_in_place(ctx *c, sqlite3_int64 content_id, const local_index *ix, int *in_place){
+  sqlite3_stmt *stmt = c->select_segments_from;
+  int step_result;
+
+  *in_place = 1;
+  c->err_context = "comparing a file with a revision";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, content_id)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, 0)) ) return 1;
+  while( *in_place
+      && 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW
+  ){
+    sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_int64 seg_offset = sqlite3_column_int64(stmt, 1);
+    if( chunk_id!=0 && !local_has_at(ix, chunk_id, seg_offset) && local_find(ix, chunk_id)>=0 ){
+      *in_place = 0;
+    }
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return c->errtype!=CTX_ERR_NONE;
+}
+
+int ctx_spew_delta(ctx *c, const char *dest_path, sqlite3_int64 revision_id, ctx_delta_stats *stats){
+  ctx_delta_stats own_stats;
+  local_index ix;
+  restore_out out;
+  struct stat st, own;
+  sqlite3_stmt *stmt = c->select_revision_length;
+  sqlite3_int64 content_id = 0, length = 0;
+  int step_result, in_place = 0, local_fd = -1, out_ready = 0;
+  char *tmp_path = NULL;
+  int err = 1;
+
+  if( !stats ) stats = &own_stats;
+  memset(stats, 0, sizeof(*stats));
+  memset(&ix, 0, sizeof(ix));
+  ix.c = c;
+
+  if( stat(dest_path, &st) ){
+    if( errno!=ENOENT ){
+      ctx_errmsg(c, sqlite3_mprintf("Could not read %s: %s", dest_path, strerror(errno)));
+      return 1;
+    }
+    if( ctx_spew(c, dest_path, revision_id) ) return 1;
+    if( 0==stat(dest_path, &st) ) stats->bytes_fetched = st.st_size;
+    return 0;
+  }
+
+  c->err_context = "finding a revision to restore";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, revision_id)) ) return 1;
+  if( ctx_collect_err(c, step_result=sqlite3_step(stmt)) ) return 1;
+  if( step_result!=SQLITE_ROW ){
+    ctx_errmsg(c, sqlite3_mprintf("There is no revision %lld", revision_id));
+  }else if( sqlite3_column_type(stmt, 1)==SQLITE_NULL ){
+    ctx_errmsg(c, sqlite3_mprintf("Revision %lld was stored without the offsets needed to patch a file", revision_id));
+  }else{
+    content_id = sqlite3_column_int64(stmt, 0);
+    length = sqlite3_column_int64(stmt, 1);
+  }
+  sqlite3_reset(stmt);
+  if( content_id==0 ) return 1;
+
+  if( local_index_load_target(c, &ix, content_id) ) goto out;
+  if( local_index_build(c, &ix, dest_path) ) goto out;
+  if( delta_fits_in_place(c, content_id, &ix, &in_place) ) goto out;
+  /* Patching a file in place would write through its other hard links */
+  if( in_place && (lstat(dest_path, &own) || !S_ISREG(own.st_mode) || own.st_nlink!=1) ) in_place = 0;
+  if( restore_out_init(c, &out) ) goto out;
+  out_ready = 1;
+  out.cache = c->restore_cache;
+
+  if( in_place ){
+    out.path = dest_path;
+    out.fd = open(dest_path, O_WRONLY | O_NOFOLLOW);
+    if( out.fd<0 ){
+      ctx_errmsg(c, sqlite3_mprintf("Could not write to %s", dest_path));
+      goto out;
+    }
+  }else{
+    local_fd = open(dest_path, O_RDONLY);
+    tmp_path = sqlite3_mprintf("%s.XXXXXX", dest_path);
+    if( !tmp_path ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      goto out;
+    }
+    out.path = tmp_path;
+    out.fd = local_fd<0 ? -1 : mkstemp(tmp_path);
+    if( out.fd<0 ){
+      ctx_errmsg(c, sqlite3_mprintf("Could not write beside %s: %s", dest_path, strerror(errno)));
+      goto out;
+    }
+    fchmod(out.fd, st.st_mode & 07777);
+  }
+
+  if( delta_apply(c, content_id, &ix, local_fd, in_place, &out, stats) ) goto out;
+  if( ftruncate(out.fd, (off_t)length) ){
+    ctx_errmsg(c, sqlite3_mprintf("Error writing to %s: %s", out.path, strerror(errno)));
+    goto out;
+  }
+  if( close(out.fd) ){
+    out.fd = -1;
+    ctx_errmsg(c, sqlite3_mprintf("Error writing to %s: %s", out.path, strerror(errno)));
+    goto out;
+  }
+  out.fd = -1;
+  if( !in_place && rename(tmp_path, dest_path) ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not replace %s: %s", dest_path, strerror(errno)));
+    goto out;
+  }
+  stats->in_place = in_place;
+  err = 0;
+
+out:
+  if( out_ready ){
+    if( out.fd>=0 ) close(out.fd);
+    if( err && tmp_path && !in_place ) unlink(tmp_path);
+    restore_out_free(&out);
+  }
+  if( local_fd>=0 ) close(local_fd);
+  sqlite3_free(tmp_path);
+  free(ix.by_offset);
+  free(ix.by_chunk);
+  chunk_hints_free(&ix.target);
+  return err;
+}
+
+/* Map a stored path onto dest_root. Stored paths may use either separator
+** and may start with "./"; empty, "." and ".." components are dropped so a
+** restore can never write outside dest_root. Stored paths are UTF-8 and
+** are handed to the system as they are, which is what POSIX expects. */
+char *restore_dest_path(const char *dest_root, const char *stored){
+  size_t root_len = strlen(dest_root);
+  char *path = malloc(root_len + strlen(stored) + 2);
+  if( !path ) return NULL;
+  memcpy(path, dest_root, root_len);
+  size_t len = root_len;
+
+  const char *p = stored;
+  while( *p ){
+    const char *end = p;
+    while( *end && *end!='/' && *end!='\\' ) end++;
+    size_t part = (size_t)(end-p);
+    if( part>0 && !(part==1 && p[0]=='.') && !(part==2 && p[0]=='.' && p[1]=='.') ){
+      path[len++] = '/';
+      memcpy(path+len, p, part);
+      len += part;
+    }
+    p = *end ? end+1 : end;
+  }
+  path[len] = 0;
+  return path;
+}
+
+/* Create every missing directory above path */
+static int make_parent_dirs(char *path, size_t root_len){
+  char *p = path + root_len + 1;
+  while( (p = strchr(p, '/')) ){
+    *p = 0;
+    int failed = mkdir(path, 0777) && errno!=EEXIST;
+    *p = '/';
+    if( failed ) return 1;
+    p++;
+  }
+  return 0;
+}
+
+/* A snapshot restore is planned a batch of files at a time. Every chunk
+** the batch needs is listed, the list is sorted by chunk_id, and the
+** chunks are read in that order into an image of the files in memory,
+** which is then written out. chunk_id follows the order chunks were
+** stored in, and after a repack the order they lie in the repository, so
+** the reads sweep through the file instead of seeking back and forth.
+** Files larger than the plan are restored alone, a window at a time.
+*/
+
+typedef struct restore_entry {
+  char *path;
+  sqlite3_int64 content_id;
+  sqlite3_int64 length;
+  int sparse; /* Has runs of zeros, which are left as holes */
+  sqlite3_int64 mtime_ns; /* -1 when not recorded */
+  unsigned char hash[HASH_LENGTH];
+  int skip; /* Already up to date at the destination */
+  int copy_of; /* Earlier entry with the same content, made from it; -1 if none */
+} restore_entry;
+
+/* A stretch of one file that is restored in a single pass */
+typedef struct plan_window {
+  unsigned int entry;
+  sqlite3_int64 start;
+  sqlite3_int64 end;
+} plan_window;
+
+typedef struct plan_batch {
+  unsigned int first; /* Index of its first window */
+  unsigned int count;
+} plan_batch;
+
+/* Part of a chunk to copy into the image */
+typedef struct plan_read {
+  sqlite3_int64 chunk_id;
+  unsigned int length; /* Of the whole chunk */
+  int has_crc;
+  uint32_t crc;
+  unsigned int skip; /* Bytes of the chunk before the part wanted */
+  unsigned int take;
+  unsigned char *dest;
+} plan_read;
+
+/* A run of zeros within a window, which is not written */
+typedef struct plan_hole {
+  unsigned int window; /* Within the round */
+  sqlite3_int64 start;
+  sqlite3_int64 end;
+} plan_hole;
+
+typedef struct restore_worker {
+  ctx c;
+  ctx ahead; /* Reads ahead of c, to have the next chunks off the disk in time */
+  int opened; /* 1 once c is open, 2 once ahead is too */
+  sqlite3_blob *blob;
+  unsigned char *image;
+  unsigned char *chunk;
+  unsigned int chunk_capacity;
+  plan_read *reads;
+  unsigned int read_count;
+  unsigned int read_capacity;
+  plan_hole *holes;
+  unsigned int hole_count;
+  unsigned int hole_capacity;
+  int fds[RESTORE_PLAN_FILES];
+  int carry_fd; /* A file whose later windows are in the next round */
+} restore_worker;
+
+typedef struct restore_job {
+  const char *dest_root;
+  restore_entry *entries;
+  plan_window *windows;
+  plan_batch *batches;
+  size_t plan_bytes;
+  restore_worker *workers; /* One per pool thread */
+  chunk_cache *cache;
+  const ctx_restore_opts *opts;
+
+  pthread_mutex_t lock; /* Guards everything below */
+  int failed;
+  ctx_restore_progress progress;
+  sqlite3_int64 start_ms;
+  sqlite3_int64 reported_ms;
+} restore_job;
+
+typedef struct read_ahead {
+  ctx *c;
+  const plan_read *reads;
+  unsigned int count;
+  pthread_mutex_t lock; /* Guards consumed and stop */
+  pthread_cond_t moved;
+  unsigned int consumed;
+  int stop;
+} read_ahead;
+
+static void restore_report(restore_job *job, int final){
+  sqlite3_int64 now = ctx_now_ms();
+  if( !job->opts || !job->opts->on_progress ) return;
+  if( !final && now - job->reported_ms < RESTORE_PROGRESS_MS ) return;
+  job->reported_ms = now;
+  job->progress.elapsed_ms = now - job->start_ms;
+  job->progress.bytes_per_second = job->progress.elapsed_ms>0
+    ? job->progress.bytes_done*1000/job->progress.elapsed_ms : 0;
+  chunk_cache_stats(job->cache, &job->progress.cache_hits, &job->progress.cache_misses);
+  job->opts->on_progress(job->opts->arg, &job->progress);
+}
+
+/* Read the planned chunks in the same order as the copy, but up to
+** RESTORE_READAHEAD chunks in front of it. Nothing read is kept here; the
+** point is only to have the disk working while the copy checks and copies
+** what it already has. Problems are left for the copy to report. */
+static void *readahead_run(void *arg){
+  read_ahead *ra = (read_ahead *)arg;
+  sqlite3_blob *blob = NULL;
+  unsigned char *buf = NULL;
+  unsigned int capacity = 0, i;
+  sqlite3_int64 last = 0;
+
+  for( i=0; i<ra->count; i++ ){
+    const plan_read *r = &ra->reads[i];
+    if( r->chunk_id==last ) continue;
+    last = r->chunk_id;
+
+    pthread_mutex_lock(&ra->lock);
+    while( !ra->stop && i > ra->consumed+RESTORE_READAHEAD ){
+      pthread_cond_wait(&ra->moved, &ra->lock);
+    }
+    int stop = ra->stop;
+    pthread_mutex_unlock(&ra->lock);
+    if( stop ) break;
+
+    if( r->length>capacity ){
+      unsigned char *grown = realloc(buf, r->length);
+      if( !grown ) break;
+      buf = grown;
+      capacity = r->length;
+    }
+    int rc = blob ? sqlite3_blob_reopen(blob, r->chunk_id)
+                  : sqlite3_blob_open(ra->c->db, "main", "chunk", "body", r->chunk_id, 0, &blob);
+    if( rc!=SQLITE_OK ) break;
+    if( sqlite3_blob_bytes(blob)==(int)r->length ){
+      sqlite3_blob_read(blob, buf, (int)r->length, 0);
+    }
+  }
+  if( blob ) sqlite3_blob_close(blob);
+  free(buf);
+  return NULL;
+}
+
+static void readahead_moved(read_ahead *ra, unsigned int consumed, int stop){
+  pthread_mutex_lock(&ra->lock);
+  ra->consumed = consumed;
+  ra->stop = stop;
+  pthread_cond_signal(&ra->moved);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+static int plan_grow(ctx *c, void **items, unsigned int *capacity, size_t size){
+  unsigned int wanted = *capacity ? *capacity*2 : 1024;
+  void *grown = realloc(*items, wanted*size);
+  if( !grown ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  *items = grown;
+  *capacity = wanted;
+  return 0;
+}
+
+/* List the chunk reads and holes that make up one window */
+static int plan_window_reads(restore_job *job, restore_worker *w, const plan_window *win, unsigned int index, unsigned char *image){
+  ctx *c = &w->c;
+  const restore_entry *e = &job->entries[win->entry];
+  sqlite3_stmt *stmt = c->select_segments_from;
+  sqlite3_int64 pos = win->start;
+  int step_result;
+
+  if( win->start>=win->end ) return 0;
+  c->err_context = "planning a restore";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, e->content_id)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, win->start)) ) return 1;
+  while( pos<win->end
+      && 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW
+  ){
+    sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_int64 seg_offset = sqlite3_column_int64(stmt, 1);
+    unsigned int seg_length = (unsigned int)sqlite3_column_int64(stmt, 2);
+    sqlite3_int64 to = seg_offset+seg_length < win->end ? seg_offset+seg_length : win->end;
+    if( pos<seg_offset || to<=pos ) break;
+
+    if( chunk_id==0 ){
+      if( w->hole_count==w->hole_capacity
+       && plan_grow(c, (void **)&w->holes, &w->hole_capacity, sizeof(*w->holes)) ) break;
+      plan_hole *h = &w->holes[w->hole_count++];
+      h->window = index;
+      h->start = pos;
+      h->end = to;
+    }else{
+      if( w->read_count==w->read_capacity
+       && plan_grow(c, (void **)&w->reads, &w->read_capacity, sizeof(*w->reads)) ) break;
+      plan_read *r = &w->reads[w->read_count++];
+      r->chunk_id = chunk_id;
+      r->length = seg_length;
+      r->has_crc = sqlite3_column_type(stmt, 3)!=SQLITE_NULL;
+      r->crc = (uint32_t)sqlite3_column_int64(stmt, 3);
+      r->skip = (unsigned int)(pos-seg_offset);
+      r->take = (unsigned int)(to-pos);
+      r->dest = image + (pos-win->start);
+    }
+    pos = to;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if( c->errtype!=CTX_ERR_NONE ) return 1;
+  if( pos<win->end ){
+    ctx_errmsg(c, sqlite3_mprintf("The segments of %s do not line up", e->path));
+    return 1;
+  }
+  return 0;
+}
+
+static int plan_read_cmp(const void *a, const void *b){
+  const plan_read *ra = (const plan_read *)a;
+  const plan_read *rb = (const plan_read *)b;
+  if( ra->chunk_id!=rb->chunk_id ) return ra->chunk_id < rb->chunk_id ? -1 : 1;
+  if( ra->dest!=rb->dest ) return ra->dest < rb->dest ? -1 : 1;
+  return 0;
+}
+
+/* Load a whole chunk into w->chunk */
+static int plan_load_chunk(restore_job *job, restore_worker *w, const plan_read *r){
+  ctx *c = &w->c;
+  int rc;
+
+  if( r->length>w->chunk_capacity ){
+    unsigned char *grown = realloc(w->chunk, r->length);
+    if( !grown ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      return 1;
+    }
+    w->chunk = grown;
+    w->chunk_capacity = r->length;
+  }
+  if( chunk_cache_get(job->cache, r->chunk_id, w->chunk, r->length) ) return 0;
+
+  if( w->blob ){
+    rc = sqlite3_blob_reopen(w->blob, r->chunk_id);
+  }else{
+    rc = sqlite3_blob_open(c->db, "main", "chunk", "body", r->chunk_id, 0, &w->blob);
+  }
+  if( rc!=SQLITE_OK || sqlite3_blob_bytes(w->blob)!=(int)r->length ){
+    ctx_errmsg(c, sqlite3_mprintf("Got an invalid file chunk while restoring a snapshot"));
+    return 1;
+  }
+  c->err_context = "restoring a snapshot";
+  if( ctx_collect_err(c, sqlite3_blob_read(w->blob, w->chunk, (int)r->length, 0)) ) return 1;
+  if( r->has_crc && r->crc!=crc32c(w->chunk, r->length) ){
+    ctx_errmsg(c, sqlite3_mprintf("Chunk %lld is damaged", r->chunk_id));
+    return 1;
+  }
+  chunk_cache_put(job->cache, r->chunk_id, w->chunk, r->length);
+  return 0;
+}
+
+/* Fill the image from the sorted reads, with the read-ahead running */
+static int plan_copy(restore_job *job, restore_worker *w){
+  read_ahead ra;
+  pthread_t thread;
+  sqlite3_int64 loaded = 0;
+  unsigned int i;
+  int err = 0;
+
+  memset(&ra, 0, sizeof(ra));
+  ra.c = &w->ahead;
+  ra.reads = w->reads;
+  ra.count = w->read_count;
+  pthread_mutex_init(&ra.lock, NULL);
+  pthread_cond_init(&ra.moved, NULL);
+  int started = w->read_count>1 && 0==pthread_create(&thread, NULL, readahead_run, &ra);
+
+  for( i=0; i<w->read_count && !err; i++ ){
+    const plan_read *r = &w->reads[i];
+    if( started && (i & 63)==0 ) readahead_moved(&ra, i, 0);
+    if( r->chunk_id!=loaded ){
+      loaded = 0;
+      if( plan_load_chunk(job, w, r) ){
+        err = 1;
+        break;
+      }
+      loaded = r->chunk_id;
+    }
+    memcpy(r->dest, w->chunk+r->skip, r->take);
+  }
+
+  if( started ){
+    readahead_moved(&ra, i, 1);
+    pthread_join(thread, NULL);
+  }
+  pthread_cond_destroy(&ra.moved);
+  pthread_mutex_destroy(&ra.lock);
+  return err;
+}
+
+static int plan_open(restore_job *job, restore_worker *w, const restore_entry *e, int *fd){
+  ctx *c = &w->c;
+  char *path = restore_dest_path(job->dest_root, e->path);
+  if( !path ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  if( make_parent_dirs(path, strlen(job->dest_root)) ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not create the directory for %s: %s", path, strerror(errno)));
+    free(path);
+    return 1;
+  }
+  *fd = restore_create(path);
+  if( *fd<0 ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not write to %s", path));
+    free(path);
+    return 1;
+  }
+  free(path);
+#ifdef __linux__
+  /* As in restore_file, but sparse files keep their holes */
+  if( e->length>0 && !e->sparse ) fallocate(*fd, 0, 0, (off_t)e->length);
+#endif
+  return 0;
+}
+
+/* Times for futimens that set the stored modification time only */
+static void stored_times(struct timespec *times, sqlite3_int64 mtime_ns){
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1].tv_sec = (time_t)(mtime_ns/1000000000);
+  times[1].tv_nsec = (long)(mtime_ns%1000000000);
+}
+
+/* Write a window's image, skipping its holes */
+static int plan_write(restore_job *job, restore_worker *w, const plan_window *win, unsigned int index, const unsigned char *image, unsigned int *hole){
+  const restore_entry *e = &job->entries[win->entry];
+  sqlite3_int64 pos = win->start;
+  int fd = w->fds[index];
+
+  while( pos<win->end ){
+    sqlite3_int64 to = win->end;
+    if( *hole<w->hole_count && w->holes[*hole].window==index ) to = w->holes[*hole].start;
+    if( to>pos && restore_pwrite(&w->c, fd, image+(pos-win->start), (size_t)(to-pos), pos, e->path) ) return 1;
+    if( to==win->end ) break;
+    pos = w->holes[(*hole)++].end;
+  }
+  if( win->end<e->length ) return 0;
+
+  /* Covers a trailing hole as well */
+  w->fds[index] = -1;
+  int failed = ftruncate(fd, (off_t)e->length)!=0;
+  if( e->mtime_ns>=0 ){
+    struct timespec times[2];
+    stored_times(times, e->mtime_ns);
+    failed = futimens(fd, times)!=0 || failed;
+  }
+  failed = close(fd)!=0 || failed;
+  if( failed ){
+    ctx_errmsg(&w->c, sqlite3_mprintf("Error writing to %s: %s", e->path, strerror(errno)));
+    return 1;
+  }
+  return 0;
+}
+
+/* Restore windows that between them fit in the plan */
+static int restore_round(restore_job *job, restore_worker *w, const plan_window *windows, unsigned int count){
+  unsigned int i, hole = 0, finished = 0;
+  sqlite3_int64 bytes = 0;
+  unsigned char *image = w->image;
+  int err = 1;
+
+  for( i=0; i<count; i++ ) w->fds[i] = -1;
+  w->read_count = 0;
+  w->hole_count = 0;
+  for( i=0; i<count; i++ ){
+    const plan_window *win = &windows[i];
+    if( win->start==0 ){
+      if( plan_open(job, w, &job->entries[win->entry], &w->fds[i]) ) goto out;
+    }else{
+      w->fds[i] = w->carry_fd;
+      w->carry_fd = -1;
+    }
+    if( plan_window_reads(job, w, win, i, image) ) goto out;
+    image += win->end - win->start;
+  }
+
+  qsort(w->reads, w->read_count, sizeof(*w->reads), plan_read_cmp);
+  if( plan_copy(job, w) ) goto out;
+
+  image = w->image;
+  for( i=0; i<count; i++ ){
+    const plan_window *win = &windows[i];
+    if( plan_write(job, w, win, i, image, &hole) ) goto out;
+    if( w->fds[i]<0 ){
+      finished++;
+    }else{
+      w->carry_fd = w->fds[i];
+      w->fds[i] = -1;
+    }
+    bytes += win->end - win->start;
+    image += win->end - win->start;
+  }
+  err = 0;
+
+out:
+  for( i=0; i<count; i++ ){
+    if( w->fds[i]>=0 ) close(w->fds[i]);
+  }
+  pthread_mutex_lock(&job->lock);
+  if( err ){
+    job->failed = 1;
+  }else{
+    job->progress.files_done += finished;
+    job->progress.bytes_done += bytes;
+    restore_report(job, 0);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return err;
+}
+
+static void restore_batch_run(void *arg, unsigned int worker, unsigned int task){
+  restore_job *job = (restore_job *)arg;
+  restore_worker *w = &job->workers[worker];
+  const plan_batch *b = &job->batches[task];
+  unsigned int next = b->first, end = b->first+b->count;
+
+  while( next<end ){
+    pthread_mutex_lock(&job->lock);
+    int failed = job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if( failed ) break;
+
+    unsigned int count = 0;
+    size_t bytes = 0;
+    while( next+count<end && count<RESTORE_PLAN_FILES ){
+      const plan_window *win = &job->windows[next+count];
+      size_t size = (size_t)(win->end - win->start);
+      if( count>0 && bytes+size>job->plan_bytes ) break;
+      bytes += size;
+      count++;
+    }
+    if( restore_round(job, w, &job->windows[next], count) ) break;
+    next += count;
+  }
+  if( w->carry_fd>=0 ){
+    close(w->carry_fd);
+    w->carry_fd = -1;
+  }
+}
+
+/* Split the files into windows no larger than the plan, and group the
+** windows into batches: either several small files or one large one. The
+** files keep the order they were listed in, so each batch's chunks tend
+** to lie near each other. */
+static int restore_plan_batches(ctx *c, restore_job *job, unsigned int entry_count, unsigned int *batch_count){
+  sqlite3_int64 plan = (sqlite3_int64)job->plan_bytes;
+  unsigned int window_count = 0, i;
+  unsigned int batch_first = 0;
+  size_t batch_bytes = 0;
+
+  for( i=0; i<entry_count; i++ ){
+    sqlite3_int64 length = job->entries[i].length;
+    if( job->entries[i].skip || job->entries[i].copy_of>=0 ) continue;
+    window_count += length>plan ? (unsigned int)((length+plan-1)/plan) : 1;
+  }
+  job->windows = calloc(window_count ? window_count : 1, sizeof(*job->windows));
+  job->batches = calloc(window_count ? window_count : 1, sizeof(*job->batches));
+  if( !job->windows || !job->batches ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+
+  *batch_count = 0;
+  window_count = 0;
+  for( i=0; i<entry_count; i++ ){
+    sqlite3_int64 length = job->entries[i].length;
+    if( job->entries[i].skip || job->entries[i].copy_of>=0 ) continue;
+    int alone = length>plan;
+    int full = window_count>batch_first
+      && (alone || batch_bytes+(size_t)length>job->plan_bytes || window_count-batch_first==RESTORE_PLAN_FILES);
+    if( full ){
+      job->batches[*batch_count].first = batch_first;
+      job->batches[*batch_count].count = window_count-batch_first;
+      (*batch_count)++;
+      batch_first = window_count;
+      batch_bytes = 0;
+    }
+
+    sqlite3_int64 start = 0;
+    do{
+      plan_window *win = &job->windows[window_count++];
+      win->entry = i;
+      win->start = start;
+      win->end = length-start>plan ? start+plan : length;
+      start = win->end;
+    }while( start<length );
+    batch_bytes += (size_t)length;
+
+    if( alone ){
+      job->batches[*batch_count].first = batch_first;
+      job->batches[*batch_count].count = window_count-batch_first;
+      (*batch_count)++;
+      batch_first = window_count;
+      batch_bytes = 0;
+    }
+  }
+  if( window_count>batch_first ){
+    job->batches[*batch_count].first = batch_first;
+    job->batches[*batch_count].count = window_count-batch_first;
+    (*batch_count)++;
+  }
+  return 0;
+}
+
+/* Decide whether a file at the destination can be left alone. Under
+** CTX_SYNC_VERIFY every candidate is hashed, however its times look; one
+** that passes gets its modification time put right, so the next
+** CTX_SYNC_MTIME restore can skip it on a stat alone. A symlink is never
+** trusted, and is replaced rather than followed. */
+static void restore_check_run(void *arg, unsigned int worker, unsigned int task){
+  restore_job *job = (restore_job *)arg;
+  restore_entry *e = &job->entries[task];
+  struct stat st;
+  (void)worker;
+
+  if( e->skip ) return;
+  char *path = restore_dest_path(job->dest_root, e->path);
+  if( !path ) return;
+  if( lstat(path, &st) || !S_ISREG(st.st_mode) || st.st_size!=e->length ){
+    free(path);
+    return;
+  }
+
+  sqlite3_int64 mtime_ns = (sqlite3_int64)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+  if( job->opts->sync==CTX_SYNC_MTIME ){
+    e->skip = e->mtime_ns>=0 && mtime_ns==e->mtime_ns;
+  }else if( job->opts->sync==CTX_SYNC_VERIFY ){
+    unsigned char hash[HASH_LENGTH];
+    FILE *f = fopen(path, "rb");
+    if( f ){
+      e->skip = 0==blake2b_file(f, hash) && 0==memcmp(hash, e->hash, HASH_LENGTH);
+      fclose(f);
+    }
+    if( e->skip && e->mtime_ns>=0 && mtime_ns!=e->mtime_ns ){
+      struct timespec times[2];
+      stored_times(times, e->mtime_ns);
+      utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+    }
+  }
+  free(path);
+}
+
+/* Copy length bytes between files, keeping the holes of a sparse source */
+static int copy_range(int src, int dst, sqlite3_int64 length, int sparse){
+  sqlite3_int64 pos = 0;
+  while( pos<length ){
+    off_t data = (off_t)pos, hole = (off_t)length;
+#ifdef SEEK_DATA
+    if( sparse ){
+      data = lseek(src, (off_t)pos, SEEK_DATA);
+      if( data<0 ) return errno==ENXIO ? 0 : 1;
+      hole = lseek(src, data, SEEK_HOLE);
+      if( hole<0 ) return 1;
+      if( hole>(off_t)length ) hole = (off_t)length;
+    }
+#endif
+    off_t in = data, out = data;
+    while( in<hole ){
+      ssize_t n = -1;
+#ifdef __linux__
+      /* Lets the filesystem share or clone the blocks where it can */
+      n = copy_file_range(src, &in, dst, &out, (size_t)(hole-in), 0);
+#endif
+      if( n<0 ){
+        unsigned char buf[65536];
+        size_t want = hole-in < (off_t)sizeof(buf) ? (size_t)(hole-in) : sizeof(buf);
+        n = pread(src, buf, want, in);
+        if( n<0 && errno==EINTR ) continue;
+        if( n<=0 || pwrite(dst, buf, (size_t)n, out)!=n ) return 1;
+        in += n;
+        out += n;
+      }else if( n==0 ){
+        return 1; /* The source is shorter than it should be */
+      }
+    }
+    pos = hole;
+  }
+  return 0;
+}
+
+/* Make an entry's file from the file already restored for its content */
+static void restore_copy_run(void *arg, unsigned int worker, unsigned int task){
+  restore_job *job = (restore_job *)arg;
+  restore_entry *e = &job->entries[task];
+  ctx *c = &job->workers[worker].c;
+  char *from = NULL, *to = NULL;
+  int src = -1, dst = -1;
+
+  if( e->skip || e->copy_of<0 ) return;
+  pthread_mutex_lock(&job->lock);
+  int failed = job->failed;
+  pthread_mutex_unlock(&job->lock);
+  if( failed ) return;
+
+  from = restore_dest_path(job->dest_root, job->entries[e->copy_of].path);
+  to = restore_dest_path(job->dest_root, e->path);
+  if( !from || !to ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    goto out;
+  }
+  if( make_parent_dirs(to, strlen(job->dest_root)) ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not create the directory for %s: %s", to, strerror(errno)));
+    goto out;
+  }
+
+  if( job->opts && job->opts->hardlink ){
+    if( (unlink(to) && errno!=ENOENT) || link(from, to) ){
+      ctx_errmsg(c, sqlite3_mprintf("Could not link %s to %s: %s", to, from, strerror(errno)));
+    }
+    goto out;
+  }
+
+  src = open(from, O_RDONLY);
+  dst = src<0 ? -1 : restore_create(to);
+  if( src<0 || dst<0 ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not copy %s to %s: %s", from, to, strerror(errno)));
+    goto out;
+  }
+  if( copy_range(src, dst, e->length, e->sparse) || ftruncate(dst, (off_t)e->length) ){
+    ctx_errmsg(c, sqlite3_mprintf("Error writing to %s: %s", to, strerror(errno)));
+    goto out;
+  }
+  if( e->mtime_ns>=0 ){
+    struct timespec times[2];
+    stored_times(times, e->mtime_ns);
+    futimens(dst, times);
+  }
+  int closed = close(dst);
+  dst = -1;
+  if( closed ){
+    ctx_errmsg(c, sqlite3_mprintf("Error writing to %s: %s", to, strerror(errno)));
+  }
+
+out:
+  if( src>=0 ) close(src);
+  if( dst>=0 ) close(dst);
+  free(from);
+  free(to);
+  pthread_mutex_lock(&job->lock);
+  if( c->errtype!=CTX_ERR_NONE ){
+    job->failed = 1;
+  }else{
+    job->progress.files_done++;
+    job->progress.bytes_done += e->length;
+    restore_report(job, 0);
+  }
+  pthread_mutex_unlock(&job->lock);
+}
+
+static int entry_content_cmp(const void *a, const void *b){
+  const restore_entry *ea = *(const restore_entry *const *)a;
+  const restore_entry *eb = *(const restore_entry *const *)b;
+  if( ea->content_id!=eb->content_id ) return ea->content_id < eb->content_id ? -1 : 1;
+  return ea < eb ? -1 : ea > eb;
+}
+
+/* Point every entry after the first with a given content at that first one */
+static int restore_find_copies(ctx *c, restore_entry *entries, unsigned int count){
+  restore_entry **order = malloc((count ? count : 1)*sizeof(*order));
+  unsigned int i;
+  if( !order ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+  for( i=0; i<count; i++ ) order[i] = &entries[i];
+  qsort(order, count, sizeof(*order), entry_content_cmp);
+  for( i=0; i<count; i++ ){
+    order[i]->copy_of = i>0 && order[i-1]->content_id==order[i]->content_id
+      ? (order[i-1]->copy_of>=0 ? order[i-1]->copy_of : (int)(order[i-1]-entries))
+      : -1;
+  }
+  free(order);
+  return 0;
+}
+
+static int restore_collect_entries(ctx *c, sqlite3_int64 snapshot_id, restore_entry **entries, unsigned int *count){
+  sqlite3_stmt *stmt = c->select_snapshot_entries;
+  unsigned int capacity = 0;
+  int step_result;
+
+  *entries = NULL;
+  *count = 0;
+  c->err_context = "listing a snapshot";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, snapshot_id)) ) return 1;
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( *count==capacity ){
+      capacity = capacity ? capacity*2 : 1024;
+      restore_entry *grown = realloc(*entries, capacity*sizeof(*grown));
+      if( !grown ){
+        ctx_errtype(c, CTX_ERR_NO_MEMORY);
+        break;
+      }
+      *entries = grown;
+    }
+    restore_entry *e = &(*entries)[*count];
+    const char *path = (const char *)sqlite3_column_text(stmt, 0);
+    e->path = path ? strdup(path) : NULL;
+    e->content_id = sqlite3_column_int64(stmt, 1);
+    e->length = sqlite3_column_int64(stmt, 2);
+    e->sparse = sqlite3_column_int64(stmt, 3)!=0;
+    e->mtime_ns = sqlite3_column_type(stmt, 4)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 4);
+    e->skip = 0;
+    memset(e->hash, 0, HASH_LENGTH);
+    if( sqlite3_column_bytes(stmt, 5)==HASH_LENGTH ){
+      memcpy(e->hash, sqlite3_column_blob(stmt, 5), HASH_LENGTH);
+    }
+    if( !e->path ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      break;
+    }
+    (*count)++;
+  }
+  sqlite3_reset(stmt);
+  return c->errtype != CTX_ERR_NONE;
+}
+
+typedef struct dir_set {
+  char **paths;
+  size_t count;
+  size_t capacity;
+} dir_set;
+
+static int dir_set_add(void *arg, const char *path){
+  dir_set *set = (dir_set *)arg;
+  if( set->count==set->capacity ){
+    size_t capacity = set->capacity ? set->capacity*2 : 64;
+    char **grown = realloc(set->paths, capacity*sizeof(*grown));
+    if( !grown ) return CTX_ERR_NO_MEMORY;
+    set->paths = grown;
+    set->capacity = capacity;
+  }
+  set->paths[set->count] = strdup(path);
+  if( !set->paths[set->count] ) return CTX_ERR_NO_MEMORY;
+  set->count++;
+  return 0;
+}
+
+static int dir_set_cmp(const void *a, const void *b){
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Whether the directory part of path, its first len bytes, is in set */
+static int dir_set_has(const dir_set *set, const char *path, size_t len){
+  size_t lo = 0, hi = set->count;
+  while( lo<hi ){
+    size_t mid = lo+(hi-lo)/2;
+    const char *dir = set->paths[mid];
+    int order = strncmp(dir, path, len);
+    if( order==0 ) order = dir[len]!='\0';
+    if( order==0 ) return 1;
+    if( order<0 ) lo = mid+1; else hi = mid;
+  }
+  return 0;
+}
+
+/* Skip the files in directories that are the same as in the snapshot the
+** destination was last synced to, without a stat */
+static int restore_skip_unchanged(ctx *c, sqlite3_int64 snapshot_id, sqlite3_int64 since_snapshot_id,
+                                  restore_entry *entries, unsigned int count){
+  dir_set changed;
+  int since_has, has, err;
+  unsigned int i;
+  size_t j;
+
+  if( ctx_has_directory_hashes(c, since_snapshot_id, &since_has)
+   || ctx_has_directory_hashes(c, snapshot_id, &has)
+  ){
+    return 1;
+  }
+  if( !since_has || !has ) return 0;
+
+  memset(&changed, 0, sizeof(changed));
+  err = ctx_changed_dirs(c, since_snapshot_id, snapshot_id, dir_set_add, &changed);
+  if( err==CTX_ERR_NO_MEMORY ) ctx_errtype(c, CTX_ERR_NO_MEMORY);
+  if( !err ){
+    qsort(changed.paths, changed.count, sizeof(*changed.paths), dir_set_cmp);
+    for( i=0; i<count; i++ ){
+      if( !dir_set_has(&changed, entries[i].path, ctx_dir_length(entries[i].path)) ) entries[i].skip = 1;
+    }
+  }
+  for( j=0; j<changed.count; j++ ) free(changed.paths[j]);
+  free(changed.paths);
+  return err!=0;
+}
+
+int ctx_restore_snapshot(ctx *c, sqlite3_int64 snapshot_id, const char *dest_root, const ctx_restore_opts *opts){
+  restore_job job;
+  unsigned int count = 0, batch_count = 0, workers = 0, i;
+  int err = 1;
+  pool *p = NULL;
+  chunk_cache *own_cache = NULL;
+
+  memset(&job, 0, sizeof(job));
+  job.dest_root = dest_root;
+  job.opts = opts;
+  job.plan_bytes = opts && opts->plan_bytes ? opts->plan_bytes : RESTORE_PLAN_DEFAULT;
+  pthread_mutex_init(&job.lock, NULL);
+
+  const char *repo_path = ctx_path(c);
+  if( !repo_path || !repo_path[0] ){
+    ctx_errmsg(c, sqlite3_mprintf("Restoring a snapshot needs a repository stored in a file"));
+    goto out;
+  }
+  if( mkdir(dest_root, 0777) && errno!=EEXIST ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not create %s: %s", dest_root, strerror(errno)));
+    goto out;
+  }
+
+  /* Files come back ordered by where their first chunk is stored */
+  if( restore_collect_entries(c, snapshot_id, &job.entries, &count) ) goto out;
+  if( restore_find_copies(c, job.entries, count) ) goto out;
+  if( opts && opts->sync==CTX_SYNC_MTIME && opts->since_snapshot_id
+   && restore_skip_unchanged(c, snapshot_id, opts->since_snapshot_id, job.entries, count)
+  ){
+    goto out;
+  }
+
+  /* Counts reported are for the cache, so a cache kept on the ctx reports
+  ** its totals across restores. */
+  job.cache = c->restore_cache;
+  if( !job.cache ){
+    job.cache = own_cache = chunk_cache_create(opts && opts->cache_bytes ? opts->cache_bytes : RESTORE_CACHE_DEFAULT);
+    if( !own_cache ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      goto out;
+    }
+  }
+
+  p = pool_create(opts ? opts->threads : 0);
+  if( !p ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not start restore threads"));
+    goto out;
+  }
+  job.workers = calloc(pool_size(p), sizeof(*job.workers));
+  if( !job.workers ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    goto out;
+  }
+  for( workers=0; workers<pool_size(p); workers++ ){
+    restore_worker *w = &job.workers[workers];
+    w->carry_fd = -1;
+    if( ctx_init_readonly(&w->c, repo_path) ){
+      ctx_errmsg(c, sqlite3_mprintf("%s", w->c.errmsg ? w->c.errmsg : "Could not open the repository"));
+      workers++;
+      goto out;
+    }
+    w->opened = 1;
+    if( ctx_init_readonly(&w->ahead, repo_path) ){
+      ctx_errmsg(c, sqlite3_mprintf("%s", w->ahead.errmsg ? w->ahead.errmsg : "Could not open the repository"));
+      workers++;
+      goto out;
+    }
+    w->opened = 2;
+    w->image = malloc(job.plan_bytes);
+    if( !w->image ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      workers++;
+      goto out;
+    }
+  }
+
+  job.start_ms = ctx_now_ms();
+  if( opts && opts->sync!=CTX_SYNC_NONE ) pool_run(p, restore_check_run, &job, count);
+  for( i=0; i<count; i++ ){
+    if( job.entries[i].skip ){
+      job.progress.files_skipped++;
+    }else{
+      job.progress.files_total++;
+      job.progress.bytes_total += job.entries[i].length;
+    }
+  }
+  if( restore_plan_batches(c, &job, count, &batch_count) ) goto out;
+  pool_run(p, restore_batch_run, &job, batch_count);
+  /* Every content is written once; its other files are made from that */
+  if( !job.failed ) pool_run(p, restore_copy_run, &job, count);
+
+  for( i=0; i<workers; i++ ){
+    ctx *w = &job.workers[i].c;
+    if( w->errtype==CTX_ERR_NONE ) continue;
+    if( w->errmsg ){
+      ctx_errmsg(c, sqlite3_mprintf("%s", w->errmsg));
+    }else{
+      ctx_errtype(c, w->errtype);
+    }
+  }
+  if( c->errtype!=CTX_ERR_NONE ) goto out;
+  restore_report(&job, 1);
+  err = 0;
+
+out:
+  pool_destroy(p);
+  for( i=0; i<workers; i++ ){
+    restore_worker *w = &job.workers[i];
+    if( w->blob ) sqlite3_blob_close(w->blob);
+    if( w->opened>0 ) ctx_close(&w->c);
+    if( w->opened>1 ) ctx_close(&w->ahead);
+    free(w->image);
+    free(w->chunk);
+    free(w->reads);
+    free(w->holes);
+  }
+  for( i=0; i<count; i++ ){
+    free(job.entries[i].path);
+  }
+  free(job.entries);
+  free(job.windows);
+  free(job.batches);
+  free(job.workers);
+  chunk_cache_destroy(own_cache);
+  pthread_mutex_destroy(&job.lock);
+  return err;
+}
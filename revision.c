@@ -0,0 +1,169 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Decoded chunks kept per open revision */
+#define REVISION_CACHE_SLOTS 16
+
+typedef struct cached_chunk {
+  sqlite3_int64 chunk_id; /* 0 when the slot is empty */
+  unsigned char *data;
+  unsigned int length;
+  sqlite3_int64 last_used;
+} cached_chunk;
+
+struct ctx_revision {
+  ctx *c;
+  sqlite3_int64 content_id;
+  sqlite3_int64 length;
+  sqlite3_blob *blob;
+  sqlite3_int64 clock; /* Ticks once per lookup, for least-recently-used eviction */
+  cached_chunk cache[REVISION_CACHE_SLOTS];
+};
+
+ctx_revision *ctx_open_revision(ctx *c, sqlite3_int64 revision_id){
+  sqlite3_stmt *stmt = c->select_revision_length;
+  int step_result;
+  ctx_revision *r = NULL;
+
+  c->err_context = "opening a revision";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return NULL;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, revision_id)) ) return NULL;
+  if( ctx_collect_err(c, step_result=sqlite3_step(stmt)) ) return NULL;
+  if( step_result!=SQLITE_ROW ){
+    ctx_errmsg(c, sqlite3_mprintf("There is no revision %lld", revision_id));
+  }else if( sqlite3_column_type(stmt, 1)==SQLITE_NULL ){
+    ctx_errmsg(c, sqlite3_mprintf("Revision %lld was stored without the offsets needed to read it in place", revision_id));
+  }else if( !(r = calloc(1, sizeof(*r))) ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+  }else{
+    r->c = c;
+    r->content_id = sqlite3_column_int64(stmt, 0);
+    r->length = sqlite3_column_int64(stmt, 1);
+  }
+  sqlite3_reset(stmt);
+  return r;
+}
+
+sqlite3_int64 ctx_revision_size(ctx_revision *r){
+  return r->length;
+}
+
+void ctx_close_revision(ctx_revision *r){
+  if( !r ) return;
+  int i;
+  for( i=0; i<REVISION_CACHE_SLOTS; i++ ){
+    free(r->cache[i].data);
+  }
+  if( r->blob ) sqlite3_blob_close(r->blob);
+  free(r);
+}
+
+/* Return a chunk's bytes, from the cache if possible */
+static const unsigned char *revision_chunk(ctx_revision *r, sqlite3_int64 chunk_id, unsigned int length, int has_crc, uint32_t crc){
+  ctx *c = r->c;
+  cached_chunk *slot = &r->cache[0];
+  int i, rc;
+
+  r->clock++;
+  for( i=0; i<REVISION_CACHE_SLOTS; i++ ){
+    cached_chunk *e = &r->cache[i];
+    if( e->chunk_id==chunk_id ){
+      e->last_used = r->clock;
+      return e->data;
+    }
+    if( e->last_used < slot->last_used ) slot = e;
+  }
+
+  if( r->blob ){
+    rc = sqlite3_blob_reopen(r->blob, chunk_id);
+  }else{
+    rc = sqlite3_blob_open(c->db, "main", "chunk", "body", chunk_id, 0, &r->blob);
+  }
+  if( rc!=SQLITE_OK || sqlite3_blob_bytes(r->blob)!=(int)length ){
+    ctx_errmsg(c, sqlite3_mprintf("Got an invalid file chunk while reading a revision"));
+    return NULL;
+  }
+
+  unsigned char *data = realloc(slot->data, length ? length : 1);
+  if( !data ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return NULL;
+  }
+  slot->data = data;
+  slot->chunk_id = 0;
+  if( ctx_collect_err(c, sqlite3_blob_read(r->blob, data, (int)length, 0)) ) return NULL;
+  if( has_crc && crc!=crc32c(data, length) ){
+    ctx_errmsg(c, sqlite3_mprintf("Chunk %lld is damaged", chunk_id));
+    return NULL;
+  }
+  slot->chunk_id = chunk_id;
+  slot->length = length;
+  slot->last_used = r->clock;
+  return data;
+}
+
+sqlite3_int64 ctx_pread(ctx_revision *r, void *buf, size_t len, sqlite3_int64 offset){
+  ctx *c = r->c;
+  sqlite3_stmt *stmt = c->select_segments_from;
+  unsigned char *out = (unsigned char *)buf;
+  sqlite3_int64 end = offset + (sqlite3_int64)len;
+  sqlite3_int64 done = 0;
+  int step_result;
+
+  if( offset<0 ) return -1;
+  if( end > r->length ) end = r->length;
+  if( offset>=end ) return 0;
+
+  c->err_context = "reading a revision";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return -1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, r->content_id)) ) return -1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 2, offset)) ) return -1;
+  while( offset+done<end
+      && 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW
+  ){
+    sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_int64 seg_offset = sqlite3_column_int64(stmt, 1);
+    unsigned int seg_length = (unsigned int)sqlite3_column_int64(stmt, 2);
+    int has_crc = sqlite3_column_type(stmt, 3)!=SQLITE_NULL;
+    uint32_t crc = (uint32_t)sqlite3_column_int64(stmt, 3);
+
+    sqlite3_int64 from = offset+done;
+    sqlite3_int64 to = seg_offset+seg_length < end ? seg_offset+seg_length : end;
+    if( from<seg_offset || to<=from ){
+      ctx_errmsg(c, sqlite3_mprintf("The segments of revision content %lld do not line up", r->content_id));
+      break;
+    }
+    if( chunk_id==0 ){
+      memset(out+done, 0, (size_t)(to-from));
+    }else{
+      const unsigned char *data = revision_chunk(r, chunk_id, seg_length, has_crc, crc);
+      if( !data ) break;
+      memcpy(out+done, data+(from-seg_offset), (size_t)(to-from));
+    }
+    done += to-from;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  if( c->errtype!=CTX_ERR_NONE ) return -1;
+  return done;
+}
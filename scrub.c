@@ -0,0 +1,317 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include "blake2.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Ids covered by one task. Each task reads its range in storage order. */
+#define SCRUB_RANGE 1024
+/* Tasks handed to each thread between checkpoints */
+#define SCRUB_TASKS_PER_THREAD 4
+
+#define PHASE_CHUNKS 0
+#define PHASE_CONTENTS 1
+
+static const unsigned char zeros[4096];
+
+typedef struct scrub_task {
+  sqlite3_int64 lo; /* First id to check */
+  sqlite3_int64 hi; /* One past the last id to check */
+  sqlite3_int64 *bad;
+  unsigned int bad_count;
+  unsigned int bad_capacity;
+  sqlite3_int64 items;
+  sqlite3_int64 bytes;
+} scrub_task;
+
+typedef struct scrub_job {
+  ctx *workers; /* One read-only connection per pool thread */
+  scrub_task *tasks;
+  int phase;
+  int mode;
+} scrub_job;
+
+static int task_add_bad(ctx *w, scrub_task *t, sqlite3_int64 id){
+  if( t->bad_count==t->bad_capacity ){
+    unsigned int capacity = t->bad_capacity ? t->bad_capacity*2 : 16;
+    sqlite3_int64 *bad = realloc(t->bad, capacity*sizeof(*bad));
+    if( !bad ){
+      ctx_errtype(w, CTX_ERR_NO_MEMORY);
+      return 1;
+    }
+    t->bad = bad;
+    t->bad_capacity = capacity;
+  }
+  t->bad[t->bad_count++] = id;
+  return 0;
+}
+
+static void scrub_chunk_range(ctx *w, scrub_task *t, int mode){
+  sqlite3_stmt *stmt = w->scrub_chunks;
+  unsigned char hash[HASH_LENGTH];
+  int step_result;
+
+  w->err_context = "scrubbing chunks";
+  if( ctx_collect_err(w, sqlite3_reset(stmt)) ) return;
+  if( ctx_collect_err(w, sqlite3_bind_int64(stmt, 1, t->lo)) ) return;
+  if( ctx_collect_err(w, sqlite3_bind_int64(stmt, 2, t->hi)) ) return;
+  while( 0==ctx_collect_err(w, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+    const void *stored_hash = sqlite3_column_blob(stmt, 1);
+    int stored_hash_len = sqlite3_column_bytes(stmt, 1);
+    const void *body = sqlite3_column_blob(stmt, 2);
+    int body_len = sqlite3_column_bytes(stmt, 2);
+    /* Chunks stored before CRCs were recorded have none to check */
+    int has_crc = sqlite3_column_type(stmt, 3)!=SQLITE_NULL;
+    uint32_t stored_crc = (uint32_t)sqlite3_column_int64(stmt, 3);
+
+    t->items++;
+    t->bytes += body_len;
+    if( (has_crc && stored_crc!=crc32c(body, body_len))
+     || (mode==CTX_SCRUB_DEEP
+         && (stored_hash_len!=HASH_LENGTH
+          || blake2b(hash, body, NULL, HASH_LENGTH, (uint64_t)body_len, 0)
+          || memcmp(hash, stored_hash, HASH_LENGTH)))
+    ){
+      if( task_add_bad(w, t, chunk_id) ) break;
+    }
+  }
+  sqlite3_reset(stmt);
+}
+
+/* Feed a content's chunks, in order, through one hash and compare the result */
+static int content_matches(ctx *w, sqlite3_int64 content_id, const void *stored_hash){
+  sqlite3_stmt *stmt = w->select_content_chunks;
+  unsigned char hash[HASH_LENGTH];
+  blake2b_state b;
+  int step_result;
+
+  blake2b_init(&b, HASH_LENGTH);
+  if( ctx_collect_err(w, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(w, sqlite3_bind_int64(stmt, 1, content_id)) ) return 1;
+  while( 0==ctx_collect_err(w, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( sqlite3_column_type(stmt, 0)==SQLITE_NULL ){
+      /* A zero extent */
+      sqlite3_int64 left = sqlite3_column_int64(stmt, 1);
+      while( left>0 ){
+        unsigned int n = left>(sqlite3_int64)sizeof(zeros) ? (unsigned int)sizeof(zeros) : (unsigned int)left;
+        blake2b_update(&b, zeros, n);
+        left -= n;
+      }
+      continue;
+    }
+    const void *body = sqlite3_column_blob(stmt, 0);
+    int body_len = sqlite3_column_bytes(stmt, 0);
+    blake2b_update(&b, body, (uint64_t)body_len);
+  }
+  sqlite3_reset(stmt);
+  blake2b_final(&b, hash, HASH_LENGTH);
+  return memcmp(hash, stored_hash, HASH_LENGTH)==0;
+}
+
+static void scrub_content_range(ctx *w, scrub_task *t){
+  sqlite3_stmt *stmt = w->scrub_contents;
+  int step_result;
+
+  w->err_context = "scrubbing contents";
+  if( ctx_collect_err(w, sqlite3_reset(stmt)) ) return;
+  if( ctx_collect_err(w, sqlite3_bind_int64(stmt, 1, t->lo)) ) return;
+  if( ctx_collect_err(w, sqlite3_bind_int64(stmt, 2, t->hi)) ) return;
+  while( 0==ctx_collect_err(w, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    sqlite3_int64 content_id = sqlite3_column_int64(stmt, 0);
+    const void *stored_hash = sqlite3_column_blob(stmt, 1);
+    int stored_hash_len = sqlite3_column_bytes(stmt, 1);
+
+    t->items++;
+    if( stored_hash_len!=HASH_LENGTH || !content_matches(w, content_id, stored_hash) ){
+      if( w->errtype!=CTX_ERR_NONE || task_add_bad(w, t, content_id) ) break;
+    }
+  }
+  sqlite3_reset(stmt);
+}
+
+static void scrub_task_run(void *arg, unsigned int worker, unsigned int task){
+  scrub_job *job = (scrub_job *)arg;
+  ctx *w = &job->workers[worker];
+  if( w->errtype!=CTX_ERR_NONE ) return;
+  if( job->phase==PHASE_CHUNKS ){
+    scrub_chunk_range(w, &job->tasks[task], job->mode);
+  }else{
+    scrub_content_range(w, &job->tasks[task]);
+  }
+}
+
+static int report_problem(ctx *c, const ctx_scrub_opts *opts, int kind, sqlite3_int64 id){
+  sqlite3_stmt *stmt = kind==CTX_SCRUB_CHUNK ? c->select_chunk_revisions : c->select_content_revisions;
+  sqlite3_int64 *revision_ids = NULL;
+  unsigned int count = 0, capacity = 0;
+  int step_result;
+  int err = 0;
+
+  c->err_context = "finding revisions affected by damaged data";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, id)) ) return 1;
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    if( count==capacity ){
+      capacity = capacity ? capacity*2 : 16;
+      sqlite3_int64 *grown = realloc(revision_ids, capacity*sizeof(*grown));
+      if( !grown ){
+        ctx_errtype(c, CTX_ERR_NO_MEMORY);
+        err = 1;
+        break;
+      }
+      revision_ids = grown;
+    }
+    revision_ids[count++] = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_reset(stmt);
+
+  if( !err && c->errtype==CTX_ERR_NONE && opts->on_problem ){
+    ctx_scrub_problem problem;
+    problem.kind = kind;
+    problem.id = id;
+    problem.revision_ids = revision_ids;
+    problem.revision_count = count;
+    opts->on_problem(opts->arg, &problem);
+  }
+  free(revision_ids);
+  return c->errtype != CTX_ERR_NONE;
+}
+
+/* Walk ids [start, max] a round at a time. After each round every task's
+** findings are reported in id order, so the checkpoint that follows covers
+** exactly what has been reported. */
+static int scrub_phase(ctx *c, pool *p, scrub_job *job, const ctx_scrub_opts *opts,
+                       ctx_scrub_checkpoint *checkpoint, sqlite3_int64 max, ctx_scrub_stats *stats){
+  unsigned int task_count = pool_size(p) * SCRUB_TASKS_PER_THREAD;
+  sqlite3_int64 *next = job->phase==PHASE_CHUNKS ? &checkpoint->chunk_id : &checkpoint->content_id;
+  if( *next < 1 ) *next = 1;
+
+  while( *next <= max ){
+    unsigned int n = 0;
+    sqlite3_int64 lo = *next;
+    while( n<task_count && lo<=max ){
+      memset(&job->tasks[n], 0, sizeof(job->tasks[n]));
+      job->tasks[n].lo = lo;
+      job->tasks[n].hi = lo + SCRUB_RANGE;
+      lo += SCRUB_RANGE;
+      n++;
+    }
+    pool_run(p, scrub_task_run, job, n);
+
+    unsigned int i, j;
+    int err = 0;
+    for( i=0; i<pool_size(p); i++ ){
+      ctx *w = &job->workers[i];
+      if( w->errtype==CTX_ERR_NONE ) continue;
+      if( w->errmsg ){
+        ctx_errmsg(c, sqlite3_mprintf("%s", w->errmsg));
+      }else{
+        ctx_errtype(c, w->errtype);
+      }
+      err = 1;
+    }
+    for( i=0; i<n; i++ ){
+      scrub_task *t = &job->tasks[i];
+      for( j=0; !err && j<t->bad_count; j++ ){
+        err = report_problem(c, opts, job->phase==PHASE_CHUNKS ? CTX_SCRUB_CHUNK : CTX_SCRUB_CONTENT, t->bad[j]);
+      }
+      if( job->phase==PHASE_CHUNKS ){
+        stats->chunks += t->items;
+        stats->bad_chunks += t->bad_count;
+      }else{
+        stats->contents += t->items;
+        stats->bad_contents += t->bad_count;
+      }
+      stats->bytes += t->bytes;
+      free(t->bad);
+      t->bad = NULL;
+    }
+    if( err ) return 1;
+
+    *next = lo;
+    if( opts->on_checkpoint ) opts->on_checkpoint(opts->arg, checkpoint);
+  }
+  return 0;
+}
+
+int ctx_scrub(ctx *c, const ctx_scrub_opts *opts, ctx_scrub_stats *stats){
+  ctx_scrub_checkpoint checkpoint = opts->resume_from;
+  sqlite3_int64 max_chunk_id = 0, max_content_id = 0;
+  scrub_job job;
+  int err = 1;
+  unsigned int i, opened = 0;
+
+  memset(stats, 0, sizeof(*stats));
+  memset(&job, 0, sizeof(job));
+
+  const char *path = ctx_path(c);
+  if( !path || !path[0] ){
+    ctx_errmsg(c, sqlite3_mprintf("Scrubbing needs a repository stored in a file"));
+    return 1;
+  }
+
+  /* Ids handed out after this point belong to snapshots still being written
+  ** and are left for the next scrub. */
+  c->err_context = "starting a scrub";
+  if( ctx_collect_err(c, sqlite3_reset(c->select_max_ids)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_step(c->select_max_ids)) ) return 1;
+  max_chunk_id = sqlite3_column_int64(c->select_max_ids, 0);
+  max_content_id = sqlite3_column_int64(c->select_max_ids, 1);
+  sqlite3_reset(c->select_max_ids);
+
+  pool *p = pool_create(opts->threads);
+  if( !p ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not start scrub threads"));
+    return 1;
+  }
+  job.workers = calloc(pool_size(p), sizeof(*job.workers));
+  job.tasks = calloc(pool_size(p) * SCRUB_TASKS_PER_THREAD, sizeof(*job.tasks));
+  if( !job.workers || !job.tasks ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    goto out;
+  }
+  for( opened=0; opened<pool_size(p); opened++ ){
+    if( ctx_init_readonly(&job.workers[opened], path) ){
+      ctx_errmsg(c, sqlite3_mprintf("%s", job.workers[opened].errmsg ? job.workers[opened].errmsg : "Could not open the repository"));
+      opened++;
+      goto out;
+    }
+  }
+
+  job.mode = opts->mode;
+  job.phase = PHASE_CHUNKS;
+  if( scrub_phase(c, p, &job, opts, &checkpoint, max_chunk_id, stats) ) goto out;
+  if( opts->mode==CTX_SCRUB_DEEP ){
+    job.phase = PHASE_CONTENTS;
+    if( scrub_phase(c, p, &job, opts, &checkpoint, max_content_id, stats) ) goto out;
+  }
+  err = 0;
+
+out:
+  pool_destroy(p);
+  for( i=0; i<opened; i++ ){
+    ctx_close(&job.workers[i]);
+  }
+  free(job.workers);
+  free(job.tasks);
+  return err;
+}
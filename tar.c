@@ -0,0 +1,533 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A snapshot is written as a POSIX (ustar, with pax headers where ustar
+** falls short) archive. The calling thread decodes chunks into a ring of
+** large buffers and a writer thread drains them, so reading the
+** repository and writing to a slow pipe or socket overlap.
+*/
+#define EXPORT_BUFFER_SIZE (4*1024*1024)
+#define EXPORT_BUFFERS 4
+/* The archive is padded to a whole number of records, as tar does */
+#define TAR_BLOCK 512
+#define TAR_RECORD (20*TAR_BLOCK)
+
+typedef struct tar_out {
+  int fd;
+  unsigned char *buffers[EXPORT_BUFFERS];
+  size_t used[EXPORT_BUFFERS];
+  unsigned int fill; /* Buffer being filled by the reader */
+  sqlite3_int64 total; /* Bytes put so far */
+
+  pthread_mutex_t lock; /* Guards everything below */
+  pthread_cond_t changed;
+  unsigned int head; /* Next buffer to write */
+  unsigned int queued;
+  int finished;
+  int write_errno; /* Set when a write fails; the reader then gives up */
+} tar_out;
+
+static void *tar_writer_run(void *arg){
+  tar_out *out = (tar_out *)arg;
+  pthread_mutex_lock(&out->lock);
+  while( 1 ){
+    while( out->queued==0 && !out->finished ) pthread_cond_wait(&out->changed, &out->lock);
+    if( out->queued==0 ) break;
+    unsigned int b = out->head;
+    int failed = out->write_errno!=0;
+    pthread_mutex_unlock(&out->lock);
+
+    size_t done = 0;
+    int write_errno = 0;
+    while( !failed && done<out->used[b] ){
+      ssize_t n = write(out->fd, out->buffers[b]+done, out->used[b]-done);
+      if( n<0 && errno==EINTR ) continue;
+      if( n<=0 ){
+        write_errno = n<0 ? errno : EIO;
+        break;
+      }
+      done += (size_t)n;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    if( write_errno ) out->write_errno = write_errno;
+    out->head = (out->head+1) % EXPORT_BUFFERS;
+    out->queued--;
+    pthread_cond_broadcast(&out->changed);
+  }
+  pthread_mutex_unlock(&out->lock);
+  return NULL;
+}
+
+/* Hand the buffer being filled to the writer and wait for a free one */
+static int tar_submit(ctx *c, tar_out *out){
+  pthread_mutex_lock(&out->lock);
+  out->queued++;
+  pthread_cond_broadcast(&out->changed);
+  while( out->queued==EXPORT_BUFFERS && !out->write_errno ){
+    pthread_cond_wait(&out->changed, &out->lock);
+  }
+  int write_errno = out->write_errno;
+  pthread_mutex_unlock(&out->lock);
+
+  out->fill = (out->fill+1) % EXPORT_BUFFERS;
+  out->used[out->fill] = 0;
+  if( write_errno ){
+    ctx_errmsg(c, sqlite3_mprintf("Error writing the archive: %s", strerror(write_errno)));
+    return 1;
+  }
+  return 0;
+}
+
+/* Append len bytes, or len zeros if data is NULL */
+static int tar_put(ctx *c, tar_out *out, const void *data, size_t len){
+  const unsigned char *p = (const unsigned char *)data;
+  out->total += len;
+  while( len>0 ){
+    size_t room = EXPORT_BUFFER_SIZE - out->used[out->fill];
+    size_t piece = len<room ? len : room;
+    unsigned char *dest = out->buffers[out->fill] + out->used[out->fill];
+    if( p ){
+      memcpy(dest, p, piece);
+      p += piece;
+    }else{
+      memset(dest, 0, piece);
+    }
+    out->used[out->fill] += piece;
+    len -= piece;
+    if( out->used[out->fill]==EXPORT_BUFFER_SIZE && tar_submit(c, out) ) return 1;
+  }
+  return 0;
+}
+
+static void tar_octal(char *field, size_t width, sqlite3_int64 value){
+  /* width includes the terminating NUL */
+  field[width-1] = 0;
+  size_t i = width-1;
+  while( i>0 ){
+    field[--i] = (char)('0' + (value & 7));
+    value >>= 3;
+  }
+}
+
+/* A pax record is "<length> <key>=<value>\n", its length counting itself */
+static char *pax_record(char *records, const char *key, const char *value){
+  size_t body = strlen(key) + strlen(value) + 3;
+  size_t len = body + 1;
+  while( len != body + (size_t)snprintf(NULL, 0, "%zu", len) ) len++;
+  char *more = sqlite3_mprintf("%s%lld %s=%s\n", records ? records : "", (sqlite3_int64)len, key, value);
+  sqlite3_free(records);
+  return more;
+}
+
+/* Where a long name can be split into ustar's prefix (155 bytes) and
+** name (100 bytes) fields, or NULL if it cannot */
+static const char *ustar_split(const char *name){
+  size_t name_len = strlen(name);
+  const char *p;
+  for( p=name; *p; p++ ){
+    size_t before = (size_t)(p-name);
+    if( *p=='/' && before>0 && before<=155 && name_len-before-1<=100 ) return p;
+  }
+  return NULL;
+}
+
+static int tar_header(ctx *c, tar_out *out, const char *name, char type, sqlite3_int64 size, sqlite3_int64 mtime){
+  unsigned char block[TAR_BLOCK];
+  char *h = (char *)block;
+  size_t name_len = strlen(name);
+  unsigned int i, sum = 0;
+
+  memset(block, 0, sizeof(block));
+  if( name_len>100 ){
+    const char *split = ustar_split(name);
+    if( split ){
+      memcpy(h+345, name, (size_t)(split-name));
+      memcpy(h, split+1, name_len-(size_t)(split-name)-1);
+    }else{
+      memcpy(h, name, 100); /* The pax header before this carries the full name */
+    }
+  }else{
+    memcpy(h, name, name_len);
+  }
+  tar_octal(h+100, 8, 0644);
+  tar_octal(h+108, 8, 0);
+  tar_octal(h+116, 8, 0);
+  tar_octal(h+124, 12, size < (1LL<<33) ? size : 0);
+  tar_octal(h+136, 12, mtime>0 && mtime < (1LL<<33) ? mtime : 0);
+  h[156] = type;
+  memcpy(h+257, "ustar", 6);
+  memcpy(h+263, "00", 2);
+  memset(h+148, ' ', 8);
+  for( i=0; i<TAR_BLOCK; i++ ) sum += block[i];
+  tar_octal(h+148, 7, sum);
+  h[155] = ' ';
+  return tar_put(c, out, block, TAR_BLOCK);
+}
+
+static int tar_pad(ctx *c, tar_out *out){
+  size_t partial = (size_t)(out->total % TAR_BLOCK);
+  return partial ? tar_put(c, out, NULL, TAR_BLOCK-partial) : 0;
+}
+
+/* Write a file's headers: a pax header first when ustar cannot hold its
+** name or size */
+static int tar_file_header(ctx *c, tar_out *out, const char *name, sqlite3_int64 size, sqlite3_int64 mtime){
+  if( size >= (1LL<<33) || (strlen(name)>100 && !ustar_split(name)) ){
+    char size_text[32];
+    snprintf(size_text, sizeof(size_text), "%lld", size);
+    char *records = pax_record(NULL, "path", name);
+    if( records ) records = pax_record(records, "size", size_text);
+    if( !records ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      return 1;
+    }
+    size_t len = strlen(records);
+    int err = tar_header(c, out, "PaxHeader", 'x', (sqlite3_int64)len, mtime)
+           || tar_put(c, out, records, len)
+           || tar_pad(c, out);
+    sqlite3_free(records);
+    if( err ) return 1;
+  }
+  return tar_header(c, out, name, '0', size, mtime);
+}
+
+static int tar_content(ctx *c, tar_out *out, sqlite3_int64 content_id, sqlite3_blob **blob){
+  unsigned char chunk[MAX_CHUNK_SIZE];
+  sqlite3_stmt *stmt = c->select_content_segments;
+  int step_result, rc;
+
+  c->err_context = "exporting a file";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) return 1;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, content_id)) ) return 1;
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    sqlite3_int64 chunk_id = sqlite3_column_int64(stmt, 0);
+    sqlite3_int64 length = sqlite3_column_int64(stmt, 1);
+    if( chunk_id==0 ){
+      if( tar_put(c, out, NULL, (size_t)length) ) break;
+      continue;
+    }
+    if( *blob ){
+      rc = sqlite3_blob_reopen(*blob, chunk_id);
+    }else{
+      rc = sqlite3_blob_open(c->db, "main", "chunk", "body", chunk_id, 0, blob);
+    }
+    if( rc!=SQLITE_OK || length>MAX_CHUNK_SIZE || sqlite3_blob_bytes(*blob)!=(int)length ){
+      ctx_errmsg(c, sqlite3_mprintf("Got an invalid file chunk while exporting a snapshot"));
+      break;
+    }
+    if( ctx_collect_err(c, sqlite3_blob_read(*blob, chunk, (int)length, 0)) ) break;
+    if( sqlite3_column_type(stmt, 2)!=SQLITE_NULL
+     && (uint32_t)sqlite3_column_int64(stmt, 2)!=crc32c(chunk, (size_t)length)
+    ){
+      ctx_errmsg(c, sqlite3_mprintf("Chunk %lld is damaged", chunk_id));
+      break;
+    }
+    if( tar_put(c, out, chunk, (size_t)length) ) break;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return c->errtype!=CTX_ERR_NONE;
+}
+
+/* Write every file of the snapshot, in the order they are listed */
+static int tar_snapshot(ctx *c, sqlite3_int64 snapshot_id, tar_out *out){
+  sqlite3_stmt *stmt = c->select_snapshot_entries;
+  sqlite3_blob *blob = NULL;
+  int step_result;
+  int err = 1;
+
+  c->err_context = "listing a snapshot";
+  if( ctx_collect_err(c, sqlite3_reset(stmt)) ) goto out;
+  if( ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, snapshot_id)) ) goto out;
+  while( 0==ctx_collect_err(c, step_result=sqlite3_step(stmt)) && step_result==SQLITE_ROW ){
+    const char *stored = (const char *)sqlite3_column_text(stmt, 0);
+    sqlite3_int64 content_id = sqlite3_column_int64(stmt, 1);
+    sqlite3_int64 length = sqlite3_column_int64(stmt, 2);
+    sqlite3_int64 mtime = sqlite3_column_type(stmt, 4)==SQLITE_NULL ? 0 : sqlite3_column_int64(stmt, 4)/1000000000;
+
+    /* "./" and then the path, made relative the same way a restore does */
+    char *name = restore_dest_path(".", stored ? stored : "");
+    if( !name ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      goto out;
+    }
+    int failed = tar_file_header(c, out, name[1] ? name+2 : name, length, mtime);
+    free(name);
+    if( failed ) goto out;
+    sqlite3_int64 before = out->total;
+    if( tar_content(c, out, content_id, &blob) ) goto out;
+    if( out->total - before != length ){
+      ctx_errmsg(c, sqlite3_mprintf("The segments of %s do not add up to its length", stored));
+      goto out;
+    }
+    if( tar_pad(c, out) ) goto out;
+  }
+  if( c->errtype!=CTX_ERR_NONE ) goto out;
+
+  /* Two empty blocks end the archive */
+  if( tar_put(c, out, NULL, 2*TAR_BLOCK) ) goto out;
+  if( out->total % TAR_RECORD && tar_put(c, out, NULL, TAR_RECORD - (size_t)(out->total % TAR_RECORD)) ) goto out;
+  err = 0;
+
+out:
+  if( blob ) sqlite3_blob_close(blob);
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return err;
+}
+
+int ctx_export_tar(ctx *c, sqlite3_int64 snapshot_id, int fd){
+  tar_out out;
+  pthread_t writer;
+  unsigned int i;
+  int err = 1;
+
+  memset(&out, 0, sizeof(out));
+  out.fd = fd;
+  for( i=0; i<EXPORT_BUFFERS; i++ ){
+    out.buffers[i] = malloc(EXPORT_BUFFER_SIZE);
+    if( !out.buffers[i] ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      goto free_buffers;
+    }
+  }
+  pthread_mutex_init(&out.lock, NULL);
+  pthread_cond_init(&out.changed, NULL);
+  if( pthread_create(&writer, NULL, tar_writer_run, &out) ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not start the archive writer"));
+    goto destroy;
+  }
+
+  err = tar_snapshot(c, snapshot_id, &out);
+
+  /* Queue what is left and let the writer drain it */
+  pthread_mutex_lock(&out.lock);
+  if( !err && out.used[out.fill]>0 ) out.queued++;
+  out.finished = 1;
+  pthread_cond_broadcast(&out.changed);
+  pthread_mutex_unlock(&out.lock);
+  pthread_join(writer, NULL);
+  if( !err && out.write_errno ){
+    ctx_errmsg(c, sqlite3_mprintf("Error writing the archive: %s", strerror(out.write_errno)));
+    err = 1;
+  }
+
+destroy:
+  pthread_cond_destroy(&out.changed);
+  pthread_mutex_destroy(&out.lock);
+free_buffers:
+  for( i=0; i<EXPORT_BUFFERS; i++ ){
+    free(out.buffers[i]);
+  }
+  return err;
+}
+
+/* Reading archives. Members are streamed straight into the chunker, so an
+** archive on a pipe is ingested in one pass without being spooled.
+*/
+#define TAR_PAX_MAX (1024*1024) /* Largest pax header we will hold in memory */
+
+typedef struct tar_member {
+  FILE *in;
+  sqlite3_int64 left;
+  int short_read;
+} tar_member;
+
+static size_t read_member(void *src, unsigned char *buf, size_t len){
+  tar_member *m = (tar_member *)src;
+  if( (sqlite3_int64)len > m->left ) len = (size_t)m->left;
+  size_t n = len ? fread(buf, 1, len, m->in) : 0;
+  if( n<len ) m->short_read = 1;
+  m->left -= n;
+  return n;
+}
+
+/* Read and throw away len bytes */
+static int tar_skip(FILE *in, sqlite3_int64 len){
+  unsigned char buf[TAR_BLOCK*16];
+  while( len>0 ){
+    size_t piece = len<(sqlite3_int64)sizeof(buf) ? (size_t)len : sizeof(buf);
+    if( fread(buf, 1, piece, in)!=piece ) return 1;
+    len -= piece;
+  }
+  return 0;
+}
+
+static sqlite3_int64 tar_padding(sqlite3_int64 size){
+  return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+/* A numeric field: octal text, or GNU base-256 when the top bit is set */
+static sqlite3_int64 tar_number(const char *field, size_t width){
+  const unsigned char *p = (const unsigned char *)field;
+  sqlite3_int64 value = 0;
+  size_t i = 0;
+  if( p[0] & 0x80 ){
+    value = p[0] & 0x3f;
+    for( i=1; i<width; i++ ) value = (value<<8) | p[i];
+    return value;
+  }
+  while( i<width && p[i]==' ' ) i++;
+  while( i<width && p[i]>='0' && p[i]<='7' ) value = value*8 + (p[i++]-'0');
+  return value;
+}
+
+static int tar_checksum_ok(const unsigned char *block){
+  unsigned int i, sum = 0;
+  for( i=0; i<TAR_BLOCK; i++ ) sum += (i>=148 && i<156) ? ' ' : block[i];
+  return sum==(unsigned int)tar_number((const char *)block+148, 8);
+}
+
+/* Pick out the pax keys we use: path, size and mtime */
+static void pax_parse(char *records, size_t len, char **path, sqlite3_int64 *size, sqlite3_int64 *mtime_ns){
+  char *p = records, *end = records+len;
+  while( p<end ){
+    char *record = p;
+    size_t record_len = (size_t)strtoul(p, &p, 10);
+    if( record_len==0 || record+record_len>end || *p!=' ' ) break;
+    char *key = p+1;
+    char *eq = memchr(key, '=', (size_t)(record+record_len-key));
+    if( !eq ) break;
+    char *value = eq+1;
+    record[record_len-1] = 0; /* The newline */
+    *eq = 0;
+    if( strcmp(key, "path")==0 ){
+      free(*path);
+      *path = strdup(value);
+    }else if( strcmp(key, "size")==0 ){
+      *size = strtoll(value, NULL, 10);
+    }else if( strcmp(key, "mtime")==0 ){
+      char *frac;
+      sqlite3_int64 ns = strtoll(value, &frac, 10)*1000000000;
+      if( *frac=='.' ){
+        sqlite3_int64 scale = 100000000;
+        for( frac++; *frac>='0' && *frac<='9' && scale>0; frac++, scale/=10 ) ns += (*frac-'0')*scale;
+      }
+      *mtime_ns = ns;
+    }
+    p = record+record_len;
+  }
+}
+
+/* Read a pax or GNU long name member's body into memory */
+static char *tar_read_body(ctx *c, FILE *in, sqlite3_int64 size){
+  if( size>TAR_PAX_MAX ){
+    ctx_errmsg(c, sqlite3_mprintf("A tar extended header is too large"));
+    return NULL;
+  }
+  char *body = malloc((size_t)size+1);
+  if( !body ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return NULL;
+  }
+  if( fread(body, 1, (size_t)size, in)!=(size_t)size || tar_skip(in, tar_padding(size)) ){
+    ctx_errmsg(c, sqlite3_mprintf("The tar archive ends partway through a member"));
+    free(body);
+    return NULL;
+  }
+  body[size] = 0;
+  return body;
+}
+
+int ctx_add_tar_to_snapshot(ctx *c, FILE *in){
+  unsigned char block[TAR_BLOCK];
+  char *next_path = NULL; /* From a pax or GNU long name header */
+  sqlite3_int64 next_size = -1, next_mtime_ns = -1;
+  int err = 1;
+
+  while( 1 ){
+    size_t got = fread(block, 1, TAR_BLOCK, in);
+    if( got==0 ) break; /* Some writers leave off the end blocks */
+    if( got<TAR_BLOCK ){
+      ctx_errmsg(c, sqlite3_mprintf("The tar archive ends partway through a header"));
+      goto out;
+    }
+    size_t i;
+    for( i=0; i<TAR_BLOCK && block[i]==0; i++ );
+    if( i==TAR_BLOCK ) break; /* An end block */
+    if( !tar_checksum_ok(block) ){
+      ctx_errmsg(c, sqlite3_mprintf("Not a tar archive, or a damaged one"));
+      goto out;
+    }
+
+    const char *h = (const char *)block;
+    char type = h[156];
+    sqlite3_int64 size = next_size>=0 ? next_size : tar_number(h+124, 12);
+
+    if( type=='x' || type=='L' ){
+      char *body = tar_read_body(c, in, size);
+      if( !body ) goto out;
+      if( type=='x' ){
+        pax_parse(body, (size_t)size, &next_path, &next_size, &next_mtime_ns);
+      }else{
+        free(next_path);
+        next_path = strdup(body);
+      }
+      free(body);
+      continue;
+    }
+
+    if( type=='0' || type=='\0' || type=='7' ){
+      char name[256+2];
+      const char *path = next_path;
+      if( !path ){
+        /* ustar keeps a long name's directories in the prefix field */
+        size_t prefix_len = memcmp(h+257, "ustar", 5)==0 ? strnlen(h+345, 155) : 0;
+        size_t name_len = strnlen(h, 100);
+        memcpy(name, h+345, prefix_len);
+        if( prefix_len ) name[prefix_len++] = '/';
+        memcpy(name+prefix_len, h, name_len);
+        name[prefix_len+name_len] = 0;
+        path = name;
+      }
+      sqlite3_int64 mtime_ns = next_mtime_ns>=0 ? next_mtime_ns : tar_number(h+136, 12)*1000000000;
+
+      tar_member m;
+      m.in = in;
+      m.left = size;
+      m.short_read = 0;
+      if( ctx_add_reader_to_snapshot(c, path, read_member, &m, size, mtime_ns) ) goto out;
+      if( m.short_read || tar_skip(in, m.left + tar_padding(size)) ){
+        ctx_errmsg(c, sqlite3_mprintf("The tar archive ends partway through %s", path));
+        goto out;
+      }
+    }else if( tar_skip(in, size + tar_padding(size)) ){
+      ctx_errmsg(c, sqlite3_mprintf("The tar archive ends partway through a member"));
+      goto out;
+    }
+
+    free(next_path);
+    next_path = NULL;
+    next_size = -1;
+    next_mtime_ns = -1;
+  }
+  err = 0;
+
+out:
+  free(next_path);
+  return err;
+}
@@ -0,0 +1,992 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "freezefile.h"
+#include "blake2.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Snapshotting a directory tree with many threads and one writer.
+**
+** Workers share two lists: directories still to be listed, and files in
+** the order they were found. An idle worker reads the next file if the
+** memory budget allows, and otherwise lists a directory. Reading a file
+** means loading it whole, hashing it and cutting and hashing its chunks,
+** which is everything but the database work. The calling thread takes the
+** files that are ready in list order, a batch at a time, and stores them.
+**
+** With many small files the time goes on opening, reading and hashing
+** each one, so those happen on all the workers at once while the writer
+** does nothing but inserts. Files of INGEST_PIPELINE_MIN or more are not
+** loaded; the writer stores them itself, through the ingest pipeline.
+**
+** Listing a directory costs one open and a few large getdents64 calls on
+** Linux. The entry types they return say which names are directories and
+** regular files, so nothing is stat'ed while listing; a file's size and
+** time come from fstat once a worker has it open. Paths are kept whole,
+** with no length limit, and a path too long for the kernel is opened a
+** piece at a time with openat.
+**
+** Given a change journal (see watch.c), only what it lists is queued:
+** changed files to read and new or moved directories to walk. Every other
+** file is carried over from the snapshot that last took the journal with
+** no stat, and, in a delta snapshot of that one, with no insert either.
+*/
+#define TREE_INFLIGHT_MAX (64*1024*1024) /* Bytes loaded and not yet written */
+#define TREE_WRITE_BATCH 256
+#define TREE_DENTS_BUFFER (256*1024) /* Per worker, for getdents64 */
+
+#define FILE_WAITING 0
+#define FILE_READING 1
+#define FILE_READY 2
+
+typedef struct tree_file {
+  char *path;
+  file_meta meta; /* Once opened */
+  sqlite3_int64 reused; /* The earlier revision's content it still has, or 0 */
+  int state; /* A FILE_* constant */
+  int large; /* Left for the writer to read */
+  int failed;
+  size_t charge; /* Counted against TREE_INFLIGHT_MAX */
+  unsigned char hash[HASH_LENGTH];
+  unsigned char *data;
+  sqlite3_int64 length;
+  hashed_chunk *chunks;
+  unsigned int chunk_count;
+  unsigned int chunk_capacity;
+} tree_file;
+
+typedef struct tree_walk {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  int stop;
+  int no_memory;
+  int deterministic;
+
+  char **dirs;
+  size_t dir_count;
+  size_t dir_capacity;
+  unsigned int dirs_busy;
+  int listed; /* Every directory has been listed */
+
+  tree_file **files;
+  size_t file_count;
+  size_t file_capacity;
+  size_t next_read;
+  size_t next_write;
+  size_t inflight;
+  sqlite3_int64 skipped;
+
+  int reuse; /* The ctx's CTX_REUSE_* level */
+  struct prior_file *prior; /* Read-only once the workers start */
+  size_t prior_mask;
+} tree_walk;
+
+static void tree_file_free(tree_file *f){
+  if( !f ) return;
+  free(f->path);
+  free(f->data);
+  free(f->chunks);
+  free(f);
+}
+
+static char *tree_join(const char *dir, const char *name){
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  char *path = malloc(dir_len + name_len + 2);
+  if( !path ) return NULL;
+  memcpy(path, dir, dir_len);
+  if( dir_len==0 || dir[dir_len-1]!='/' ) path[dir_len++] = '/';
+  memcpy(path+dir_len, name, name_len+1);
+  return path;
+}
+
+static int grow(void **array, size_t *capacity, size_t needed, size_t item_size){
+  if( needed <= *capacity ) return 0;
+  size_t n = *capacity ? *capacity : 64;
+  while( n < needed ) n *= 2;
+  void *a = realloc(*array, n*item_size);
+  if( !a ) return 1;
+  *array = a;
+  *capacity = n;
+  return 0;
+}
+
+static int file_cmp(const void *a, const void *b){
+  return strcmp((*(tree_file *const *)a)->path, (*(tree_file *const *)b)->path);
+}
+
+/* Called with the lock held */
+static void tree_fail(tree_walk *w){
+  w->no_memory = 1;
+  w->stop = 1;
+  pthread_cond_broadcast(&w->changed);
+}
+
+/* What each file was like at its latest earlier revision, for reuse
+** without asking the database from the workers. A file is known by a
+** 64-bit hash of its path, and its metadata by a 64-bit hash of the
+** fields the reuse level compares, which keeps an entry to 24 bytes for
+** trees of tens of millions of files. */
+typedef struct prior_file {
+  uint64_t path_key; /* 0 for an empty slot */
+  uint64_t meta_key;
+  sqlite3_int64 content_id;
+} prior_file;
+
+static uint64_t path_key(const char *path){
+  uint64_t key = 0;
+  blake2b((uint8_t *)&key, path, NULL, sizeof(key), strlen(path), 0);
+  return key ? key : 1;
+}
+
+/* 0 when meta lacks a field that level compares */
+static uint64_t meta_key(const file_meta *meta, int level){
+  sqlite3_int64 fields[5];
+  unsigned int n = 0;
+  uint64_t key = 0;
+  if( meta->size<0 || meta->mtime_ns<0 ) return 0;
+  fields[n++] = meta->size;
+  fields[n++] = meta->mtime_ns;
+  if( level==CTX_REUSE_STRICT ){
+    if( meta->ctime_ns<0 || !meta->has_inode ) return 0;
+    fields[n++] = meta->ctime_ns;
+    fields[n++] = meta->inode;
+    fields[n++] = meta->device;
+  }
+  blake2b((uint8_t *)&key, fields, NULL, sizeof(key), n*sizeof(fields[0]), 0);
+  return key ? key : 1;
+}
+
+static sqlite3_int64 prior_content(tree_walk *w, const char *path, const file_meta *meta){
+  if( !w->prior ) return 0;
+  uint64_t key = path_key(path);
+  size_t i = (size_t)key & w->prior_mask;
+  while( w->prior[i].path_key ){
+    if( w->prior[i].path_key==key ){
+      return w->prior[i].meta_key==meta_key(meta, w->reuse) ? w->prior[i].content_id : 0;
+    }
+    i = (i+1) & w->prior_mask;
+  }
+  return 0;
+}
+
+static int prior_insert(tree_walk *w, uint64_t path_key, uint64_t meta_key, sqlite3_int64 content_id, size_t *count){
+  if( (*count+1)*2 > w->prior_mask+1 ){
+    size_t new_size = w->prior ? (w->prior_mask+1)*2 : 1024;
+    prior_file *slots = calloc(new_size, sizeof(*slots));
+    if( !slots ) return 1;
+    size_t j;
+    for( j=0; w->prior && j<=w->prior_mask; j++ ){
+      if( !w->prior[j].path_key ) continue;
+      size_t k = (size_t)w->prior[j].path_key & (new_size-1);
+      while( slots[k].path_key ) k = (k+1) & (new_size-1);
+      slots[k] = w->prior[j];
+    }
+    free(w->prior);
+    w->prior = slots;
+    w->prior_mask = new_size-1;
+  }
+  size_t i = (size_t)path_key & w->prior_mask;
+  while( w->prior[i].path_key && w->prior[i].path_key!=path_key ) i = (i+1) & w->prior_mask;
+  if( !w->prior[i].path_key ) (*count)++;
+  w->prior[i].path_key = path_key;
+  w->prior[i].meta_key = meta_key;
+  w->prior[i].content_id = content_id;
+  return 0;
+}
+
+/* Load the latest earlier revision of every file under root */
+static int prior_load(ctx *c, tree_walk *w, const char *root){
+  sqlite3_stmt *stmt = c->select_prior_revisions;
+  size_t count = 0;
+  int step_result;
+  int err = 0;
+  char *prefix = tree_join(root, "");
+  if( !prefix ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+
+  c->err_context = "loading the previous revisions";
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, c->creating_snapshot_id))
+   || ctx_collect_err(c, sqlite3_bind_text(stmt, 2, prefix, -1, SQLITE_STATIC))
+  ){
+    err = 1;
+  }
+  while( !err && 0==(err=ctx_collect_err(c, step_result=sqlite3_step(stmt))) && step_result==SQLITE_ROW ){
+    file_meta meta;
+    meta.size = sqlite3_column_int64(stmt, 2);
+    meta.mtime_ns = sqlite3_column_int64(stmt, 3);
+    meta.ctime_ns = sqlite3_column_type(stmt, 4)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 4);
+    meta.has_inode = sqlite3_column_type(stmt, 5)!=SQLITE_NULL;
+    meta.inode = sqlite3_column_int64(stmt, 5);
+    meta.device = sqlite3_column_int64(stmt, 6);
+    uint64_t mk = meta_key(&meta, w->reuse);
+    if( mk==0 ) continue;
+    if( prior_insert(w, path_key((const char *)sqlite3_column_text(stmt, 0)), mk, sqlite3_column_int64(stmt, 1), &count) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      err = 1;
+    }
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  free(prefix);
+  return err;
+}
+
+/* open(2) for a path of any length. Past PATH_MAX it descends through the
+** path's directories with openat, each step well under the limit. */
+static int tree_open(const char *path, int flags){
+  if( strlen(path) < PATH_MAX ) return open(path, flags|O_CLOEXEC);
+
+  char *copy = strdup(path);
+  if( !copy ){
+    errno = ENOMEM;
+    return -1;
+  }
+  char *rest = copy;
+  int dir_fd = AT_FDCWD;
+  int fd = -1;
+  while( strlen(rest) >= PATH_MAX ){
+    char *cut = rest + PATH_MAX - 1;
+    while( cut>rest && *cut!='/' ) cut--;
+    if( cut==rest ){
+      errno = ENAMETOOLONG;
+      goto out;
+    }
+    *cut = 0;
+    int next = openat(dir_fd, rest, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if( dir_fd!=AT_FDCWD ) close(dir_fd);
+    dir_fd = next;
+    if( dir_fd<0 ) goto out;
+    rest = cut+1;
+  }
+  fd = openat(dir_fd, rest, flags|O_CLOEXEC);
+
+out:
+  if( dir_fd>=0 && dir_fd!=AT_FDCWD ) close(dir_fd);
+  free(copy);
+  return fd;
+}
+
+#define ENTRY_OTHER 0
+#define ENTRY_DIR 1
+#define ENTRY_FILE 2
+
+/* Classify a directory entry, stat'ing it only when the listing gave no type */
+static int entry_kind(int dir_fd, const char *name, int d_type){
+#ifdef DT_UNKNOWN
+  if( d_type==DT_DIR ) return ENTRY_DIR;
+  if( d_type==DT_REG ) return ENTRY_FILE;
+  if( d_type!=DT_UNKNOWN ) return ENTRY_OTHER;
+#endif
+  struct stat st;
+  if( fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) ) return ENTRY_OTHER;
+  if( S_ISDIR(st.st_mode) ) return ENTRY_DIR;
+  if( S_ISREG(st.st_mode) ) return ENTRY_FILE;
+  return ENTRY_OTHER;
+}
+
+typedef struct dir_listing {
+  const char *dir;
+  char **dirs;
+  size_t dir_count;
+  size_t dir_capacity;
+  tree_file **files;
+  size_t file_count;
+  size_t file_capacity;
+} dir_listing;
+
+static int listing_add(dir_listing *l, int dir_fd, const char *name, int d_type){
+  if( name[0]=='.' && (name[1]==0 || (name[1]=='.' && name[2]==0)) ) return 0;
+  int kind = entry_kind(dir_fd, name, d_type);
+  if( kind==ENTRY_OTHER ) return 0;
+
+  char *path = tree_join(l->dir, name);
+  if( !path ) return 1;
+  if( kind==ENTRY_DIR ){
+    if( grow((void **)&l->dirs, &l->dir_capacity, l->dir_count+1, sizeof(*l->dirs)) ){
+      free(path);
+      return 1;
+    }
+    l->dirs[l->dir_count++] = path;
+    return 0;
+  }
+  tree_file *f = calloc(1, sizeof(*f));
+  if( !f || grow((void **)&l->files, &l->file_capacity, l->file_count+1, sizeof(*l->files)) ){
+    free(f);
+    free(path);
+    return 1;
+  }
+  f->path = path;
+  l->files[l->file_count++] = f;
+  return 0;
+}
+
+#ifdef __linux__
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Returns 1 if it ran out of memory */
+static int list_entries(dir_listing *l, int fd, unsigned char *buf){
+  while( 1 ){
+    long n = syscall(SYS_getdents64, fd, buf, TREE_DENTS_BUFFER);
+    if( n<=0 ) return 0; /* A read error just ends the listing */
+    long pos = 0;
+    while( pos<n ){
+      struct linux_dirent64 *e = (struct linux_dirent64 *)(buf+pos);
+      if( listing_add(l, fd, e->d_name, e->d_type) ) return 1;
+      pos += e->d_reclen;
+    }
+  }
+}
+#else
+static int list_entries(dir_listing *l, int fd, unsigned char *buf){
+  DIR *d = fdopendir(dup(fd));
+  if( !d ) return 0;
+  struct dirent *e;
+  int err = 0;
+  while( !err && (e = readdir(d))!=NULL ){
+#ifdef DT_UNKNOWN
+    err = listing_add(l, fd, e->d_name, e->d_type);
+#else
+    err = listing_add(l, fd, e->d_name, 0);
+#endif
+  }
+  closedir(d);
+  return err;
+}
+#endif
+
+static void tree_list_dir(tree_walk *w, char *dir, unsigned char *buf){
+  dir_listing l;
+  size_t i;
+
+  memset(&l, 0, sizeof(l));
+  l.dir = dir;
+  int fd = tree_open(dir, O_RDONLY|O_DIRECTORY);
+  if( fd<0 ){
+    pthread_mutex_lock(&w->lock);
+    w->skipped++;
+    pthread_mutex_unlock(&w->lock);
+    free(dir);
+    return;
+  }
+  int failed = list_entries(&l, fd, buf);
+  close(fd);
+  free(dir);
+
+  pthread_mutex_lock(&w->lock);
+  if( failed
+   || grow((void **)&w->dirs, &w->dir_capacity, w->dir_count+l.dir_count, sizeof(*w->dirs))
+   || grow((void **)&w->files, &w->file_capacity, w->file_count+l.file_count, sizeof(*w->files))
+  ){
+    tree_fail(w);
+    pthread_mutex_unlock(&w->lock);
+    for( i=0; i<l.dir_count; i++ ) free(l.dirs[i]);
+    for( i=0; i<l.file_count; i++ ) tree_file_free(l.files[i]);
+  }else{
+    memcpy(w->dirs+w->dir_count, l.dirs, l.dir_count*sizeof(*l.dirs));
+    w->dir_count += l.dir_count;
+    memcpy(w->files+w->file_count, l.files, l.file_count*sizeof(*l.files));
+    w->file_count += l.file_count;
+    pthread_mutex_unlock(&w->lock);
+  }
+  free(l.dirs);
+  free(l.files);
+}
+
+typedef struct memory_reader {
+  const unsigned char *data;
+  size_t length;
+  size_t pos;
+} memory_reader;
+
+static size_t read_from_memory(void *src, unsigned char *buf, size_t len){
+  memory_reader *m = (memory_reader *)src;
+  if( len > m->length-m->pos ) len = m->length-m->pos;
+  memcpy(buf, m->data+m->pos, len);
+  m->pos += len;
+  return len;
+}
+
+typedef struct chunk_collector {
+  tree_file *f;
+  sqlite3_int64 offset;
+} chunk_collector;
+
+static int collect_chunk(unsigned int sequence, unsigned char *data, int data_len, void *ptr){
+  chunk_collector *cc = (chunk_collector *)ptr;
+  tree_file *f = cc->f;
+  size_t capacity = f->chunk_capacity;
+  if( grow((void **)&f->chunks, &capacity, f->chunk_count+1, sizeof(*f->chunks)) ) return 1;
+  f->chunk_capacity = (unsigned int)capacity;
+
+  hashed_chunk *ch = &f->chunks[f->chunk_count++];
+  ch->sequence = sequence;
+  ch->length = data_len;
+  ch->data = NULL;
+  if( data ){
+    ch->data = f->data + cc->offset;
+    if( blake2b(ch->hash, data, NULL, HASH_LENGTH, (uint64_t)data_len, 0) ) return 1;
+    ch->crc = crc32c(data, (size_t)data_len);
+  }
+  cc->offset += data_len;
+  return 0;
+}
+
+/* Read exactly len bytes, or fewer only at the end of the file */
+static ssize_t read_full(int fd, unsigned char *buf, size_t len){
+  size_t done = 0;
+  while( done<len ){
+    ssize_t n = read(fd, buf+done, len-done);
+    if( n<0 && errno==EINTR ) continue;
+    if( n<0 ) return -1;
+    if( n==0 ) break;
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
+/* lstat for a path of any length */
+static int tree_stat(const char *path, struct stat *st){
+  if( strlen(path) < PATH_MAX ) return lstat(path, st);
+  int fd = tree_open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+  if( fd<0 ) return -1;
+  int err = fstat(fd, st);
+  close(fd);
+  return err;
+}
+
+/* Load, hash and chunk a file on a worker. Only the file is written to,
+** apart from charging what it loads against the walk's memory budget.
+** A file that still matches its earlier revision is not opened. */
+static void tree_read_file(tree_walk *w, tree_file *f){
+  struct stat st;
+  if( w->prior ){
+    if( tree_stat(f->path, &st) || !S_ISREG(st.st_mode) ){
+      f->failed = 1;
+      return;
+    }
+    file_meta_from_stat(&f->meta, &st);
+    f->reused = prior_content(w, f->path, &f->meta);
+    if( f->reused ) return;
+  }
+
+  int fd = tree_open(f->path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK);
+  if( fd<0 ){
+    f->failed = 1;
+    return;
+  }
+  if( fstat(fd, &st) || !S_ISREG(st.st_mode) ){
+    /* Replaced by something else since it was listed */
+    close(fd);
+    f->failed = 1;
+    return;
+  }
+  file_meta_from_stat(&f->meta, &st);
+  if( f->meta.size >= INGEST_PIPELINE_MIN ){
+    close(fd);
+    f->large = 1;
+    return;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  f->charge = (size_t)f->meta.size;
+  w->inflight += f->charge;
+  pthread_mutex_unlock(&w->lock);
+
+  f->data = malloc((size_t)f->meta.size + 1);
+  if( !f->data ){
+    close(fd);
+    f->failed = 1;
+    return;
+  }
+  /* One byte more than expected shows whether it grew */
+  ssize_t got = read_full(fd, f->data, (size_t)f->meta.size + 1);
+  close(fd);
+  if( got<0 ){
+    f->failed = 1;
+    return;
+  }
+  if( got > f->meta.size ){
+    /* Changed while being listed; the writer reads it as it is now */
+    free(f->data);
+    f->data = NULL;
+    f->large = 1;
+    return;
+  }
+  f->length = (sqlite3_int64)got;
+
+  blake2b(f->hash, f->data, NULL, HASH_LENGTH, (uint64_t)f->length, 0);
+
+  unsigned char buf[MAX_CHUNK_SIZE];
+  memory_reader m;
+  chunk_collector cc;
+  m.data = f->data;
+  m.length = (size_t)f->length;
+  m.pos = 0;
+  cc.f = f;
+  cc.offset = 0;
+  if( stream_to_chunks(read_from_memory, &m, buf, MAX_CHUNK_SIZE, collect_chunk, &cc) ){
+    f->failed = 1;
+  }
+}
+
+static void *tree_worker(void *arg){
+  tree_walk *w = (tree_walk *)arg;
+  unsigned char *buf = malloc(TREE_DENTS_BUFFER);
+  pthread_mutex_lock(&w->lock);
+  if( !buf ) tree_fail(w);
+  while( !w->stop ){
+    tree_file *f = NULL;
+    /* Sizes are not known until a file is open, so the budget can be
+    ** overrun by one small file per worker */
+    if( w->next_read < w->file_count && (w->listed || !w->deterministic) && w->inflight < TREE_INFLIGHT_MAX ){
+      f = w->files[w->next_read++];
+      f->state = FILE_READING;
+    }
+    if( f ){
+      pthread_mutex_unlock(&w->lock);
+      tree_read_file(w, f);
+      pthread_mutex_lock(&w->lock);
+      f->state = FILE_READY;
+      pthread_cond_broadcast(&w->changed);
+      continue;
+    }
+
+    if( w->dir_count ){
+      char *dir = w->dirs[--w->dir_count];
+      w->dirs_busy++;
+      pthread_mutex_unlock(&w->lock);
+      tree_list_dir(w, dir, buf);
+      pthread_mutex_lock(&w->lock);
+      w->dirs_busy--;
+      if( w->dir_count==0 && w->dirs_busy==0 && !w->listed ){
+        if( w->deterministic ) qsort(w->files, w->file_count, sizeof(*w->files), file_cmp);
+        w->listed = 1;
+      }
+      pthread_cond_broadcast(&w->changed);
+      continue;
+    }
+
+    if( w->listed && w->next_read==w->file_count ) break;
+    pthread_cond_wait(&w->changed, &w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+  free(buf);
+  return NULL;
+}
+
+/* Store one file that a worker has finished with */
+static int tree_write_file(ctx *c, tree_file *f, ctx_tree_stats *stats){
+  if( f->failed ){
+    stats->skipped++;
+    return 0;
+  }
+  if( f->large ){
+    int fd = tree_open(f->path, O_RDONLY);
+    FILE *in = fd<0 ? NULL : fdopen(fd, "rb");
+    if( !in ){
+      if( fd>=0 ) close(fd);
+      stats->skipped++;
+      return 0;
+    }
+    int err = ctx_add_to_snapshot(c, f->path, in);
+    fclose(in);
+    if( err ) return 1;
+    stats->files++;
+    stats->bytes += f->meta.size;
+    return 0;
+  }
+  if( f->reused ){
+    if( ctx_add_known_to_snapshot(c, f->path, f->reused, &f->meta) ) return 1;
+    stats->files++;
+    stats->reused++;
+    stats->bytes += f->meta.size;
+    return 0;
+  }
+  if( ctx_add_hashed_to_snapshot(c, f->path, f->hash, f->length, f->chunks, f->chunk_count, &f->meta) ) return 1;
+  stats->files++;
+  stats->bytes += f->length;
+  return 0;
+}
+
+/* The paths a change journal lists, each once, with subtree set if any of
+** its rows had it */
+typedef struct dirty_path {
+  char *path;
+  int subtree;
+} dirty_path;
+
+typedef struct dirty_set {
+  dirty_path *slots;
+  size_t mask;
+  size_t count;
+  int subtrees; /* Some path has subtree set */
+} dirty_set;
+
+static uint64_t dirty_hash(const char *path, size_t len){
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+  for( i=0; i<len; i++ ){
+    h ^= (unsigned char)path[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* The first len bytes of path, if the set has them as a path */
+static dirty_path *dirty_find(dirty_set *d, const char *path, size_t len){
+  if( !d->slots ) return NULL;
+  size_t i = (size_t)dirty_hash(path, len) & d->mask;
+  while( d->slots[i].path ){
+    if( strncmp(d->slots[i].path, path, len)==0 && d->slots[i].path[len]==0 ) return &d->slots[i];
+    i = (i+1) & d->mask;
+  }
+  return NULL;
+}
+
+static int dirty_add(void *arg, const char *path, int subtree){
+  dirty_set *d = (dirty_set *)arg;
+  if( !path ) return 0;
+  dirty_path *found = dirty_find(d, path, strlen(path));
+  if( found ){
+    found->subtree |= subtree;
+    d->subtrees |= subtree;
+    return 0;
+  }
+  if( (d->count+1)*2 > (d->slots ? d->mask+1 : 0) ){
+    size_t new_size = d->slots ? (d->mask+1)*2 : 256;
+    dirty_path *slots = calloc(new_size, sizeof(*slots));
+    if( !slots ) return 1;
+    size_t j;
+    for( j=0; d->slots && j<=d->mask; j++ ){
+      if( !d->slots[j].path ) continue;
+      size_t k = (size_t)dirty_hash(d->slots[j].path, strlen(d->slots[j].path)) & (new_size-1);
+      while( slots[k].path ) k = (k+1) & (new_size-1);
+      slots[k] = d->slots[j];
+    }
+    free(d->slots);
+    d->slots = slots;
+    d->mask = new_size-1;
+  }
+  size_t i = (size_t)dirty_hash(path, strlen(path)) & d->mask;
+  while( d->slots[i].path ) i = (i+1) & d->mask;
+  if( !(d->slots[i].path = strdup(path)) ) return 1;
+  d->slots[i].subtree = subtree;
+  d->subtrees |= subtree;
+  d->count++;
+  return 0;
+}
+
+/* Whether a directory above path, from root down, is listed as a subtree */
+static int dirty_above(dirty_set *d, const char *path, size_t root_len){
+  if( !d->subtrees ) return 0;
+  size_t len = strlen(path);
+  while( len>root_len ){
+    len--;
+    if( path[len]!='/' ) continue;
+    dirty_path *found = dirty_find(d, path, len>0 ? len : 1);
+    if( found && found->subtree ) return 1;
+  }
+  return 0;
+}
+
+static void dirty_free(dirty_set *d){
+  size_t i;
+  for( i=0; d->slots && i<=d->mask; i++ ) free(d->slots[i].path);
+  free(d->slots);
+}
+
+/* Whether path is root or under it */
+static int tree_within(const char *path, const char *root, size_t root_len){
+  return strncmp(path, root, root_len)==0
+      && (path[root_len]==0 || path[root_len]=='/' || (root_len>0 && root[root_len-1]=='/'));
+}
+
+/* Keep every file under root from the base snapshot that the journal does
+** not list, without visiting it */
+static int tree_carry(ctx *c, sqlite3_int64 base, const char *root, dirty_set *d, ctx_tree_stats *stats){
+  sqlite3_stmt *stmt = c->select_snapshot_files;
+  size_t root_len = strlen(root);
+  int step_result;
+  int err = 0;
+  char *prefix = tree_join(root, "");
+  if( !prefix ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    return 1;
+  }
+
+  c->err_context = "carrying over unchanged files";
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, base))
+   || ctx_collect_err(c, sqlite3_bind_text(stmt, 2, prefix, -1, SQLITE_STATIC))
+  ){
+    err = 1;
+  }
+  while( !err && 0==(err=ctx_collect_err(c, step_result=sqlite3_step(stmt))) && step_result==SQLITE_ROW ){
+    const char *path = (const char *)sqlite3_column_text(stmt, 0);
+    if( dirty_find(d, path, strlen(path)) || dirty_above(d, path, root_len) ) continue;
+    file_meta meta;
+    sqlite3_int64 content_id = sqlite3_column_int64(stmt, 2);
+    meta.size = sqlite3_column_type(stmt, 3)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 3);
+    meta.mtime_ns = sqlite3_column_type(stmt, 4)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 4);
+    meta.ctime_ns = sqlite3_column_type(stmt, 5)==SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 5);
+    meta.has_inode = sqlite3_column_type(stmt, 6)!=SQLITE_NULL;
+    meta.inode = sqlite3_column_int64(stmt, 6);
+    meta.device = sqlite3_column_int64(stmt, 7);
+    if( ctx_add_revision(c, sqlite3_column_int64(stmt, 1), content_id, &meta)==0 ){
+      err = 1;
+      break;
+    }
+    stats->files++;
+    stats->carried++;
+    if( meta.size>0 ) stats->bytes += meta.size;
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  free(prefix);
+  return err;
+}
+
+/* Read the journal and, if it can be trusted, carry the unchanged files
+** over and queue the listed ones: files to read and directories to walk.
+** Sets *incremental to 0, with nothing done, when the whole tree must be
+** walked instead. */
+static int tree_from_journal(ctx *c, tree_walk *w, const char *root, sqlite3 *j, const char *journal_path,
+                             sqlite3_int64 *upto, int *incremental, ctx_tree_stats *stats){
+  dirty_set d;
+  sqlite3_int64 base;
+  size_t root_len = strlen(root);
+  size_t i;
+  int err = 1;
+
+  memset(&d, 0, sizeof(d));
+  *incremental = 0;
+  if( journal_read(c, j, journal_path, root, &base, upto, dirty_add, &d) ){
+    if( c->errtype==CTX_ERR_NONE ) ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    goto out;
+  }
+  dirty_path *at_root = dirty_find(&d, root, root_len);
+  if( base==0 || (at_root && at_root->subtree) ){
+    err = 0;
+    goto out;
+  }
+
+  *incremental = 1;
+  if( tree_carry(c, base, root, &d, stats) ) goto out;
+
+  /* Paths under a listed directory are found by walking it */
+  for( i=0; i<=d.mask && d.slots; i++ ){
+    const char *path = d.slots[i].path;
+    struct stat st;
+    if( !path || !tree_within(path, root, root_len) || dirty_above(&d, path, root_len) ) continue;
+    if( tree_stat(path, &st) ) continue; /* Gone, so left out */
+    if( S_ISDIR(st.st_mode) && d.slots[i].subtree ){
+      if( grow((void **)&w->dirs, &w->dir_capacity, w->dir_count+1, sizeof(*w->dirs)) ) goto no_memory;
+      if( !(w->dirs[w->dir_count] = strdup(path)) ) goto no_memory;
+      w->dir_count++;
+    }else if( S_ISREG(st.st_mode) ){
+      tree_file *f = calloc(1, sizeof(*f));
+      if( !f || grow((void **)&w->files, &w->file_capacity, w->file_count+1, sizeof(*w->files)) ){
+        free(f);
+        goto no_memory;
+      }
+      if( !(f->path = strdup(path)) ){
+        free(f);
+        goto no_memory;
+      }
+      w->files[w->file_count++] = f;
+    }
+  }
+  if( w->dir_count==0 ){
+    /* Nothing left to list, which the workers would otherwise notice */
+    if( w->deterministic ) qsort(w->files, w->file_count, sizeof(*w->files), file_cmp);
+    w->listed = 1;
+  }
+  err = 0;
+  goto out;
+
+no_memory:
+  ctx_errtype(c, CTX_ERR_NO_MEMORY);
+out:
+  dirty_free(&d);
+  return err;
+}
+
+int ctx_snapshot_tree(ctx *c, const char *root, const ctx_tree_opts *opts, ctx_tree_stats *stats){
+  ctx_tree_opts default_opts;
+  ctx_tree_stats ignored;
+  tree_walk w;
+  pthread_t *threads = NULL;
+  unsigned int thread_count, started = 0;
+  tree_file *batch[TREE_WRITE_BATCH];
+  sqlite3 *j = NULL;
+  char *journal_root_path = NULL;
+  sqlite3_int64 upto = 0;
+  int incremental = 0;
+  size_t i;
+  int err = 1;
+
+  if( !opts ){
+    memset(&default_opts, 0, sizeof(default_opts));
+    opts = &default_opts;
+  }
+  if( !stats ) stats = &ignored;
+  memset(stats, 0, sizeof(*stats));
+  memset(&w, 0, sizeof(w));
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.changed, NULL);
+  w.deterministic = opts->deterministic;
+  w.reuse = c->reuse;
+
+  struct stat st;
+  if( stat(root, &st) || !S_ISDIR(st.st_mode) ){
+    ctx_errmsg(c, sqlite3_mprintf("%s is not a directory", root));
+    goto out;
+  }
+
+  if( opts->journal ){
+    journal_root_path = journal_root(root);
+    if( !journal_root_path ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      goto out;
+    }
+    root = journal_root_path;
+    j = journal_open(c, opts->journal);
+    if( !j || tree_from_journal(c, &w, root, j, opts->journal, &upto, &incremental, stats) ) goto out;
+  }
+  /* The files a journal lists have changed, so an earlier revision would
+  ** seldom match */
+  if( !incremental && w.reuse!=CTX_REUSE_NEVER && prior_load(c, &w, root) ) goto out;
+
+  thread_count = opts->threads ? opts->threads : pool_default_threads();
+  threads = calloc(thread_count, sizeof(*threads));
+  if( !threads ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    goto out;
+  }
+  if( !incremental ){
+    w.dirs = malloc(sizeof(*w.dirs));
+    if( !w.dirs || !(w.dirs[0] = strdup(root)) ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      goto out;
+    }
+    w.dir_count = 1;
+    w.dir_capacity = 1;
+  }
+
+  for( started=0; started<thread_count; started++ ){
+    if( pthread_create(&threads[started], NULL, tree_worker, &w) ) break;
+  }
+  if( started==0 ){
+    ctx_errmsg(c, sqlite3_mprintf("Could not start the snapshot threads"));
+    goto out;
+  }
+
+  /* The writer: store ready files in list order */
+  while( 1 ){
+    size_t n = 0;
+    pthread_mutex_lock(&w.lock);
+    while( !w.stop
+        && !(w.next_write < w.file_count && w.files[w.next_write]->state==FILE_READY)
+        && !(w.listed && w.next_write==w.file_count)
+    ){
+      pthread_cond_wait(&w.changed, &w.lock);
+    }
+    while( !w.stop && n<TREE_WRITE_BATCH && w.next_write+n < w.file_count && w.files[w.next_write+n]->state==FILE_READY ){
+      batch[n] = w.files[w.next_write+n];
+      w.files[w.next_write+n] = NULL;
+      n++;
+    }
+    pthread_mutex_unlock(&w.lock);
+    if( n==0 ) break;
+
+    size_t released = 0;
+    int failed = 0;
+    for( i=0; i<n; i++ ){
+      if( !failed ) failed = tree_write_file(c, batch[i], stats);
+      released += batch[i]->charge;
+      tree_file_free(batch[i]);
+    }
+
+    pthread_mutex_lock(&w.lock);
+    w.next_write += n;
+    w.inflight -= released;
+    if( failed ) w.stop = 1;
+    pthread_cond_broadcast(&w.changed);
+    pthread_mutex_unlock(&w.lock);
+    if( failed ) break;
+  }
+
+  pthread_mutex_lock(&w.lock);
+  w.stop = 1;
+  pthread_cond_broadcast(&w.changed);
+  pthread_mutex_unlock(&w.lock);
+  for( i=0; i<started; i++ ) pthread_join(threads[i], NULL);
+
+  stats->skipped += w.skipped;
+  if( w.no_memory ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+  }else if( c->errtype==CTX_ERR_NONE ){
+    err = 0;
+  }
+  /* Everything up to upto is in the open snapshot now, but the journal
+  ** is only taken once ctx_finish_snapshot has committed it */
+  if( !err && j ){
+    free(c->journal_pending);
+    c->journal_upto = upto;
+    c->journal_pending = strdup(opts->journal);
+    if( !c->journal_pending ){
+      ctx_errtype(c, CTX_ERR_NO_MEMORY);
+      err = 1;
+    }
+  }
+
+out:
+  for( i=0; i<w.dir_count; i++ ) free(w.dirs[i]);
+  for( i=w.next_write; i<w.file_count; i++ ) tree_file_free(w.files[i]);
+  free(w.dirs);
+  free(w.files);
+  free(w.prior);
+  free(threads);
+  if( j ) journal_close(j);
+  free(journal_root_path);
+  pthread_cond_destroy(&w.changed);
+  pthread_mutex_destroy(&w.lock);
+  return err;
+}
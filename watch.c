@@ -0,0 +1,807 @@
+/*
+    Copyright 2014 Peter Reid
+
+    This file is part of freezefile.
+
+    Freezefile is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Freezefile is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Freezefile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE /* open_by_handle_at */
+#include "freezefile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
+
+/* The change journal. A watcher appends every path under its root that
+** changes, and a snapshot of that root reads them back, visits only those
+** paths and keeps the rest of the tree as it was in the snapshot that last
+** took the journal. The journal is an SQLite database of its own, in WAL
+** mode, so the watcher can keep writing while a snapshot reads it.
+**
+** A row with subtree set stands for everything under its path: a
+** directory that was created, removed or moved, or the whole root when
+** the watcher has just started or the kernel dropped events. The watcher
+** holds an exclusive flock on the journal for as long as it runs; a
+** journal that nobody holds may have missed changes and is not trusted.
+**
+** A snapshot only takes the journal once it is committed. Its id alone
+** could name another snapshot later, since the id of one rolled back is
+** handed out again, so its time is kept beside it and both must match.
+*/
+
+static int journal_exec(ctx *c, sqlite3 *j, const char *sql){
+  char *errmsg = NULL;
+  if( sqlite3_exec(j, sql, NULL, NULL, &errmsg)!=SQLITE_OK ){
+    ctx_errmsg(c, sqlite3_mprintf("Journal error: %s", errmsg ? errmsg : sqlite3_errmsg(j)));
+    sqlite3_free(errmsg);
+    return 1;
+  }
+  return 0;
+}
+
+static int journal_prepare(ctx *c, sqlite3 *j, const char *sql, sqlite3_stmt **stmt){
+  if( sqlite3_prepare_v2(j, sql, -1, stmt, NULL)!=SQLITE_OK ){
+    ctx_errmsg(c, sqlite3_mprintf("Journal error: %s", sqlite3_errmsg(j)));
+    return 1;
+  }
+  return 0;
+}
+
+static int journal_step_done(ctx *c, sqlite3 *j, sqlite3_stmt *stmt){
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if( rc!=SQLITE_DONE && rc!=SQLITE_ROW ){
+    ctx_errmsg(c, sqlite3_mprintf("Journal error: %s", sqlite3_errmsg(j)));
+    return 1;
+  }
+  return 0;
+}
+
+sqlite3 *journal_open(ctx *c, const char *path){
+  sqlite3 *j = NULL;
+  if( sqlite3_open_v2(path, &j, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL)!=SQLITE_OK ){
+    ctx_errmsg(c, sqlite3_mprintf("Can't open journal %s: %s", path, j ? sqlite3_errmsg(j) : "out of memory"));
+    sqlite3_close(j);
+    return NULL;
+  }
+  sqlite3_busy_timeout(j, 5000);
+  if( journal_exec(c, j, "PRAGMA journal_mode=WAL")
+   || journal_exec(c, j, "CREATE TABLE IF NOT EXISTS dirty"
+                         "(seq INTEGER PRIMARY KEY AUTOINCREMENT"
+                         ",path TEXT NOT NULL"
+                         ",subtree INT NOT NULL DEFAULT 0" /* Everything under path may have changed */
+                         ")")
+   || journal_exec(c, j, "CREATE TABLE IF NOT EXISTS journal_state"
+                         "(name TEXT PRIMARY KEY" /* root, repository, base_snapshot or base_time */
+                         ",value"
+                         ")")
+  ){
+    sqlite3_close(j);
+    return NULL;
+  }
+  return j;
+}
+
+void journal_close(sqlite3 *j){
+  sqlite3_close(j);
+}
+
+/* A root without trailing slashes, so every side spells paths alike */
+char *journal_root(const char *root){
+  size_t len = strlen(root);
+  while( len>1 && root[len-1]=='/' ) len--;
+  char *r = malloc(len+1);
+  if( !r ) return NULL;
+  memcpy(r, root, len);
+  r[len] = 0;
+  return r;
+}
+
+/* The time snapshot_id was taken, sqlite3_malloc'd, or NULL if it is gone */
+static int journal_snapshot_time(ctx *c, sqlite3_int64 snapshot_id, char **time){
+  sqlite3_stmt *stmt = c->select_snapshot_time;
+  int step_result;
+
+  *time = NULL;
+  c->err_context = "finding the journal's snapshot";
+  if( ctx_collect_err(c, sqlite3_reset(stmt))
+   || ctx_collect_err(c, sqlite3_bind_int64(stmt, 1, snapshot_id))
+   || ctx_collect_err(c, step_result=sqlite3_step(stmt))
+  ){
+    return 1;
+  }
+  if( step_result==SQLITE_ROW && sqlite3_column_type(stmt, 0)!=SQLITE_NULL ){
+    *time = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(stmt, 0));
+    if( !*time ) ctx_errtype(c, CTX_ERR_NO_MEMORY);
+  }
+  sqlite3_reset(stmt);
+  return c->errtype!=CTX_ERR_NONE;
+}
+
+/* Whether a watcher holds the journal at path */
+static int journal_watched(const char *path){
+  int fd = open(path, O_RDONLY|O_CLOEXEC);
+  if( fd<0 ) return 0;
+  int held = flock(fd, LOCK_SH|LOCK_NB)!=0 && errno==EWOULDBLOCK;
+  close(fd);
+  return held;
+}
+
+int journal_read(ctx *c, sqlite3 *j, const char *journal_path, const char *root, sqlite3_int64 *base, sqlite3_int64 *upto,
+                 int (*each)(void *arg, const char *path, int subtree), void *arg){
+  sqlite3_stmt *state = NULL;
+  sqlite3_stmt *rows = NULL;
+  int err = 1;
+  int watched_root = 0;
+  int same_repository = 0;
+  char *base_time = NULL, *snapshot_time = NULL;
+  int step_result;
+
+  *base = 0;
+  *upto = 0;
+  /* One read transaction, so the rows match the state */
+  if( journal_exec(c, j, "BEGIN") ) return 1;
+  if( journal_prepare(c, j, "SELECT name, value FROM journal_state", &state)
+   || journal_prepare(c, j, "SELECT seq, path, subtree FROM dirty ORDER BY seq", &rows)
+  ){
+    goto out;
+  }
+  while( (step_result = sqlite3_step(state))==SQLITE_ROW ){
+    const char *name = (const char *)sqlite3_column_text(state, 0);
+    const char *value = (const char *)sqlite3_column_text(state, 1);
+    if( !name || !value ) continue;
+    if( strcmp(name, "root")==0 ) watched_root = strcmp(value, root)==0;
+    if( strcmp(name, "repository")==0 ) same_repository = strcmp(value, ctx_path(c))==0;
+    if( strcmp(name, "base_snapshot")==0 ) *base = sqlite3_column_int64(state, 1);
+    if( strcmp(name, "base_time")==0 ){
+      sqlite3_free(base_time);
+      base_time = sqlite3_mprintf("%s", value);
+      if( !base_time ){
+        ctx_errtype(c, CTX_ERR_NO_MEMORY);
+        goto out;
+      }
+    }
+  }
+  if( step_result!=SQLITE_DONE ){
+    ctx_errmsg(c, sqlite3_mprintf("Journal error: %s", sqlite3_errmsg(j)));
+    goto out;
+  }
+  if( !watched_root || !same_repository || !journal_watched(journal_path) ) *base = 0;
+  /* The snapshot may have been deleted since */
+  if( *base && journal_snapshot_time(c, *base, &snapshot_time) ) goto out;
+  if( !base_time || !snapshot_time || strcmp(base_time, snapshot_time)!=0 ) *base = 0;
+
+  while( (step_result = sqlite3_step(rows))==SQLITE_ROW ){
+    *upto = sqlite3_column_int64(rows, 0);
+    if( *base==0 ) continue;
+    if( each(arg, (const char *)sqlite3_column_text(rows, 1), sqlite3_column_int(rows, 2)) ) goto out;
+  }
+  if( step_result!=SQLITE_DONE ){
+    ctx_errmsg(c, sqlite3_mprintf("Journal error: %s", sqlite3_errmsg(j)));
+    goto out;
+  }
+  err = 0;
+
+out:
+  sqlite3_free(base_time);
+  sqlite3_free(snapshot_time);
+  sqlite3_finalize(state);
+  sqlite3_finalize(rows);
+  journal_exec(c, j, "COMMIT");
+  return err;
+}
+
+int journal_taken(ctx *c, sqlite3 *j, sqlite3_int64 upto, sqlite3_int64 snapshot_id){
+  sqlite3_stmt *clear = NULL;
+  sqlite3_stmt *set = NULL;
+  char *time = NULL;
+  int err = 1;
+
+  if( journal_snapshot_time(c, snapshot_id, &time) ) return 1;
+  if( !time ){
+    ctx_errmsg(c, sqlite3_mprintf("There is no snapshot %lld", snapshot_id));
+    return 1;
+  }
+  if( journal_exec(c, j, "BEGIN IMMEDIATE") ){
+    sqlite3_free(time);
+    return 1;
+  }
+  if( journal_prepare(c, j, "DELETE FROM dirty WHERE seq <= ?", &clear)
+   || journal_prepare(c, j, "INSERT OR REPLACE INTO journal_state(name, value) VALUES (?, ?)", &set)
+  ){
+    goto out;
+  }
+  sqlite3_bind_int64(clear, 1, upto);
+  if( journal_step_done(c, j, clear) ) goto out;
+  sqlite3_bind_text(set, 1, "repository", -1, SQLITE_STATIC);
+  sqlite3_bind_text(set, 2, ctx_path(c), -1, SQLITE_TRANSIENT);
+  if( journal_step_done(c, j, set) ) goto out;
+  sqlite3_bind_text(set, 1, "base_snapshot", -1, SQLITE_STATIC);
+  sqlite3_bind_int64(set, 2, snapshot_id);
+  if( journal_step_done(c, j, set) ) goto out;
+  sqlite3_bind_text(set, 1, "base_time", -1, SQLITE_STATIC);
+  sqlite3_bind_text(set, 2, time, -1, SQLITE_STATIC);
+  if( journal_step_done(c, j, set) ) goto out;
+  err = 0;
+
+out:
+  sqlite3_finalize(clear);
+  sqlite3_finalize(set);
+  sqlite3_free(time);
+  if( err ){
+    journal_exec(c, j, "ROLLBACK");
+    return 1;
+  }
+  return journal_exec(c, j, "COMMIT");
+}
+
+int journal_confirm(ctx *c, sqlite3_int64 snapshot_id){
+  sqlite3 *j;
+  int err;
+
+  if( !c->journal_pending ) return 0;
+  j = journal_open(c, c->journal_pending);
+  if( !j ) return 1;
+  err = journal_taken(c, j, c->journal_upto, snapshot_id);
+  journal_close(j);
+  return err;
+}
+
+#ifdef __linux__
+/* The watcher collects paths in memory and writes them out at most once
+** every WATCH_FLUSH_MS, or sooner when WATCH_FLUSH_PATHS have piled up,
+** with repeats of the same path written once. */
+#define WATCH_FLUSH_MS 1000
+#define WATCH_FLUSH_PATHS 4096
+#define WATCH_EVENT_BUFFER (64*1024)
+
+#define WATCH_INOTIFY_MASK (IN_CREATE|IN_DELETE|IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO \
+                            |IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK)
+#define WATCH_FANOTIFY_MASK (FAN_CREATE|FAN_DELETE|FAN_MODIFY|FAN_CLOSE_WRITE|FAN_ATTRIB \
+                             |FAN_MOVED_FROM|FAN_MOVED_TO|FAN_ONDIR)
+#define WATCH_TREE_EVENTS (FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO)
+
+typedef struct pending_path {
+  char *path;
+  int subtree;
+} pending_path;
+
+typedef struct watcher {
+  ctx *c;
+  sqlite3 *journal;
+  sqlite3_stmt *insert_dirty;
+  char *root;
+
+  pending_path *pending;
+  size_t pending_count;
+  size_t pending_capacity;
+  sqlite3_int64 last_flush;
+
+  /* inotify: one watch per directory, and each watch's path */
+  int inotify_fd;
+  char **wd_paths;
+  size_t wd_capacity;
+
+  /* fanotify: one mark for the whole filesystem, whose events name a
+  ** directory by handle; the last one resolved is remembered */
+  int fanotify_fd;
+  int mount_fd;
+  char *root_real;
+  unsigned char *last_handle;
+  size_t last_handle_bytes;
+  char *last_dir;
+} watcher;
+
+static char *watch_join(const char *dir, const char *name){
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  char *path = malloc(dir_len + name_len + 2);
+  if( !path ) return NULL;
+  memcpy(path, dir, dir_len);
+  if( dir_len==0 || dir[dir_len-1]!='/' ) path[dir_len++] = '/';
+  memcpy(path+dir_len, name, name_len+1);
+  return path;
+}
+
+/* Whether path is dir or somewhere under it */
+static int path_within(const char *path, const char *dir){
+  size_t n = strlen(dir);
+  return strncmp(path, dir, n)==0 && (path[n]==0 || path[n]=='/' || (n>0 && dir[n-1]=='/'));
+}
+
+/* Takes ownership of path */
+static int watch_note(watcher *w, char *path, int subtree){
+  if( !path ) goto no_memory;
+  if( w->pending_count==w->pending_capacity ){
+    size_t n = w->pending_capacity ? w->pending_capacity*2 : 64;
+    pending_path *p = realloc(w->pending, n*sizeof(*p));
+    if( !p ){
+      free(path);
+      goto no_memory;
+    }
+    w->pending = p;
+    w->pending_capacity = n;
+  }
+  w->pending[w->pending_count].path = path;
+  w->pending[w->pending_count].subtree = subtree;
+  w->pending_count++;
+  return 0;
+
+no_memory:
+  ctx_errtype(w->c, CTX_ERR_NO_MEMORY);
+  return 1;
+}
+
+static int watch_note_copy(watcher *w, const char *path, int subtree){
+  return watch_note(w, strdup(path), subtree);
+}
+
+static int pending_cmp(const void *a, const void *b){
+  return strcmp(((const pending_path *)a)->path, ((const pending_path *)b)->path);
+}
+
+static int watch_flush(watcher *w){
+  size_t i;
+  int err = 0;
+  if( w->pending_count==0 ) return 0;
+  qsort(w->pending, w->pending_count, sizeof(*w->pending), pending_cmp);
+  if( journal_exec(w->c, w->journal, "BEGIN IMMEDIATE") ) return 1;
+  for( i=0; i<w->pending_count && !err; ){
+    size_t same = i;
+    int subtree = 0;
+    while( same<w->pending_count && strcmp(w->pending[same].path, w->pending[i].path)==0 ){
+      subtree |= w->pending[same].subtree;
+      same++;
+    }
+    sqlite3_bind_text(w->insert_dirty, 1, w->pending[i].path, -1, SQLITE_STATIC);
+    sqlite3_bind_int(w->insert_dirty, 2, subtree);
+    err = journal_step_done(w->c, w->journal, w->insert_dirty);
+    i = same;
+  }
+  sqlite3_clear_bindings(w->insert_dirty);
+  if( err || journal_exec(w->c, w->journal, "COMMIT") ){
+    journal_exec(w->c, w->journal, "ROLLBACK");
+    return 1;
+  }
+  for( i=0; i<w->pending_count; i++ ) free(w->pending[i].path);
+  w->pending_count = 0;
+  w->last_flush = ctx_now_ms();
+  return 0;
+}
+
+/* Record that the watcher covers root, and that nothing under it can be
+** trusted yet */
+static int watch_mark_root(watcher *w){
+  sqlite3_stmt *set = NULL;
+  int err = 1;
+  if( journal_exec(w->c, w->journal, "BEGIN IMMEDIATE") ) return 1;
+  if( journal_prepare(w->c, w->journal, "INSERT OR REPLACE INTO journal_state(name, value) VALUES ('root', ?)", &set) ) goto out;
+  sqlite3_bind_text(set, 1, w->root, -1, SQLITE_STATIC);
+  if( journal_step_done(w->c, w->journal, set) ) goto out;
+  sqlite3_bind_text(w->insert_dirty, 1, w->root, -1, SQLITE_STATIC);
+  sqlite3_bind_int(w->insert_dirty, 2, 1);
+  if( journal_step_done(w->c, w->journal, w->insert_dirty) ) goto out;
+  err = 0;
+out:
+  sqlite3_finalize(set);
+  sqlite3_clear_bindings(w->insert_dirty);
+  if( err ){
+    journal_exec(w->c, w->journal, "ROLLBACK");
+    return 1;
+  }
+  return journal_exec(w->c, w->journal, "COMMIT");
+}
+
+/* Watch one directory. Only running out of watches is an error; a
+** directory that has gone or cannot be read is left alone. */
+static int watch_add_dir(watcher *w, const char *path){
+  int wd = inotify_add_watch(w->inotify_fd, path, WATCH_INOTIFY_MASK);
+  if( wd<0 ){
+    if( errno==ENOSPC ){
+      ctx_errmsg(w->c, sqlite3_mprintf("Out of inotify watches at %s; raise fs.inotify.max_user_watches", path));
+      return 1;
+    }
+    return 0;
+  }
+  if( (size_t)wd >= w->wd_capacity ){
+    size_t n = w->wd_capacity ? w->wd_capacity : 1024;
+    while( n <= (size_t)wd ) n *= 2;
+    char **paths = realloc(w->wd_paths, n*sizeof(*paths));
+    if( !paths ) goto no_memory;
+    memset(paths+w->wd_capacity, 0, (n-w->wd_capacity)*sizeof(*paths));
+    w->wd_paths = paths;
+    w->wd_capacity = n;
+  }
+  /* The same directory again, perhaps under a new name */
+  char *copy = strdup(path);
+  if( !copy ) goto no_memory;
+  free(w->wd_paths[wd]);
+  w->wd_paths[wd] = copy;
+  return 0;
+
+no_memory:
+  ctx_errtype(w->c, CTX_ERR_NO_MEMORY);
+  return 1;
+}
+
+/* Watch top and every directory under it */
+static int watch_add_tree(watcher *w, const char *top){
+  char **stack = NULL;
+  size_t count = 0, capacity = 0;
+  int err = 0;
+  char *dir = strdup(top);
+
+  if( !dir ) err = 1;
+  while( dir && !err ){
+    err = watch_add_dir(w, dir);
+    DIR *d = err ? NULL : opendir(dir);
+    struct dirent *e;
+    while( d && !err && (e = readdir(d))!=NULL ){
+      if( e->d_name[0]=='.' && (e->d_name[1]==0 || (e->d_name[1]=='.' && e->d_name[2]==0)) ) continue;
+      int is_dir = e->d_type==DT_DIR;
+      if( e->d_type==DT_UNKNOWN ){
+        struct stat st;
+        is_dir = fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW)==0 && S_ISDIR(st.st_mode);
+      }
+      if( !is_dir ) continue;
+      if( count==capacity ){
+        size_t n = capacity ? capacity*2 : 64;
+        char **s = realloc(stack, n*sizeof(*s));
+        if( !s ){
+          err = 1;
+          break;
+        }
+        stack = s;
+        capacity = n;
+      }
+      if( !(stack[count] = watch_join(dir, e->d_name)) ){
+        err = 1;
+        break;
+      }
+      count++;
+    }
+    if( d ) closedir(d);
+    free(dir);
+    dir = count ? stack[--count] : NULL;
+  }
+  free(dir);
+  while( count ) free(stack[--count]);
+  free(stack);
+  if( err && w->c->errtype==CTX_ERR_NONE ) ctx_errtype(w->c, CTX_ERR_NO_MEMORY);
+  return err;
+}
+
+/* Stop watching a directory that has moved away, and everything under it */
+static void watch_forget_tree(watcher *w, const char *top){
+  size_t wd;
+  for( wd=0; wd<w->wd_capacity; wd++ ){
+    if( w->wd_paths[wd] && path_within(w->wd_paths[wd], top) ){
+      inotify_rm_watch(w->inotify_fd, (int)wd);
+      free(w->wd_paths[wd]);
+      w->wd_paths[wd] = NULL;
+    }
+  }
+}
+
+static int watch_inotify_event(watcher *w, const struct inotify_event *ev){
+  if( ev->mask & IN_Q_OVERFLOW ) return watch_note_copy(w, w->root, 1);
+  if( ev->wd<0 || (size_t)ev->wd>=w->wd_capacity || !w->wd_paths[ev->wd] ) return 0;
+  char *dir = w->wd_paths[ev->wd];
+  if( ev->mask & IN_IGNORED ){
+    free(dir);
+    w->wd_paths[ev->wd] = NULL;
+    return 0;
+  }
+  if( ev->len==0 || ev->name[0]==0 ){
+    /* About a watched directory itself, which its parent's watch reports
+    ** as well, unless it is the root */
+    if( (ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) && strcmp(dir, w->root)==0 ){
+      return watch_note_copy(w, w->root, 1);
+    }
+    return 0;
+  }
+
+  char *path = watch_join(dir, ev->name);
+  if( !path ) return watch_note(w, NULL, 0);
+  if( ev->mask & IN_ISDIR ){
+    if( ev->mask & IN_MOVED_FROM ) watch_forget_tree(w, path);
+    if( ev->mask & (IN_CREATE|IN_MOVED_TO) ){
+      /* Whatever it held before its watch was added is covered by the
+      ** subtree row */
+      if( watch_add_tree(w, path) ){
+        free(path);
+        return 1;
+      }
+    }
+    if( ev->mask & (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO) ) return watch_note(w, path, 1);
+    free(path);
+    return 0;
+  }
+  return watch_note(w, path, 0);
+}
+
+static int watch_inotify_read(watcher *w, char *buf){
+  ssize_t n = read(w->inotify_fd, buf, WATCH_EVENT_BUFFER);
+  if( n<0 ) return errno==EAGAIN || errno==EINTR ? 0 : -1;
+  ssize_t pos = 0;
+  while( pos<n ){
+    const struct inotify_event *ev = (const struct inotify_event *)(buf+pos);
+    if( watch_inotify_event(w, ev) ) return 1;
+    pos += sizeof(*ev) + ev->len;
+  }
+  return 0;
+}
+
+/* Whether another filesystem is mounted somewhere under dir, which a
+** filesystem-wide mark on dir's filesystem would not see */
+static int has_submounts(const char *dir){
+  FILE *f = fopen("/proc/self/mountinfo", "r");
+  char line[4096];
+  int found = 0;
+  if( !f ) return 1;
+  while( !found && fgets(line, sizeof(line), f) ){
+    /* The fifth field is the mount point, with spaces and the like escaped
+    ** in octal */
+    char *field = line;
+    int i;
+    for( i=0; i<4 && field; i++ ){
+      field = strchr(field, ' ');
+      if( field ) field++;
+    }
+    if( !field ) continue;
+    char point[4096];
+    size_t len = 0;
+    while( *field && *field!=' ' && len<sizeof(point)-1 ){
+      if( field[0]=='\\' && field[1] && field[2] && field[3] ){
+        point[len++] = (char)(((field[1]-'0')<<6) | ((field[2]-'0')<<3) | (field[3]-'0'));
+        field += 4;
+      }else{
+        point[len++] = *field++;
+      }
+    }
+    point[len] = 0;
+    found = strcmp(point, dir)!=0 && path_within(point, dir);
+  }
+  fclose(f);
+  return found;
+}
+
+/* Set up fanotify on root's filesystem, returning 0 if it is not allowed
+** or not supported, so the caller falls back to inotify */
+static int watch_fanotify_start(watcher *w){
+  w->root_real = realpath(w->root, NULL);
+  if( !w->root_real || has_submounts(w->root_real) ) return 0;
+  w->fanotify_fd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK|FAN_REPORT_DFID_NAME, O_RDONLY|O_LARGEFILE);
+  if( w->fanotify_fd<0 ) return 0;
+  w->mount_fd = open(w->root_real, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if( w->mount_fd<0 ) goto fail;
+
+  /* Handles are only of use if they can be opened again */
+  struct {
+    struct file_handle h;
+    unsigned char space[MAX_HANDLE_SZ];
+  } handle;
+  int mount_id;
+  handle.h.handle_bytes = MAX_HANDLE_SZ;
+  if( name_to_handle_at(AT_FDCWD, w->root_real, &handle.h, &mount_id, 0) ) goto fail;
+  int probe = open_by_handle_at(w->mount_fd, &handle.h, O_PATH|O_CLOEXEC);
+  if( probe<0 ) goto fail;
+  close(probe);
+
+  if( fanotify_mark(w->fanotify_fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, WATCH_FANOTIFY_MASK, AT_FDCWD, w->root_real) ) goto fail;
+  return 1;
+
+fail:
+  if( w->mount_fd>=0 ) close(w->mount_fd);
+  close(w->fanotify_fd);
+  w->mount_fd = -1;
+  w->fanotify_fd = -1;
+  return 0;
+}
+
+/* The path of the directory a handle refers to, or NULL if it is gone */
+static const char *watch_resolve(watcher *w, struct file_handle *h, int *failed){
+  size_t bytes = sizeof(*h) + h->handle_bytes;
+  if( w->last_dir && bytes==w->last_handle_bytes && memcmp(w->last_handle, h, bytes)==0 ) return w->last_dir;
+
+  int fd = open_by_handle_at(w->mount_fd, h, O_PATH|O_CLOEXEC);
+  if( fd<0 ){
+    *failed = errno!=ESTALE && errno!=ENOENT;
+    return NULL;
+  }
+  char link[64];
+  char *dir = malloc(PATH_MAX);
+  unsigned char *copy = malloc(bytes);
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = dir ? readlink(link, dir, PATH_MAX-1) : -1;
+  close(fd);
+  if( n<0 || !copy ){
+    free(dir);
+    free(copy);
+    *failed = 1;
+    return NULL;
+  }
+  dir[n] = 0;
+  memcpy(copy, h, bytes);
+  free(w->last_dir);
+  free(w->last_handle);
+  w->last_dir = dir;
+  w->last_handle = copy;
+  w->last_handle_bytes = bytes;
+  return dir;
+}
+
+static int watch_fanotify_event(watcher *w, const struct fanotify_event_metadata *m){
+  if( m->mask & FAN_Q_OVERFLOW ) return watch_note_copy(w, w->root, 1);
+  if( m->event_len < sizeof(*m) + sizeof(struct fanotify_event_info_fid) ) return 0;
+  struct fanotify_event_info_fid *info = (struct fanotify_event_info_fid *)(m+1);
+  if( info->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID_NAME ) return 0;
+  struct file_handle *h = (struct file_handle *)info->handle;
+  const char *name = (const char *)h->f_handle + h->handle_bytes;
+  int ondir = (m->mask & FAN_ONDIR)!=0;
+  if( name[0]==0 || (name[0]=='.' && name[1]==0) ) return 0;
+
+  int failed = 0;
+  const char *dir = watch_resolve(w, h, &failed);
+  /* A directory moved or removed anywhere may have been the one remembered */
+  if( ondir && (m->mask & (FAN_MOVED_FROM|FAN_MOVED_TO|FAN_DELETE)) ){
+    free(w->last_dir);
+    w->last_dir = NULL;
+  }
+  if( !dir ) return failed ? watch_note_copy(w, w->root, 1) : 0;
+
+  char *real = watch_join(dir, name);
+  if( !real ) return watch_note(w, NULL, 0);
+  if( !path_within(real, w->root_real) ){
+    free(real);
+    return 0;
+  }
+  char *path = watch_join(w->root, real + strlen(w->root_real) + (real[strlen(w->root_real)]=='/'));
+  int at_root = strcmp(real, w->root_real)==0;
+  free(real);
+  if( !path ) return watch_note(w, NULL, 0);
+  if( at_root ){
+    free(path);
+    return watch_note_copy(w, w->root, 1);
+  }
+  if( ondir ){
+    if( m->mask & WATCH_TREE_EVENTS ) return watch_note(w, path, 1);
+    free(path);
+    return 0;
+  }
+  return watch_note(w, path, 0);
+}
+
+static int watch_fanotify_read(watcher *w, char *buf){
+  ssize_t n = read(w->fanotify_fd, buf, WATCH_EVENT_BUFFER);
+  if( n<0 ) return errno==EAGAIN || errno==EINTR ? 0 : -1;
+  const struct fanotify_event_metadata *m = (const struct fanotify_event_metadata *)buf;
+  while( FAN_EVENT_OK(m, n) ){
+    if( m->vers!=FANOTIFY_METADATA_VERSION ){
+      ctx_errmsg(w->c, sqlite3_mprintf("Unexpected fanotify version %d", m->vers));
+      return 1;
+    }
+    if( m->fd>=0 ) close(m->fd);
+    if( watch_fanotify_event(w, m) ) return 1;
+    m = FAN_EVENT_NEXT(m, n);
+  }
+  return 0;
+}
+
+int ctx_watch(ctx *c, const char *root, const char *journal_path, volatile int *stop){
+  watcher w;
+  int lock_fd = -1;
+  char *buf = NULL;
+  int err = 1;
+  size_t i;
+
+  memset(&w, 0, sizeof(w));
+  w.c = c;
+  w.inotify_fd = -1;
+  w.fanotify_fd = -1;
+  w.mount_fd = -1;
+  w.root = journal_root(root);
+  buf = malloc(WATCH_EVENT_BUFFER);
+  if( !w.root || !buf ){
+    ctx_errtype(c, CTX_ERR_NO_MEMORY);
+    goto out;
+  }
+  struct stat st;
+  if( stat(w.root, &st) || !S_ISDIR(st.st_mode) ){
+    ctx_errmsg(c, sqlite3_mprintf("%s is not a directory", w.root));
+    goto out;
+  }
+
+  w.journal = journal_open(c, journal_path);
+  if( !w.journal ) goto out;
+  lock_fd = open(journal_path, O_RDONLY|O_CLOEXEC);
+  if( lock_fd<0 || flock(lock_fd, LOCK_EX|LOCK_NB) ){
+    ctx_errmsg(c, sqlite3_mprintf("%s is already being kept by another watcher", journal_path));
+    goto out;
+  }
+  if( journal_prepare(c, w.journal, "INSERT INTO dirty(path, subtree) VALUES (?, ?)", &w.insert_dirty) ) goto out;
+
+  /* Nothing is known about the time before the watch is in place, and a
+  ** snapshot taken while a large tree is still being set up cannot trust
+  ** it either, so the whole root is marked before and after */
+  if( watch_mark_root(&w) ) goto out;
+  if( !watch_fanotify_start(&w) ){
+    w.inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if( w.inotify_fd<0 ){
+      ctx_errmsg(c, sqlite3_mprintf("inotify_init1 failed: %s", strerror(errno)));
+      goto out;
+    }
+    if( watch_add_tree(&w, w.root) ) goto out;
+  }
+  if( watch_mark_root(&w) ) goto out;
+
+  w.last_flush = ctx_now_ms();
+  while( !*stop ){
+    struct pollfd p;
+    p.fd = w.fanotify_fd>=0 ? w.fanotify_fd : w.inotify_fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    int ready = poll(&p, 1, WATCH_FLUSH_MS);
+    if( ready<0 && errno!=EINTR ){
+      ctx_errmsg(c, sqlite3_mprintf("poll failed: %s", strerror(errno)));
+      goto out;
+    }
+    if( ready>0 ){
+      int result = w.fanotify_fd>=0 ? watch_fanotify_read(&w, buf) : watch_inotify_read(&w, buf);
+      if( result<0 ) ctx_errmsg(c, sqlite3_mprintf("Reading change events failed: %s", strerror(errno)));
+      if( result ) goto out;
+    }
+    if( w.pending_count >= WATCH_FLUSH_PATHS
+     || (w.pending_count && ctx_now_ms() - w.last_flush >= WATCH_FLUSH_MS)
+    ){
+      if( watch_flush(&w) ) goto out;
+    }
+  }
+  err = watch_flush(&w);
+
+out:
+  for( i=0; i<w.pending_count; i++ ) free(w.pending[i].path);
+  free(w.pending);
+  for( i=0; i<w.wd_capacity; i++ ) free(w.wd_paths[i]);
+  free(w.wd_paths);
+  if( w.inotify_fd>=0 ) close(w.inotify_fd);
+  if( w.fanotify_fd>=0 ) close(w.fanotify_fd);
+  if( w.mount_fd>=0 ) close(w.mount_fd);
+  free(w.root_real);
+  free(w.last_handle);
+  free(w.last_dir);
+  sqlite3_finalize(w.insert_dirty);
+  if( w.journal ) journal_close(w.journal);
+  if( lock_fd>=0 ) close(lock_fd);
+  free(w.root);
+  free(buf);
+  return err;
+}
+#else
+int ctx_watch(ctx *c, const char *root, const char *journal_path, volatile int *stop){
+  ctx_errmsg(c, sqlite3_mprintf("Watching for changes needs Linux"));
+  return 1;
+}
+#endif